@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <new>
+#include <thread>
+#include "../proxymanager/proxymanager.h"
+#include "../proxymanager/udpshardgroup.h"
+#include "../proxymanager/socks5codec.h"
+#include "loopbackproxy.h"
+
+#define HANDSHAKE_COUNT     2000
+#define HANDSHAKE_RTT_COUNT 100     // with injected latency
+#define THROUGHPUT_BYTES    (512 * 1024 * 1024)
+#define THROUGHPUT_CHUNK    32768
+#define RTT_COUNT           20000
+#define UDP_DATAGRAM_COUNT  200000
+#define UDP_WINDOW          64
+#define UDP_PAYLOAD         512
+#define DST_IP              "127.0.0.1"
+#define DST_PORT            7
+#define CODEC_COUNT         10000000
+
+// mseconds of waiting for lost datagram, injected latency is added
+static uint32_t lossTimeout = 20;
+static uint32_t handshakeCount = HANDSHAKE_COUNT;
+// heap allocations of each thread, so threads of loopback proxy don`t disturb measured thread
+static thread_local uint64_t threadAllocations = 0;
+
+void* operator new(size_t size)
+{
+	threadAllocations++;
+	void* memory = malloc(size != 0 ? size : 1);
+	if (memory == 0)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+static uint64_t nowMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void printLatency(const char* name, const LatencyHistogram& histogram, uint32_t lost)
+{
+	Socks5::HistogramSnapshot snapshot = histogram.snapshot();
+	printf("%-36s p50 %6lu us  p99 %6lu us  max %6lu us  lost %u\n", name,
+		(unsigned long)snapshot.p50, (unsigned long)snapshot.p99, (unsigned long)snapshot.max, lost);
+}
+
+static void benchHandshakes(uint16_t port, const char* user, const char* password, const char* name,
+	bool bPipelined = false, bool bFastOpen = false)
+{
+	ProxyManager manager;
+	manager.setPipelinedHandshake(bPipelined, bFastOpen);
+	uint32_t failed = 0;
+	uint64_t start = nowMicros();
+	for (uint32_t i = 0; i < handshakeCount; i++)
+	{
+		if (!manager.connectToProxy("127.0.0.1", port, user, password, Socks5::PROXY_MODE::CONNECTION, DST_IP, DST_PORT))
+			failed++;
+		manager.closeConnection();
+	}
+	double seconds = (nowMicros() - start) / 1e6;
+	printf("%-36s %10.0f handshakes/s  %7.2f ms each  failed %u\n", name, handshakeCount / seconds,
+		seconds * 1000 / handshakeCount, failed);
+}
+
+static void benchConnectThroughput(uint16_t port)
+{
+	ProxyManager manager;
+	if (!manager.connectToProxy("127.0.0.1", port, "", "", Socks5::PROXY_MODE::CONNECTION, DST_IP, DST_PORT))
+	{
+		printf("CONNECT throughput: %s\n", ProxyManager::getErrorString(manager.lastErrorCode()).c_str());
+		return;
+	}
+
+	// echo is read by other thread, so both directions are loaded
+	uint64_t start = nowMicros();
+	std::thread reader([&manager]() {
+		char data[THROUGHPUT_CHUNK];
+		uint64_t received = 0;
+		while (received < THROUGHPUT_BYTES)
+		{
+			int32_t result = recv(manager.getTcpSocket(), data, sizeof(data), 0);
+			if (result <= 0)
+				break;
+			received += result;
+		}
+	});
+	static char chunk[THROUGHPUT_CHUNK];
+	uint64_t sent = 0;
+	while (sent < THROUGHPUT_BYTES)
+	{
+		int32_t result = manager.send(chunk, sizeof(chunk));
+		if (result <= 0)
+			break;
+		sent += result;
+	}
+	reader.join();
+	double seconds = (nowMicros() - start) / 1e6;
+	printf("%-36s %10.1f MB/s each direction\n", "CONNECT throughput", sent / seconds / (1024 * 1024));
+}
+
+static void benchTcpLatency(uint16_t port)
+{
+	ProxyManager manager;
+	if (!manager.connectToProxy("127.0.0.1", port, "", "", Socks5::PROXY_MODE::CONNECTION, DST_IP, DST_PORT))
+		return;
+
+	static LatencyHistogram histogram;
+	char data[64] = { 0 };
+	for (uint32_t i = 0; i < RTT_COUNT; i++)
+	{
+		uint64_t start = nowMicros();
+		if (manager.send(data, sizeof(data)) != sizeof(data))
+			break;
+		int32_t received = 0;
+		while (received < (int32_t)sizeof(data))
+		{
+			int32_t result = manager.read(data + received, sizeof(data) - received);
+			if (result <= 0)
+				break;
+			received += result;
+		}
+		histogram.record(nowMicros() - start);
+	}
+	printLatency("CONNECT round-trip 64 B", histogram, 0);
+}
+
+static bool connectUdp(ProxyManager* manager, uint16_t port, Socks5::UDP_BACKEND backend)
+{
+	if (!manager->connectToProxy("127.0.0.1", port, "", "", Socks5::PROXY_MODE::UDP_ASSOCIATE))
+		return false;
+	if (manager->setUdpBackend(backend, UDP_PAYLOAD + Socks5::UDP_HEADER_MAX) != backend)
+		return false;
+
+	// reading must not block when datagram is lost
+	int flags = fcntl(manager->getUdpSocket(), F_GETFL, 0);
+	fcntl(manager->getUdpSocket(), F_SETFL, flags | O_NONBLOCK);
+	return true;
+}
+
+static bool waitDatagram(ProxyManager* manager, uint64_t deadline)
+{
+	uint64_t now = nowMicros();
+	if (now >= deadline)
+		return false;
+	uint32_t waitMode = static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE);
+	manager->udpSocketWait(&waitMode, (deadline - now + 999) / 1000);
+	return true;
+}
+
+// datagrams are sent by windows, every window is drained before next one
+static uint32_t pumpUdpWindows(ProxyManager* manager, bool bBatch, uint32_t count, Socks5::UDPMessage* messages, char* payloads)
+{
+	uint32_t host = inet_addr(DST_IP);
+	uint32_t received = 0;
+	for (uint32_t sent = 0; sent < count; sent += UDP_WINDOW)
+	{
+		if (bBatch)
+		{
+			for (uint32_t i = 0; i < UDP_WINDOW; i++)
+			{
+				messages[i].data = payloads + i * UDP_PAYLOAD;
+				messages[i].dataLength = UDP_PAYLOAD;
+				messages[i].ulAddressIPv4 = host;
+				messages[i].usPort = DST_PORT;
+				messages[i].address.byteAddressType = 0;
+			}
+			manager->sendBatch(messages, UDP_WINDOW);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < UDP_WINDOW; i++)
+				manager->send(payloads + i * UDP_PAYLOAD, UDP_PAYLOAD, (int32_t)host, DST_PORT);
+		}
+
+		// lost datagrams are waited for lossTimeout
+		uint32_t windowReceived = 0;
+		uint64_t deadline = nowMicros() + lossTimeout * 1000;
+		while (windowReceived < UDP_WINDOW)
+		{
+			int32_t result;
+			if (bBatch)
+			{
+				for (uint32_t i = 0; i < UDP_WINDOW - windowReceived; i++)
+				{
+					messages[i].data = payloads + i * UDP_PAYLOAD;
+					messages[i].dataLength = UDP_PAYLOAD;
+				}
+				result = manager->readBatch(messages, UDP_WINDOW - windowReceived);
+			}
+			else result = manager->read(payloads + windowReceived * UDP_PAYLOAD, UDP_PAYLOAD) >= 0 ? 1 : -1;
+
+			if (result > 0)
+				windowReceived += result;
+			else if (!waitDatagram(manager, deadline))
+				break;
+		}
+		received += windowReceived;
+	}
+	return received;
+}
+
+static void benchUdpThroughput(uint16_t port, Socks5::UDP_BACKEND backend, bool bBatch, const char* name)
+{
+	ProxyManager manager;
+	if (!connectUdp(&manager, port, backend))
+	{
+		printf("%-36s unsupported\n", name);
+		return;
+	}
+
+	static char payloads[UDP_WINDOW * UDP_PAYLOAD];
+	Socks5::UDPMessage messages[UDP_WINDOW];
+	uint64_t start = nowMicros();
+	uint32_t received = pumpUdpWindows(&manager, bBatch, UDP_DATAGRAM_COUNT, messages, payloads);
+	double seconds = (nowMicros() - start) / 1e6;
+	printf("%-36s %10.0f pps round-trip  lost %u\n", name, received / seconds, UDP_DATAGRAM_COUNT - received);
+}
+
+static void benchUdpSharded(uint16_t port, uint32_t shardCount)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "UDP batch (%u shards)", shardCount);
+	UdpShardGroup group(shardCount);
+	if (!group.connect("127.0.0.1", port, "", ""))
+	{
+		printf("%-36s unsupported\n", name);
+		return;
+	}
+
+	// every pinned worker drives own association with its own buffers
+	std::atomic<uint32_t> received{ 0 };
+	uint32_t shardDatagrams = UDP_DATAGRAM_COUNT / shardCount / UDP_WINDOW * UDP_WINDOW;
+	uint64_t start = nowMicros();
+	group.start([&](Socks5::UdpShard* shard) {
+		int flags = fcntl(shard->manager.getUdpSocket(), F_GETFL, 0);
+		fcntl(shard->manager.getUdpSocket(), F_SETFL, flags | O_NONBLOCK);
+		received += pumpUdpWindows(&shard->manager, true, shardDatagrams, shard->messages, shard->buffers.get());
+	});
+	group.stop();
+	double seconds = (nowMicros() - start) / 1e6;
+	printf("%-36s %10.0f pps round-trip  lost %u\n", name, received / seconds, shardDatagrams * shardCount - received);
+}
+
+// regression test of buffer pool: steady-state UDP traffic must not allocate slabs or heap memory
+static bool benchUdpPooled(uint16_t port)
+{
+	const char* name = "UDP pooled buffers (syscall)";
+	ProxyManager manager;
+	if (!connectUdp(&manager, port, Socks5::UDP_BACKEND::SYSCALL))
+	{
+		printf("%-36s isn`t connected\n", name);
+		return false;
+	}
+
+	// received buffers are held by ring of handles as if they were handed to other threads
+	static PooledBuffer received[UDP_WINDOW];
+	Socks5::UDPDatagramView view;
+	uint32_t host = inet_addr(DST_IP);
+	uint32_t receivedCount = 0;
+	uint64_t slabAllocations = 0;
+	uint64_t heapAllocations = 0;
+	uint64_t start = 0;
+	for (uint32_t sent = 0; sent < UDP_DATAGRAM_COUNT + UDP_WINDOW; sent++)
+	{
+		if (sent == UDP_WINDOW)
+		{
+			// first window warms up pool
+			slabAllocations = BufferPool::global().getStats().slabAllocations;
+			heapAllocations = threadAllocations;
+			receivedCount = 0;
+			start = nowMicros();
+		}
+
+		PooledBuffer packet = BufferPool::global().acquire(Socks5::BUFFER_CLASS::MTU);
+		manager.sendWithHeadroom(packet.data(), UDP_PAYLOAD, (int32_t)host, DST_PORT);
+		uint64_t deadline = nowMicros() + lossTimeout * 1000;
+		PooledBuffer& slot = received[sent % UDP_WINDOW];
+		slot.reset();
+		bool bReceived = false;
+		while (!(bReceived = manager.readPooled(&slot, &view) >= 0) && waitDatagram(&manager, deadline));
+		if (bReceived)
+			receivedCount++;
+	}
+	heapAllocations = threadAllocations - heapAllocations;
+	double seconds = (nowMicros() - start) / 1e6;
+	slabAllocations = BufferPool::global().getStats().slabAllocations - slabAllocations;
+	printf("%-36s %10.0f pps round-trip  lost %u  slab allocations %lu  heap allocations %lu\n", name, receivedCount / seconds,
+		UDP_DATAGRAM_COUNT - receivedCount, (unsigned long)slabAllocations, (unsigned long)heapAllocations);
+	for (uint32_t i = 0; i < UDP_WINDOW; i++)
+		received[i].reset();
+
+	if (slabAllocations == 0 && heapAllocations == 0)
+		return true;
+	printf("FAILED: steady-state UDP traffic allocated memory after warm-up\n");
+	return false;
+}
+
+static void benchUdpLatency(uint16_t port, Socks5::UDP_BACKEND backend, const char* name)
+{
+	ProxyManager manager;
+	if (!connectUdp(&manager, port, backend))
+	{
+		printf("%-36s unsupported\n", name);
+		return;
+	}
+
+	static LatencyHistogram histograms[2];
+	LatencyHistogram& histogram = histograms[backend == Socks5::UDP_BACKEND::IO_URING ? 1 : 0];
+	char data[UDP_PAYLOAD] = { 0 };
+	uint32_t host = inet_addr(DST_IP);
+	uint32_t lost = 0;
+	for (uint32_t i = 0; i < RTT_COUNT; i++)
+	{
+		uint64_t start = nowMicros();
+		manager.send(data, 64, (int32_t)host, DST_PORT);
+		uint64_t deadline = start + lossTimeout * 1000;
+		bool bReceived = false;
+		while (!(bReceived = manager.read(data, sizeof(data)) >= 0) && waitDatagram(&manager, deadline));
+		if (bReceived)
+			histogram.record(nowMicros() - start);
+		else
+			lost++;
+	}
+	printLatency(name, histogram, lost);
+}
+
+static void benchCodec()
+{
+	// replies of every address type, parsed as they come from proxy
+	static const uint8_t replyIPv4[] = { 5, 0, 0, 1, 127, 0, 0, 1, 0x1F, 0x90 };
+	static const uint8_t replyDomain[] = { 5, 0, 0, 3, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm', 0, 80 };
+	static const uint8_t replyIPv6[] = { 5, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0x1F, 0x90 };
+	const uint8_t* replies[] = { replyIPv4, replyDomain, replyIPv6 };
+	const uint16_t replyLengths[] = { sizeof(replyIPv4), sizeof(replyDomain), sizeof(replyIPv6) };
+	const char* names[] = { "codec parse reply (IPv4)", "codec parse reply (domain)", "codec parse reply (IPv6)" };
+	// sum of parsed fields keeps loops from being optimized out
+	volatile uint32_t sink = 0;
+
+	for (uint32_t type = 0; type < 3; type++)
+	{
+		const uint8_t* volatile reply = replies[type];
+		uint64_t start = nowMicros();
+		uint32_t sum = 0;
+		for (uint32_t i = 0; i < CODEC_COUNT; i++)
+		{
+			Socks5::CommandReply parsed = Socks5::Codec::parseCommandReply({ reply, replyLengths[type] });
+			sum += parsed.length + parsed.bound.usPort;
+		}
+		sink = sink + sum;
+		printf("%-36s %8.1f ns/op\n", names[type], (double)(nowMicros() - start) * 1000 / CODEC_COUNT);
+	}
+
+	Socks5::Address address;
+	ProxyManager::makeAddress("example.com", 80, &address);
+	uint8_t request[Socks5::HANDSHAKE_BUFFER_SIZE];
+	uint64_t start = nowMicros();
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < CODEC_COUNT; i++)
+	{
+		address.usPort = (uint16_t)i;
+		sum += Socks5::Codec::encodeRequest(request, Socks5::PROXY_MODE::CONNECTION, address) + request[sizeof(request) - 1];
+	}
+	sink = sink + sum;
+	printf("%-36s %8.1f ns/op\n", "codec encode request (domain)", (double)(nowMicros() - start) * 1000 / CODEC_COUNT);
+
+	start = nowMicros();
+	sum = 0;
+	for (uint32_t i = 0; i < CODEC_COUNT; i++)
+	{
+		auto header = Socks5::Codec::encodeUdpHeaderIPv4(i, htons(DST_PORT));
+		Socks5::UDPHeader parsed = Socks5::Codec::parseUdpHeader(header);
+		sum += parsed.length + parsed.address.bytes[0];
+	}
+	sink = sink + sum;
+	printf("%-36s %8.1f ns/op\n\n", "codec UDP header IPv4 round-trip", (double)(nowMicros() - start) * 1000 / CODEC_COUNT);
+}
+
+int main(int argc, char** argv)
+{
+	Socks5::LoopbackConfig config = { "", "", 0, 0 };
+	if (argc > 1)
+		config.latency = atoi(argv[1]);
+	if (argc > 2)
+		config.udpLossPercent = atoi(argv[2]);
+	lossTimeout += config.latency * 2;
+	if (config.latency != 0)
+		handshakeCount = HANDSHAKE_RTT_COUNT;
+	printf("loopback proxy: latency %u ms, UDP loss %u%%\n\n", config.latency, config.udpLossPercent);
+
+	LoopbackProxy proxy(config);
+	config.user = "user";
+	config.password = "password";
+	LoopbackProxy authProxy(config);
+	if (!proxy.start() || !authProxy.start())
+	{
+		printf("Loopback proxy isn`t started\n");
+		return 1;
+	}
+
+	benchCodec();
+	benchHandshakes(proxy.getPort(), "", "", "handshake (no auth)");
+	benchHandshakes(authProxy.getPort(), "user", "password", "handshake (RFC1929)");
+	benchHandshakes(proxy.getPort(), "", "", "handshake (no auth, pipelined)", true);
+	benchHandshakes(authProxy.getPort(), "user", "password", "handshake (RFC1929, pipelined)", true);
+	benchHandshakes(authProxy.getPort(), "user", "password", "handshake (RFC1929, pipelined, TFO)", true, true);
+	benchConnectThroughput(proxy.getPort());
+	benchTcpLatency(proxy.getPort());
+	benchUdpThroughput(proxy.getPort(), Socks5::UDP_BACKEND::SYSCALL, false, "UDP per-datagram (syscall)");
+	benchUdpThroughput(proxy.getPort(), Socks5::UDP_BACKEND::SYSCALL, true, "UDP batch (syscall)");
+	benchUdpThroughput(proxy.getPort(), Socks5::UDP_BACKEND::IO_URING, false, "UDP per-datagram (io_uring)");
+	benchUdpThroughput(proxy.getPort(), Socks5::UDP_BACKEND::IO_URING, true, "UDP batch (io_uring)");
+	bool bPassed = benchUdpPooled(proxy.getPort());
+	for (uint32_t shardCount = 2; shardCount <= std::thread::hardware_concurrency() && shardCount <= 8; shardCount *= 2)
+		benchUdpSharded(proxy.getPort(), shardCount);
+	benchUdpLatency(proxy.getPort(), Socks5::UDP_BACKEND::SYSCALL, "UDP round-trip 64 B (syscall)");
+	benchUdpLatency(proxy.getPort(), Socks5::UDP_BACKEND::IO_URING, "UDP round-trip 64 B (io_uring)");
+
+	Socks5::MetricsSnapshot metrics = ProxyMetrics::global().snapshot();
+	const char* phaseNames[] = { "connect", "method", "auth", "command" };
+	printf("\n");
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::HANDSHAKE_PHASE::COUNT); i++)
+	{
+		printf("handshake phase %-20s p50 %6lu us  p99 %6lu us  count %lu\n", phaseNames[i],
+			(unsigned long)metrics.phases[i].p50, (unsigned long)metrics.phases[i].p99, (unsigned long)metrics.phases[i].count);
+	}
+
+	proxy.stop();
+	authProxy.stop();
+	return bPassed ? 0 : 1;
+}
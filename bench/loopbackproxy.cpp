@@ -0,0 +1,311 @@
+#include "loopbackproxy.h"
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <random>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// arrival time (in useconds) of requests, which are answered now. Every session has own thread
+static thread_local uint64_t flightArrival = 0;
+
+static uint64_t monotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+LoopbackProxy::~LoopbackProxy()
+{
+	stop();
+}
+
+bool LoopbackProxy::start(uint16_t port)
+{
+	stop();
+	stopEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (stopEvent < 0 || listenSocket < 0)
+	{
+		stop();
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	// data in SYN is accepted if kernel allows server side of TCP Fast Open
+	int fastOpenQueue = 256;
+	setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, &fastOpenQueue, sizeof(fastOpenQueue));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	socklen_t addrLength = sizeof(addr);
+	if (bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenSocket, 1024) != 0 ||
+		getsockname(listenSocket, (sockaddr*)&addr, &addrLength) != 0)
+	{
+		stop();
+		return false;
+	}
+	this->port = ntohs(addr.sin_port);
+	acceptThread = std::thread(&LoopbackProxy::acceptLoop, this);
+	return true;
+}
+
+void LoopbackProxy::stop()
+{
+	if (stopEvent >= 0)
+	{
+		uint64_t value = 1;
+		write(stopEvent, &value, sizeof(value));
+	}
+	if (acceptThread.joinable())
+		acceptThread.join();
+	{
+		// sessions see stop event and end
+		std::unique_lock<std::mutex> lock(sessionsMutex);
+		sessionsDone.wait(lock, [this] { return sessionCount == 0; });
+	}
+	if (listenSocket >= 0)
+	{
+		close(listenSocket);
+		listenSocket = -1;
+	}
+	if (stopEvent >= 0)
+	{
+		close(stopEvent);
+		stopEvent = -1;
+	}
+	port = 0;
+}
+
+int32_t LoopbackProxy::waitReadable(int fd, int fd2)
+{
+	struct pollfd pollFds[3];
+	pollFds[0].fd = stopEvent;
+	pollFds[1].fd = fd;
+	pollFds[2].fd = fd2;
+	pollFds[0].events = pollFds[1].events = pollFds[2].events = POLLIN;
+	pollFds[0].revents = pollFds[1].revents = pollFds[2].revents = 0;
+	if (poll(pollFds, fd2 >= 0 ? 3 : 2, -1) <= 0 || pollFds[0].revents != 0)
+		return -1;
+
+	int32_t result = 0;
+	if (pollFds[1].revents != 0)
+		result |= 1;
+	if (fd2 >= 0 && pollFds[2].revents != 0)
+		result |= 2;
+	return result;
+}
+
+void LoopbackProxy::injectLatency()
+{
+	if (config.latency != 0)
+		usleep(config.latency * 1000);
+}
+
+void LoopbackProxy::acceptLoop()
+{
+	while (waitReadable(listenSocket) > 0)
+	{
+		int fd = accept4(listenSocket, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		std::lock_guard<std::mutex> lock(sessionsMutex);
+		sessionCount++;
+		std::thread(&LoopbackProxy::serveSession, this, fd).detach();
+	}
+}
+
+void LoopbackProxy::serveSession(int fd)
+{
+	handshake(fd);
+	close(fd);
+
+	std::lock_guard<std::mutex> lock(sessionsMutex);
+	sessionCount--;
+	sessionsDone.notify_all();
+}
+
+bool LoopbackProxy::readFull(int fd, uint8_t* buffer, uint16_t length)
+{
+	uint16_t received = 0;
+	while (received < length)
+	{
+		if (waitReadable(fd) <= 0)
+			return false;
+		ssize_t result = recv(fd, buffer + received, length - received, 0);
+		if (result <= 0)
+			return false;
+		if (flightArrival == 0)
+			flightArrival = monotonicMicros();
+		received += result;
+	}
+	return true;
+}
+
+bool LoopbackProxy::writeReply(int fd, const uint8_t* buffer, uint16_t length)
+{
+	// latency is counted from arrival of request, so requests of one flight are answered after one delay
+	uint64_t deadline = flightArrival + config.latency * 1000;
+	uint64_t now = monotonicMicros();
+	if (config.latency != 0 && deadline > now)
+		usleep(deadline - now);
+
+	// queued bytes came with answered request, else next request comes after this reply
+	int queued = 0;
+	if (ioctl(fd, FIONREAD, &queued) != 0 || queued == 0)
+		flightArrival = 0;
+	return ::send(fd, buffer, length, MSG_NOSIGNAL) == length;
+}
+
+bool LoopbackProxy::handshake(int fd)
+{
+	uint8_t buffer[513];
+	if (!readFull(fd, buffer, 2) || buffer[0] != 5 || !readFull(fd, buffer + 2, buffer[1]))
+		return false;
+
+	uint8_t method = config.user.empty() ? 0 : 2;
+	bool bMethodOffered = false;
+	for (uint8_t i = 0; i < buffer[1]; i++)
+		bMethodOffered |= buffer[2 + i] == method;
+	uint8_t methodReply[2] = { 5, (uint8_t)(bMethodOffered ? method : 0xFF) };
+	if (!writeReply(fd, methodReply, 2) || !bMethodOffered)
+		return false;
+
+	if (method == 2)
+	{
+		// RFC1929: VER ULEN UNAME PLEN PASSWD
+		if (!readFull(fd, buffer, 2) || !readFull(fd, buffer + 2, buffer[1] + 1))
+			return false;
+		uint8_t userLength = buffer[1];
+		uint8_t passwordLength = buffer[2 + userLength];
+		if (!readFull(fd, buffer + 3 + userLength, passwordLength))
+			return false;
+		bool bValid = config.user == std::string((const char*)buffer + 2, userLength) &&
+			config.password == std::string((const char*)buffer + 3 + userLength, passwordLength);
+		uint8_t authReply[2] = { 1, (uint8_t)(bValid ? 0 : 1) };
+		if (!writeReply(fd, authReply, 2) || !bValid)
+			return false;
+	}
+
+	// VER CMD RSV ATYP DST.ADDR DST.PORT, destination is ignored
+	if (!readFull(fd, buffer, 4))
+		return false;
+	uint8_t command = buffer[1];
+	uint8_t* address = &buffer[4];
+	uint16_t addressLength;
+	if (buffer[3] == 1)
+		addressLength = 4;
+	else if (buffer[3] == 4)
+		addressLength = 16;
+	else if (buffer[3] == 3 && readFull(fd, &buffer[4], 1))
+	{
+		addressLength = buffer[4];
+		address = &buffer[5];
+	}
+	else
+		return false;
+	if (!readFull(fd, address, addressLength + 2))
+		return false;
+
+	uint8_t reply[10] = { 5, 0, 0, 1, 127, 0, 0, 1, 0, 0 };
+	if (command == 1)
+	{
+		if (!writeReply(fd, reply, sizeof(reply)))
+			return false;
+		echoConnection(fd);
+		return true;
+	}
+	else if (command == 3)
+	{
+		echoDatagrams(fd);
+		return true;
+	}
+	reply[1] = 7; // command not supported
+	writeReply(fd, reply, sizeof(reply));
+	return false;
+}
+
+void LoopbackProxy::echoConnection(int fd)
+{
+	char data[65536];
+	while (waitReadable(fd) > 0)
+	{
+		ssize_t received = recv(fd, data, sizeof(data), 0);
+		if (received <= 0)
+			return;
+		injectLatency();
+		ssize_t sent = 0;
+		while (sent < received)
+		{
+			ssize_t result = ::send(fd, data + sent, received - sent, MSG_NOSIGNAL);
+			if (result <= 0)
+				return;
+			sent += result;
+		}
+	}
+}
+
+void LoopbackProxy::echoDatagrams(int fd)
+{
+	int udpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (udpSocket < 0)
+		return;
+
+	int bufferSize = 4 * 1024 * 1024;
+	setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	setsockopt(udpSocket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrLength = sizeof(addr);
+	uint8_t reply[10] = { 5, 0, 0, 1, 127, 0, 0, 1, 0, 0 };
+	if (bind(udpSocket, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+		getsockname(udpSocket, (sockaddr*)&addr, &addrLength) != 0)
+	{
+		reply[1] = 1; // general failure
+		writeReply(fd, reply, sizeof(reply));
+		close(udpSocket);
+		return;
+	}
+	memcpy(&reply[8], &addr.sin_port, 2);
+	if (!writeReply(fd, reply, sizeof(reply)))
+	{
+		close(udpSocket);
+		return;
+	}
+
+	std::minstd_rand random(fd);
+	char data[65536];
+	int32_t ready;
+	// association lives while control connection is opened
+	while ((ready = waitReadable(fd, udpSocket)) > 0)
+	{
+		if (ready & 1)
+		{
+			if (recv(fd, data, sizeof(data), 0) <= 0)
+				break;
+		}
+		if (ready & 2)
+		{
+			struct sockaddr_storage source;
+			socklen_t sourceLength = sizeof(source);
+			ssize_t received = recvfrom(udpSocket, data, sizeof(data), 0, (sockaddr*)&source, &sourceLength);
+			if (received <= 0 || (config.udpLossPercent != 0 && random() % 100 < config.udpLossPercent))
+				continue;
+			injectLatency();
+			sendto(udpSocket, data, received, 0, (sockaddr*)&source, sourceLength);
+		}
+	}
+	close(udpSocket);
+}
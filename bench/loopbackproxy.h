@@ -0,0 +1,78 @@
+/******************************************************************************
+ * File: loopbackproxy.h
+ * Description: Loopback SOCKS5 server stand-in for benchmarks of socks5-client.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef LOOPBACKPROXY_H
+#define LOOPBACKPROXY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Socks5
+{
+    struct LoopbackConfig
+    {
+        std::string user;           // RFC1929 auth is required if user isn`t empty
+        std::string password;
+        uint32_t    latency;        // mseconds between arrival of request and its reply, added before every echo
+        uint32_t    udpLossPercent; // part of UDP datagrams which are dropped
+    };
+}
+
+/**
+ * @class LoopbackProxy
+ * SOCKS5 server on 127.0.0.1 with CONNECT and UDP_ASSOCIATE commands. Server is destination itself:
+ * data of CONNECT is echoed back to client, UDP datagrams are echoed back with the same header.
+ * Every session is served by own thread.
+ */
+class LoopbackProxy
+{
+public:
+    LoopbackProxy(Socks5::LoopbackConfig config) : config(config) {}
+    ~LoopbackProxy();
+    LoopbackProxy(const LoopbackProxy&) = delete;
+    LoopbackProxy& operator=(const LoopbackProxy&) = delete;
+    /**
+     * Start listening.
+     * @param port TCP port, 0 for any free port.
+     * @return true if successful.
+     */
+    bool start(uint16_t port = 0);
+    /**
+     * Stop listening and wait for end of all sessions.
+     */
+    void stop();
+    /**
+     * Gets listening port.
+     * @return port in host byte order.
+     */
+    uint16_t getPort() { return port; }
+
+private:
+    void acceptLoop();
+    void serveSession(int fd);
+    bool handshake(int fd);
+    void echoConnection(int fd);
+    void echoDatagrams(int fd);
+    bool readFull(int fd, uint8_t* buffer, uint16_t length);
+    bool writeReply(int fd, const uint8_t* buffer, uint16_t length);
+    int32_t waitReadable(int fd, int fd2 = -1);
+    void injectLatency();
+
+    Socks5::LoopbackConfig config;
+    int listenSocket = -1;
+    int stopEvent = -1;
+    uint16_t port = 0;
+    std::thread acceptThread;
+    std::mutex sessionsMutex;
+    std::condition_variable sessionsDone;
+    uint32_t sessionCount = 0;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../proxymanager/sharedudpassociation.h"
+#include "loopbackproxy.h"
+
+#define STRESS_ROUNDS       5
+#define STRESS_SENDERS      8
+#define STRESS_READERS      2
+#define STRESS_DURATION     300     // mseconds of traffic before close
+#define STRESS_PAYLOAD      64
+#define STRESS_BATCH        8
+#define DST_IP              "127.0.0.1"
+#define DST_PORT            7
+
+struct StressCounters
+{
+	std::atomic<uint64_t> sent{ 0 };
+	std::atomic<uint64_t> received{ 0 };
+	std::atomic<uint32_t> closedThreads{ 0 };
+};
+
+// senders alternate single sends and batches until close() fails them
+static void sendLoop(SharedUdpAssociation* association, StressCounters* counters)
+{
+	char payload[STRESS_PAYLOAD] = "stress";
+	Socks5::UDPMessage messages[STRESS_BATCH] = {};
+	for (Socks5::UDPMessage& message : messages)
+	{
+		message.data = payload;
+		message.dataLength = sizeof(payload);
+		message.ulAddressIPv4 = inet_addr(DST_IP);
+		message.usPort = DST_PORT;
+	}
+
+	for (uint32_t i = 0; ; i++)
+	{
+		int32_t result = (i & 1) != 0 ? association->send(payload, sizeof(payload), inet_addr(DST_IP), DST_PORT) :
+			association->sendBatch(messages, STRESS_BATCH);
+		if (result >= 0)
+			counters->sent.fetch_add((i & 1) != 0 ? 1 : result, std::memory_order_relaxed);
+		else if (SharedUdpAssociation::lastErrorCode() == Socks5::PROXY_ERROR::CONNECTION)
+			break;
+	}
+	counters->closedThreads.fetch_add(1);
+}
+
+// readers wait and read echoed datagrams until close() wakes and fails them
+static void readLoop(SharedUdpAssociation* association, StressCounters* counters)
+{
+	char buffer[2048];
+	Socks5::UDPDatagramView view;
+	while (true)
+	{
+		uint32_t waitMode = static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE);
+		int32_t result = association->wait(&waitMode, 100);
+		if (result >= 0 && waitMode != 0)
+			result = association->readView(buffer, sizeof(buffer), &view);
+		if (result > 0)
+			counters->received.fetch_add(1, std::memory_order_relaxed);
+		else if (result < 0 && SharedUdpAssociation::lastErrorCode() == Socks5::PROXY_ERROR::CONNECTION)
+			break;
+	}
+	counters->closedThreads.fetch_add(1);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t rounds = argc > 1 ? atoi(argv[1]) : STRESS_ROUNDS;
+	Socks5::LoopbackConfig config = { "", "", 0, 0 };
+	LoopbackProxy proxy(config);
+	if (!proxy.start())
+	{
+		printf("Loopback proxy isn`t started\n");
+		return 1;
+	}
+
+	// association is closed under load, so close() races with sends, reads and waits in progress
+	bool bPassed = true;
+	for (uint32_t round = 0; round < rounds; round++)
+	{
+		SharedUdpAssociation association;
+		if (!association.connect("127.0.0.1", proxy.getPort(), "", ""))
+		{
+			printf("round %u: association isn`t created\n", round);
+			bPassed = false;
+			break;
+		}
+
+		StressCounters counters;
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0; i < STRESS_SENDERS; i++)
+			threads.emplace_back(sendLoop, &association, &counters);
+		for (uint32_t i = 0; i < STRESS_READERS; i++)
+			threads.emplace_back(readLoop, &association, &counters);
+		std::this_thread::sleep_for(std::chrono::milliseconds(STRESS_DURATION));
+		association.close();
+		for (std::thread& thread : threads)
+			thread.join();
+
+		printf("round %u: sent %lu, received %lu, stopped threads %u\n", round, (unsigned long)counters.sent.load(),
+			(unsigned long)counters.received.load(), counters.closedThreads.load());
+		if (counters.sent.load() == 0 || counters.received.load() == 0)
+			bPassed = false;
+	}
+
+	proxy.stop();
+	printf(bPassed ? "shared UDP association stress: passed\n" : "shared UDP association stress: FAILED\n");
+	return bPassed ? 0 : 1;
+}
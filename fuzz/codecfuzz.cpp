@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include "../proxymanager/socks5codec.h"
+
+// standalone driver runs this count of random inputs, libFuzzer (-DSOCKS5_LIBFUZZER) drives inputs itself
+#define FUZZ_ITERATIONS     2000000
+#define FUZZ_INPUT_MAX      300
+
+static void fail(const char* check)
+{
+	fprintf(stderr, "codec fuzz: %s\n", check);
+	abort();
+}
+
+// parsed address must lie inside of input and be encoded back to the same bytes
+static void checkAddress(const Socks5::AddressView& view, const uint8_t* in, size_t size)
+{
+	if (view.status != Socks5::PARSE_STATUS::OK)
+		return;
+	if (view.bytes < in || view.bytes + view.byteLength > in + size || view.length > size)
+		fail("parsed address is outside of input");
+
+	Socks5::Address address;
+	Socks5::Codec::copyAddress(view, &address);
+	// output is allocated with exact length, so write past it is reported by sanitizer
+	std::unique_ptr<uint8_t[]> out(new uint8_t[view.length]);
+	uint16_t length = Socks5::Codec::encodeAddress({ out.get(), view.length }, address);
+	if (length != view.length || memcmp(out.get(), view.bytes - (view.byteAddressType == 3 ? 2 : 1), length) != 0)
+		fail("encoded address differs from parsed one");
+	if (Socks5::Codec::encodeAddress({ out.get(), (size_t)view.length - 1 }, address) != 0)
+		fail("address is encoded into too short buffer");
+}
+
+// address of caller can have any fields, encodeAddress must not write past output
+static void checkEncode(const uint8_t* data, size_t size)
+{
+	if (size < 3)
+		return;
+	Socks5::Address address;
+	memset(&address, 0, sizeof(address));
+	address.byteAddressType = data[0];
+	address.byteLength = data[1];
+	size_t outSize = data[2];
+	memcpy(address.bytes, data + 3, size - 3 < sizeof(address.bytes) ? size - 3 : sizeof(address.bytes));
+
+	std::unique_ptr<uint8_t[]> out(new uint8_t[outSize + 1]);
+	uint16_t length = Socks5::Codec::encodeAddress({ out.get(), outSize }, address);
+	if (length > outSize)
+		fail("encoded length is bigger than buffer");
+	if (length == 0)
+		return;
+	Socks5::AddressView view = Socks5::Codec::parseAddress({ out.get(), length });
+	if (view.status != Socks5::PARSE_STATUS::OK || view.length != length || view.byteLength != address.byteLength ||
+		view.usPort != address.usPort || memcmp(view.bytes, address.bytes, view.byteLength) != 0)
+		fail("parsed address differs from encoded one");
+}
+
+// error reply is taken by its code, whatever address follows it (servers often send zero or short address)
+static void checkErrorReply(const Socks5::CommandReply& reply, const uint8_t* in, size_t size)
+{
+	if (size < 5 || in[0] != 0x05 || in[1] == 0x00)
+		return;
+	if (reply.status != Socks5::PARSE_STATUS::OK || reply.reply != in[1] || reply.length > size)
+		fail("error reply isn`t parsed");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	// input is copied to own allocation, so read past it is reported by sanitizer
+	std::unique_ptr<uint8_t[]> in(new uint8_t[size]);
+	memcpy(in.get(), data, size);
+
+	Socks5::CommandReply reply = Socks5::Codec::parseCommandReply({ in.get(), size });
+	if (reply.status == Socks5::PARSE_STATUS::OK)
+	{
+		if (reply.length > size)
+			fail("command reply is longer than input");
+		checkAddress(reply.bound, in.get(), size);
+	}
+	checkErrorReply(reply, in.get(), size);
+
+	Socks5::UDPHeader header = Socks5::Codec::parseUdpHeader({ in.get(), size });
+	if (header.status == Socks5::PARSE_STATUS::OK)
+	{
+		if (header.length > size)
+			fail("UDP header is longer than input");
+		checkAddress(header.address, in.get(), size);
+	}
+
+	checkEncode(in.get(), size);
+	return 0;
+}
+
+#ifndef SOCKS5_LIBFUZZER
+int main(int argc, char** argv)
+{
+	uint32_t iterations = argc > 1 ? atoi(argv[1]) : FUZZ_ITERATIONS;
+	uint32_t seed = argc > 2 ? atoi(argv[2]) : 1;
+	srand(seed);
+
+	// error replies with unknown address type, short IPv4 address and short domain name
+	static const uint8_t errorReplies[][5] = { { 0x05, 0x04, 0x00, 0x00, 0x00 }, { 0x05, 0x05, 0x00, 0x01, 0x00 },
+		{ 0x05, 0x01, 0x00, 0x03, 0xFF } };
+	for (const uint8_t* errorReply : errorReplies)
+		LLVMFuzzerTestOneInput(errorReply, sizeof(errorReplies[0]));
+
+	// random bytes rarely make valid message, so half of inputs start with valid version and address type
+	uint8_t input[FUZZ_INPUT_MAX];
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		size_t size = rand() % sizeof(input);
+		for (size_t j = 0; j < size; j++)
+			input[j] = rand();
+		if (size > 3 && (rand() & 1) != 0)
+		{
+			static const uint8_t types[] = { 1, 3, 4 };
+			input[0] = 0x05;
+			input[3] = types[rand() % 3];
+			if (input[3] == 3 && size > 4)
+				input[4] = rand() % (size - 4);
+		}
+		LLVMFuzzerTestOneInput(input, size);
+	}
+	printf("codec fuzz: %u inputs, seed %u, no failures\n", iterations, seed);
+	return 0;
+}
+#endif
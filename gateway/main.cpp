@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "socks5gateway.h"
+
+#define DEFAULT_LISTEN_IP           "127.0.0.1"
+#define DEFAULT_MIN_ASSOCIATIONS    1
+#define DEFAULT_MAX_ASSOCIATIONS    4
+#define DEFAULT_FLOW_TIMEOUT        60000
+#define DEFAULT_HANDSHAKE_TIMEOUT   5000
+#define DEFAULT_TCP_STANDBY         4
+
+static Socks5Gateway* runningGateway = 0;
+
+static void onSignal(int)
+{
+	if (runningGateway != 0)
+		runningGateway->stop();
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s -p proxy:port [-a user:password] [-u port:host:port]... [-t port:host:port]... [-r port]...\n"
+		"    [-l listen IP] [-n min associations] [-m max associations] [-i flow timeout ms] [-s TCP standby]\n"
+		"  -u  datagrams to local port are forwarded to host:port through shared UDP association\n"
+		"  -t  connections to local port are forwarded to host:port by CONNECT\n"
+		"  -r  connections redirected to local port by iptables REDIRECT are forwarded to their original destination\n", name);
+}
+
+// "host:port", host can contain ':' (IPv6)
+static bool splitHostPort(std::string text, std::string* host, uint16_t* port)
+{
+	size_t colon = text.rfind(':');
+	if (colon == std::string::npos || colon == 0)
+		return false;
+	*host = text.substr(0, colon);
+	*port = atoi(text.c_str() + colon + 1);
+	return *port != 0;
+}
+
+static bool parseRule(Socks5::GATEWAY_RULE type, std::string text, Socks5::GatewayRule* rule)
+{
+	rule->type = type;
+	rule->dstPort = 0;
+	size_t colon = text.find(':');
+	rule->localPort = atoi(text.substr(0, colon).c_str());
+	if (rule->localPort == 0)
+		return false;
+	if (type == Socks5::GATEWAY_RULE::TCP_REDIRECT)
+		return colon == std::string::npos;
+	return colon != std::string::npos && splitHostPort(text.substr(colon + 1), &rule->dstHost, &rule->dstPort);
+}
+
+int main(int argc, char** argv)
+{
+	Socks5::GatewayConfig config;
+	config.proxy.port = 0;
+	config.listenIP = DEFAULT_LISTEN_IP;
+	config.minAssociations = DEFAULT_MIN_ASSOCIATIONS;
+	config.maxAssociations = DEFAULT_MAX_ASSOCIATIONS;
+	config.flowTimeout = DEFAULT_FLOW_TIMEOUT;
+	config.handshakeTimeout = DEFAULT_HANDSHAKE_TIMEOUT;
+	config.tcpStandby = DEFAULT_TCP_STANDBY;
+
+	int option;
+	while ((option = getopt(argc, argv, "p:a:u:t:r:l:n:m:i:s:h")) != -1)
+	{
+		Socks5::GatewayRule rule;
+		bool bValid = true;
+		switch (option)
+		{
+		case 'p':
+			bValid = splitHostPort(optarg, &config.proxy.ip, &config.proxy.port);
+			break;
+		case 'a':
+		{
+			std::string credentials = optarg;
+			size_t colon = credentials.find(':');
+			bValid = colon != std::string::npos;
+			if (bValid)
+			{
+				config.proxy.user = credentials.substr(0, colon);
+				config.proxy.password = credentials.substr(colon + 1);
+			}
+			break;
+		}
+		case 'u':
+		case 't':
+		case 'r':
+		{
+			Socks5::GATEWAY_RULE type = option == 'u' ? Socks5::GATEWAY_RULE::UDP :
+				(option == 't' ? Socks5::GATEWAY_RULE::TCP : Socks5::GATEWAY_RULE::TCP_REDIRECT);
+			bValid = parseRule(type, optarg, &rule);
+			if (bValid)
+				config.rules.push_back(rule);
+			break;
+		}
+		case 'l': config.listenIP = optarg; break;
+		case 'n': config.minAssociations = atoi(optarg); break;
+		case 'm': config.maxAssociations = atoi(optarg); break;
+		case 'i': config.flowTimeout = atoi(optarg); break;
+		case 's': config.tcpStandby = atoi(optarg); break;
+		default:
+			bValid = false;
+			break;
+		}
+		if (!bValid)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (config.proxy.port == 0 || config.rules.empty())
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	Socks5Gateway gateway(config);
+	if (!gateway.start())
+		return 1;
+
+	runningGateway = &gateway;
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("socks5-gateway was started, proxy %s:%u, %zu rules\n", config.proxy.ip.c_str(), config.proxy.port, config.rules.size());
+	gateway.run();
+	runningGateway = 0;
+
+	Socks5::GatewayStats stats = gateway.getStats();
+	printf("UDP flows %lu, datagrams to proxy %lu, from proxy %lu, dropped %lu, rejected flows %lu, reassociations %lu\n",
+		(unsigned long)stats.udpFlows, (unsigned long)stats.datagramsToProxy, (unsigned long)stats.datagramsFromProxy,
+		(unsigned long)stats.droppedDatagrams, (unsigned long)stats.rejectedFlows, (unsigned long)stats.reassociations);
+	printf("TCP flows %lu, failed connects %lu\n", (unsigned long)stats.tcpFlows, (unsigned long)stats.failedConnects);
+	return 0;
+}
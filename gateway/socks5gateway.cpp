@@ -0,0 +1,611 @@
+#include "socks5gateway.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/netfilter_ipv4.h>
+#include <algorithm>
+#include "../proxymanager/resolvercache.h"
+
+static uint64_t gatewayTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool Socks5Gateway::FlowKey::operator==(const FlowKey& other) const
+{
+	return port == other.port && rule == other.rule && memcmp(address, other.address, sizeof(address)) == 0;
+}
+
+size_t Socks5Gateway::FlowKeyHash::operator()(const FlowKey& key) const
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	const uint8_t* bytes = (const uint8_t*)&key;
+	for (size_t i = 0; i < sizeof(FlowKey); i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return (size_t)hash;
+}
+
+Socks5Gateway::Socks5Gateway(Socks5::GatewayConfig config) : config(config)
+{
+	if (this->config.maxAssociations == 0)
+		this->config.maxAssociations = 1;
+	if (this->config.minAssociations > this->config.maxAssociations)
+		this->config.minAssociations = this->config.maxAssociations;
+	associations.resize(this->config.maxAssociations);
+
+	inBuffers.resize(Socks5::GATEWAY_BATCH * Socks5::GATEWAY_DATAGRAM_SIZE);
+	inMessages.resize(Socks5::GATEWAY_BATCH);
+	inIov.resize(Socks5::GATEWAY_BATCH);
+	inNames.resize(Socks5::GATEWAY_BATCH);
+	outMessages.resize(Socks5::GATEWAY_BATCH);
+}
+
+Socks5Gateway::~Socks5Gateway()
+{
+	for (uint32_t i = 0; i < associations.size(); i++)
+		closeAssociation(i);
+
+	{
+		// relay of every flow is finished by shutdown of its sockets
+		std::lock_guard<std::mutex> lock(tcpMutex);
+		for (auto& flow : tcpFlows)
+		{
+			shutdown(flow->localFd, SHUT_RDWR);
+			if (flow->proxyFd >= 0)
+				shutdown(flow->proxyFd, SHUT_RDWR);
+		}
+	}
+	for (auto& flow : tcpFlows)
+		flow->thread.join();
+
+	for (Listener& listener : listeners)
+	{
+		if (listener.fd >= 0)
+		{
+			loop.removeFd(listener.fd);
+			close(listener.fd);
+		}
+	}
+}
+
+bool Socks5Gateway::start()
+{
+	if (!loop.isValid())
+	{
+		printf("epoll instance isn`t created: %s\n", strerror(errno));
+		return false;
+	}
+
+	bool bTcp = false;
+	for (uint32_t i = 0; i < config.rules.size(); i++)
+	{
+		if (!openListener(i))
+			return false;
+		if (config.rules[i].type != Socks5::GATEWAY_RULE::UDP)
+			bTcp = true;
+	}
+
+	if (bTcp)
+	{
+		pool = std::make_unique<ProxyConnectionPool>(config.proxy.ip, config.proxy.port, config.proxy.user,
+			config.proxy.password, config.tcpStandby, config.flowTimeout);
+		pool->setHandshakeTimeout(config.handshakeTimeout);
+	}
+
+	for (uint32_t i = 0; i < config.minAssociations; i++)
+		openAssociation(i);
+	loop.addTimer(Socks5::GATEWAY_SWEEP_INTERVAL, [this]() { sweep(); });
+	return true;
+}
+
+void Socks5Gateway::run()
+{
+	loop.run();
+}
+
+Socks5::GatewayStats Socks5Gateway::getStats()
+{
+	Socks5::GatewayStats stats;
+	memset(&stats, 0, sizeof(stats));
+	stats.udpFlows = flows.size();
+	for (Association& association : associations)
+	{
+		if (association.state == ASSOCIATION_STATE::READY)
+			stats.associations++;
+	}
+	{
+		std::lock_guard<std::mutex> lock(tcpMutex);
+		for (auto& flow : tcpFlows)
+		{
+			if (!flow->bDone.load())
+				stats.tcpFlows++;
+		}
+	}
+	stats.reassociations = reassociations;
+	stats.datagramsToProxy = datagramsToProxy;
+	stats.datagramsFromProxy = datagramsFromProxy;
+	stats.droppedDatagrams = droppedDatagrams;
+	stats.rejectedFlows = rejectedFlows;
+	stats.failedConnects = failedConnects.load();
+	return stats;
+}
+
+bool Socks5Gateway::openListener(uint32_t ruleIndex)
+{
+	const Socks5::GatewayRule& rule = config.rules[ruleIndex];
+	Listener listener;
+	listener.rule = ruleIndex;
+
+	if (rule.type == Socks5::GATEWAY_RULE::UDP)
+	{
+		// replies are matched with flows by their source, which is IP address, so domain name is resolved once here
+		sockaddr_storage dst;
+		socklen_t dstLength;
+		if (!ResolverCache::global().resolve(rule.dstHost, rule.dstPort, &dst, &dstLength) ||
+			(dst.ss_family != AF_INET && dst.ss_family != AF_INET6))
+		{
+			printf("UDP destination %s isn`t resolved\n", rule.dstHost.c_str());
+			return false;
+		}
+		if (dst.ss_family == AF_INET)
+		{
+			listener.dst.byteAddressType = 1;
+			listener.dst.byteLength = 4;
+			memcpy(listener.dst.bytes, &((struct sockaddr_in*)&dst)->sin_addr, 4);
+		}
+		else
+		{
+			listener.dst.byteAddressType = 4;
+			listener.dst.byteLength = 16;
+			memcpy(listener.dst.bytes, &((struct sockaddr_in6*)&dst)->sin6_addr, 16);
+		}
+		listener.dst.usPort = htons(rule.dstPort);
+		listener.replies.reserve(Socks5::GATEWAY_BATCH);
+		listener.replyIov.reserve(Socks5::GATEWAY_BATCH);
+	}
+
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(rule.localPort);
+	if (inet_pton(AF_INET, config.listenIP.c_str(), &local.sin_addr) != 1)
+	{
+		printf("Invalid listen address %s\n", config.listenIP.c_str());
+		return false;
+	}
+
+	int type = rule.type == Socks5::GATEWAY_RULE::UDP ? SOCK_DGRAM : SOCK_STREAM;
+	listener.fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int reuse = 1;
+	if (listener.fd < 0 ||
+		setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+		bind(listener.fd, (struct sockaddr*)&local, sizeof(local)) != 0 ||
+		(type == SOCK_STREAM && listen(listener.fd, SOMAXCONN) != 0))
+	{
+		printf("Port %u isn`t opened: %s\n", rule.localPort, strerror(errno));
+		if (listener.fd >= 0)
+			close(listener.fd);
+		return false;
+	}
+
+	listeners.push_back(std::move(listener));
+	uint32_t index = listeners.size() - 1;
+	bool bAdded = loop.addFd(listeners[index].fd, static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ), [this, index](uint32_t)
+	{
+		if (config.rules[listeners[index].rule].type == Socks5::GATEWAY_RULE::UDP)
+			readListener(listeners[index]);
+		else acceptTcp(listeners[index]);
+	});
+	if (!bAdded)
+		printf("Port %u isn`t watched\n", rule.localPort);
+	return bAdded;
+}
+
+void Socks5Gateway::readListener(Listener& listener)
+{
+	int32_t received;
+	do
+	{
+		for (uint32_t i = 0; i < Socks5::GATEWAY_BATCH; i++)
+		{
+			inIov[i].iov_base = &inBuffers[i * Socks5::GATEWAY_DATAGRAM_SIZE];
+			inIov[i].iov_len = Socks5::GATEWAY_DATAGRAM_SIZE;
+			memset(&inMessages[i], 0, sizeof(struct mmsghdr));
+			inMessages[i].msg_hdr.msg_iov = &inIov[i];
+			inMessages[i].msg_hdr.msg_iovlen = 1;
+			inMessages[i].msg_hdr.msg_name = &inNames[i];
+			inMessages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+		}
+		received = recvmmsg(listener.fd, inMessages.data(), Socks5::GATEWAY_BATCH, MSG_DONTWAIT, NULL);
+		if (received <= 0)
+			break;
+
+		// datagrams are grouped by association, every group is sent by one sendmmsg
+		uint64_t now = gatewayTime();
+		for (int32_t i = 0; i < received; i++)
+		{
+			UdpFlow* flow = findFlow(listener, inNames[i], inMessages[i].msg_hdr.msg_namelen, now);
+			if (flow == 0)
+			{
+				droppedDatagrams++;
+				continue;
+			}
+
+			flow->lastActive = now;
+			Association& association = associations[flow->association];
+			if (association.state == ASSOCIATION_STATE::READY)
+			{
+				Socks5::UDPMessage message = { (char*)inIov[i].iov_base, (uint16_t)inMessages[i].msg_len, 0, 0, 0, listener.dst };
+				association.outgoing.push_back(message);
+			}
+			else if (association.pending.size() < Socks5::GATEWAY_PENDING_MAX)
+			{
+				PendingDatagram datagram = { listener.rule, std::string((char*)inIov[i].iov_base, inMessages[i].msg_len) };
+				association.pending.push_back(std::move(datagram));
+			}
+			else droppedDatagrams++;
+		}
+
+		for (Association& association : associations)
+		{
+			if (association.outgoing.empty())
+				continue;
+			int32_t sent = association.session->manager().sendBatch(association.outgoing.data(), association.outgoing.size());
+			if (sent < 0)
+				sent = 0;
+			datagramsToProxy += sent;
+			droppedDatagrams += association.outgoing.size() - sent;
+			association.outgoing.clear();
+		}
+	} while (received == (int32_t)Socks5::GATEWAY_BATCH);
+}
+
+Socks5Gateway::UdpFlow* Socks5Gateway::findFlow(Listener& listener, const sockaddr_storage& client, socklen_t clientLength, uint64_t now)
+{
+	FlowKey key;
+	memset(&key, 0, sizeof(key));
+	key.rule = listener.rule;
+	if (client.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* address = (const struct sockaddr_in*)&client;
+		memcpy(key.address, &address->sin_addr, 4);
+		key.port = address->sin_port;
+	}
+	else return 0;
+
+	auto found = flows.find(key);
+	if (found != flows.end())
+		return &found->second;
+
+	FlowKey remote = remoteKey(listener.dst);
+	int32_t index = flows.size() < Socks5::GATEWAY_FLOW_MAX ? chooseAssociation(remote) : -1;
+	if (index < 0)
+	{
+		rejectedFlows++;
+		return 0;
+	}
+
+	UdpFlow& flow = flows[key];
+	memcpy(&flow.client, &client, clientLength);
+	flow.clientLength = clientLength;
+	flow.rule = listener.rule;
+	flow.association = index;
+	flow.lastActive = now;
+	associations[index].remotes[remote] = &flow;
+	return &flow;
+}
+
+int32_t Socks5Gateway::chooseAssociation(const FlowKey& remote)
+{
+	// the least loaded open association, which doesn`t have flow to this destination
+	int32_t best = -1;
+	int32_t closed = -1;
+	for (uint32_t i = 0; i < associations.size(); i++)
+	{
+		Association& association = associations[i];
+		if (association.state == ASSOCIATION_STATE::CLOSED)
+		{
+			if (closed < 0 && isIdle(association))
+				closed = i;
+			continue;
+		}
+		if (association.remotes.count(remote) != 0)
+			continue;
+		if (best < 0 || association.remotes.size() < associations[best].remotes.size())
+			best = i;
+	}
+
+	if (best < 0 && closed >= 0)
+	{
+		openAssociation(closed);
+		best = closed;
+	}
+	return best;
+}
+
+void Socks5Gateway::openAssociation(uint32_t index)
+{
+	Association& association = associations[index];
+	association.retryTimer = 0;
+	if (!association.session)
+	{
+		association.session = std::make_unique<AsyncProxyManager>(loop);
+		association.session->manager().setHandshakeTimeout(config.handshakeTimeout);
+	}
+	association.state = ASSOCIATION_STATE::CONNECTING;
+	association.task = std::make_unique<Socks5::Task<void>>(establish(index));
+	association.task->start();
+}
+
+Socks5::Task<void> Socks5Gateway::establish(uint32_t index)
+{
+	Association& association = associations[index];
+	ProxyManager& manager = association.session->manager();
+	bool bConnected = co_await association.session->connectAsync(config.proxy.ip, config.proxy.port,
+		config.proxy.user, config.proxy.password, Socks5::PROXY_MODE::UDP_ASSOCIATE);
+	if (association.state != ASSOCIATION_STATE::CONNECTING)
+	{
+		// closed while connecting
+		manager.closeConnection();
+		co_return;
+	}
+
+	if (bConnected)
+	{
+		// relay socket is drained in loop, so it must not block
+		fcntl(manager.getUdpSocket(), F_SETFL, fcntl(manager.getUdpSocket(), F_GETFL, 0) | O_NONBLOCK);
+		Socks5::SessionCallbacks callbacks;
+		callbacks.onReadable = [this, index](ProxyManager*) { readAssociation(index); };
+		callbacks.onError = [this, index](ProxyManager*) { breakAssociation(index); };
+		bConnected = loop.addSession(&manager, callbacks);
+	}
+	if (!bConnected)
+	{
+		printf("UDP association %u isn`t established: %s\n", index, ProxyManager::getErrorString(manager.lastErrorCode()).c_str());
+		manager.closeConnection();
+		association.state = ASSOCIATION_STATE::BROKEN;
+		association.retryTimer = loop.addTimer(Socks5::GATEWAY_RETRY_DELAY, [this, index]() { openAssociation(index); });
+		co_return;
+	}
+
+	if (association.bWasReady)
+		reassociations++;
+	association.bWasReady = true;
+	association.state = ASSOCIATION_STATE::READY;
+	sendPending(association);
+}
+
+void Socks5Gateway::breakAssociation(uint32_t index)
+{
+	// flows stay pinned to association, their datagrams are kept until it is established again
+	Association& association = associations[index];
+	if (association.state != ASSOCIATION_STATE::READY)
+		return;
+	printf("UDP association %u was dropped by proxy\n", index);
+	loop.removeSession(&association.session->manager());
+	association.session->manager().closeConnection();
+	association.state = ASSOCIATION_STATE::BROKEN;
+	association.retryTimer = loop.addTimer(Socks5::GATEWAY_RETRY_DELAY, [this, index]() { openAssociation(index); });
+}
+
+void Socks5Gateway::closeAssociation(uint32_t index)
+{
+	Association& association = associations[index];
+	if (association.state == ASSOCIATION_STATE::READY)
+		loop.removeSession(&association.session->manager());
+	if (association.retryTimer != 0)
+		loop.cancelTimer(association.retryTimer);
+	association.retryTimer = 0;
+	association.state = ASSOCIATION_STATE::CLOSED;
+	association.bWasReady = false;
+	association.pending.clear();
+	// handshake in progress is finished by its coroutine, which sees closed state
+	if (association.session && isIdle(association))
+		association.session->manager().closeConnection();
+}
+
+void Socks5Gateway::readAssociation(uint32_t index)
+{
+	Association& association = associations[index];
+	ProxyManager& manager = association.session->manager();
+	int32_t received;
+	do
+	{
+		for (uint32_t i = 0; i < Socks5::GATEWAY_BATCH; i++)
+		{
+			outMessages[i].data = &inBuffers[i * Socks5::GATEWAY_DATAGRAM_SIZE];
+			outMessages[i].dataLength = Socks5::GATEWAY_DATAGRAM_SIZE - Socks5::UDP_IPV4_HEADER_SIZE;
+		}
+		received = manager.readBatch(outMessages.data(), Socks5::GATEWAY_BATCH);
+		if (received <= 0)
+			break;
+
+		// replies are grouped by local socket, every group is sent by one sendmmsg
+		uint64_t now = gatewayTime();
+		for (int32_t i = 0; i < received; i++)
+		{
+			Socks5::UDPMessage& message = outMessages[i];
+			if (message.result < 0)
+				continue;
+			auto found = association.remotes.find(remoteKey(message.address));
+			if (found == association.remotes.end())
+			{
+				droppedDatagrams++;
+				continue;
+			}
+
+			UdpFlow* flow = found->second;
+			flow->lastActive = now;
+			Listener& listener = listeners[flow->rule];
+			// vectors have capacity of whole batch, so pointers to iovecs stay valid
+			struct iovec iov = { message.data, (size_t)message.result };
+			listener.replyIov.push_back(iov);
+			struct mmsghdr reply;
+			memset(&reply, 0, sizeof(reply));
+			reply.msg_hdr.msg_name = &flow->client;
+			reply.msg_hdr.msg_namelen = flow->clientLength;
+			reply.msg_hdr.msg_iov = &listener.replyIov.back();
+			reply.msg_hdr.msg_iovlen = 1;
+			listener.replies.push_back(reply);
+		}
+
+		for (Listener& listener : listeners)
+		{
+			if (listener.replies.empty())
+				continue;
+			int32_t sent = sendmmsg(listener.fd, listener.replies.data(), listener.replies.size(), MSG_DONTWAIT);
+			if (sent < 0)
+				sent = 0;
+			datagramsFromProxy += sent;
+			droppedDatagrams += listener.replies.size() - sent;
+			listener.replies.clear();
+			listener.replyIov.clear();
+		}
+	} while (received == (int32_t)Socks5::GATEWAY_BATCH);
+}
+
+void Socks5Gateway::sendPending(Association& association)
+{
+	ProxyManager& manager = association.session->manager();
+	for (uint32_t offset = 0; offset < association.pending.size(); offset += Socks5::GATEWAY_BATCH)
+	{
+		uint32_t count = std::min<uint32_t>(association.pending.size() - offset, Socks5::GATEWAY_BATCH);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			PendingDatagram& datagram = association.pending[offset + i];
+			outMessages[i] = { datagram.data.data(), (uint16_t)datagram.data.size(), 0, 0, 0, listeners[datagram.rule].dst };
+		}
+		int32_t sent = manager.sendBatch(outMessages.data(), count);
+		if (sent < 0)
+			sent = 0;
+		datagramsToProxy += sent;
+		droppedDatagrams += count - sent;
+	}
+	association.pending.clear();
+}
+
+void Socks5Gateway::acceptTcp(Listener& listener)
+{
+	const Socks5::GatewayRule& rule = config.rules[listener.rule];
+	int fd;
+	while ((fd = accept4(listener.fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+	{
+		std::string dstHost = rule.dstHost;
+		uint16_t dstPort = rule.dstPort;
+		if (rule.type == Socks5::GATEWAY_RULE::TCP_REDIRECT)
+		{
+			struct sockaddr_in original;
+			socklen_t originalLength = sizeof(original);
+			char host[INET_ADDRSTRLEN];
+			if (getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &original, &originalLength) != 0 ||
+				inet_ntop(AF_INET, &original.sin_addr, host, sizeof(host)) == 0)
+			{
+				failedConnects++;
+				close(fd);
+				continue;
+			}
+			dstHost = host;
+			dstPort = ntohs(original.sin_port);
+		}
+
+		std::lock_guard<std::mutex> lock(tcpMutex);
+		tcpFlows.push_back(std::make_unique<TcpFlow>());
+		TcpFlow* flow = tcpFlows.back().get();
+		flow->localFd = fd;
+		flow->thread = std::thread(&Socks5Gateway::relayTcp, this, flow, dstHost, dstPort);
+	}
+}
+
+void Socks5Gateway::relayTcp(TcpFlow* flow, std::string dstHost, uint16_t dstPort)
+{
+	Socks5::PROXY_ERROR error;
+	std::unique_ptr<ProxyManager> manager = pool->acquire(Socks5::PROXY_MODE::CONNECTION, dstHost, dstPort, &error);
+	if (manager)
+	{
+		{
+			std::lock_guard<std::mutex> lock(tcpMutex);
+			flow->proxyFd = manager->getTcpSocket();
+		}
+		manager->relay(flow->localFd, 0, config.flowTimeout);
+		{
+			std::lock_guard<std::mutex> lock(tcpMutex);
+			flow->proxyFd = -1;
+		}
+		manager->closeConnection();
+	}
+	else
+	{
+		printf("TCP flow to %s:%u isn`t connected: %s\n", dstHost.c_str(), dstPort, ProxyManager::getErrorString(error).c_str());
+		failedConnects++;
+	}
+
+	std::lock_guard<std::mutex> lock(tcpMutex);
+	close(flow->localFd);
+	flow->localFd = -1;
+	flow->bDone.store(true);
+}
+
+void Socks5Gateway::sweep()
+{
+	uint64_t now = gatewayTime();
+	for (auto flow = flows.begin(); flow != flows.end(); )
+	{
+		if (now - flow->second.lastActive < config.flowTimeout)
+		{
+			++flow;
+			continue;
+		}
+		associations[flow->second.association].remotes.erase(remoteKey(listeners[flow->second.rule].dst));
+		flow = flows.erase(flow);
+	}
+
+	// associations over minimal count are closed without flows
+	for (uint32_t i = config.minAssociations; i < associations.size(); i++)
+	{
+		if (associations[i].state != ASSOCIATION_STATE::CLOSED && associations[i].remotes.empty())
+			closeAssociation(i);
+	}
+
+	std::list<std::unique_ptr<TcpFlow>> finished;
+	{
+		std::lock_guard<std::mutex> lock(tcpMutex);
+		for (auto flow = tcpFlows.begin(); flow != tcpFlows.end(); )
+		{
+			auto next = std::next(flow);
+			if ((*flow)->bDone.load())
+				finished.splice(finished.end(), tcpFlows, flow);
+			flow = next;
+		}
+	}
+	for (auto& flow : finished)
+		flow->thread.join();
+
+	loop.addTimer(Socks5::GATEWAY_SWEEP_INTERVAL, [this]() { sweep(); });
+}
+
+bool Socks5Gateway::isIdle(Association& association)
+{
+	return !association.task || association.task->done();
+}
+
+Socks5Gateway::FlowKey Socks5Gateway::remoteKey(const Socks5::Address& address)
+{
+	// destinations are IP addresses, so source given by domain name doesn`t match any of them
+	FlowKey key;
+	memset(&key, 0, sizeof(key));
+	memcpy(key.address, address.bytes, std::min<size_t>(address.byteLength, sizeof(key.address)));
+	key.port = address.usPort;
+	key.rule = address.byteAddressType;
+	return key;
+}
@@ -0,0 +1,220 @@
+/******************************************************************************
+ * File: socks5gateway.h
+ * Description: Local gateway, which forwards UDP and TCP flows of local processes through shared proxy sessions.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef SOCKS5GATEWAY_H
+#define SOCKS5GATEWAY_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../proxymanager/proxymanager.h"
+#include "../proxymanager/eventloop.h"
+#include "../proxymanager/asyncproxymanager.h"
+#include "../proxymanager/proxyconnectionpool.h"
+
+namespace Socks5
+{
+    enum class GATEWAY_RULE
+    {
+        UDP = 0,        // datagrams to local port are sent to fixed destination through UDP association
+        TCP,            // connections to local port are connected to fixed destination by CONNECT
+        TCP_REDIRECT    // connections redirected by iptables (REDIRECT target) are connected to their original destination
+    };
+
+    struct GatewayRule
+    {
+        GATEWAY_RULE    type;
+        uint16_t        localPort;
+        std::string     dstHost;    // not used by TCP_REDIRECT
+        uint16_t        dstPort;
+    };
+
+    struct GatewayConfig
+    {
+        ProxyEndpoint   proxy;
+        std::string     listenIP;
+        std::vector<GatewayRule> rules;
+        uint32_t        minAssociations;    // UDP associations, which are kept open without flows
+        uint32_t        maxAssociations;
+        uint32_t        flowTimeout;        // flow is closed after this time (in mseconds) without data
+        uint32_t        handshakeTimeout;   // timeout of each handshake phase in mseconds
+        uint32_t        tcpStandby;         // warm connections for TCP flows
+    };
+
+    struct GatewayStats
+    {
+        uint64_t    udpFlows;           // UDP flows now
+        uint64_t    tcpFlows;           // TCP flows now
+        uint64_t    associations;       // established UDP associations now
+        uint64_t    reassociations;     // UDP associations established again after drop
+        uint64_t    datagramsToProxy;
+        uint64_t    datagramsFromProxy;
+        uint64_t    droppedDatagrams;   // datagrams without flow or association, or not accepted by socket
+        uint64_t    rejectedFlows;      // flows without free association or over the limit
+        uint64_t    failedConnects;     // TCP flows, which weren`t connected by proxy
+    };
+
+    // maximum count of datagrams moved by one recvmmsg/sendmmsg call of gateway
+    const uint32_t GATEWAY_BATCH = UDP_BATCH_MAX;
+    const uint32_t GATEWAY_DATAGRAM_SIZE = 65535;
+    const uint32_t GATEWAY_FLOW_MAX = 65536;
+    // datagrams of association, which are kept while it is connected
+    const uint32_t GATEWAY_PENDING_MAX = 64;
+    // mseconds between attempts to establish dropped association
+    const uint32_t GATEWAY_RETRY_DELAY = 1000;
+    // mseconds between checks of idle flows
+    const uint32_t GATEWAY_SWEEP_INTERVAL = 1000;
+}
+
+/**
+ * @class Socks5Gateway
+ * Daemon core. Local UDP flow (source address of datagrams) is pinned to one of shared UDP associations,
+ * so many local processes use a few proxy sessions. Replies of proxy are matched with flows by their source,
+ * so flows to the same destination are spread over different associations. TCP connections take
+ * authenticated connections of pool, so only CONNECT request is sent per connection.
+ * UDP is served by one thread with EventLoop, every TCP flow is relayed by own thread.
+ */
+class Socks5Gateway
+{
+public:
+    Socks5Gateway(Socks5::GatewayConfig config);
+    ~Socks5Gateway();
+    Socks5Gateway(const Socks5Gateway&) = delete;
+    Socks5Gateway& operator=(const Socks5Gateway&) = delete;
+    /**
+     * Open local sockets of rules and start minimal count of associations.
+     * @return true if successful, else error is printed.
+     */
+    bool start();
+    /**
+     * Serve flows until stop() is called.
+     */
+    void run();
+    /**
+     * Stop run(). Can be called from any thread (and from signal handler).
+     */
+    void stop() { loop.stop(); }
+    /**
+     * Gets counters of gateway.
+     * @return counters.
+     */
+    Socks5::GatewayStats getStats();
+
+private:
+    enum class ASSOCIATION_STATE
+    {
+        CLOSED = 0,
+        CONNECTING,
+        READY,
+        BROKEN      // dropped, waiting for next attempt
+    };
+
+    struct FlowKey
+    {
+        uint8_t     address[16];
+        uint16_t    port;
+        uint16_t    rule;       // rule of client flow, address type of destination
+
+        bool operator==(const FlowKey& other) const;
+    };
+
+    struct FlowKeyHash
+    {
+        size_t operator()(const FlowKey& key) const;
+    };
+
+    struct UdpFlow
+    {
+        sockaddr_storage    client;
+        socklen_t           clientLength;
+        uint32_t            rule;
+        uint32_t            association;
+        uint64_t            lastActive;
+    };
+
+    struct PendingDatagram
+    {
+        uint32_t    rule;       // listener of flow, it gives destination
+        std::string data;
+    };
+
+    struct Association
+    {
+        std::unique_ptr<AsyncProxyManager> session;
+        std::unique_ptr<Socks5::Task<void>> task;
+        ASSOCIATION_STATE state = ASSOCIATION_STATE::CLOSED;
+        bool bWasReady = false;
+        uint64_t retryTimer = 0;
+        // flows by destination (see remoteKey())
+        std::unordered_map<FlowKey, UdpFlow*, FlowKeyHash> remotes;
+        std::vector<PendingDatagram> pending;
+        std::vector<Socks5::UDPMessage> outgoing;
+    };
+
+    struct Listener
+    {
+        int fd = -1;
+        uint32_t rule;
+        // UDP rule: resolved destination (IPv4 or IPv6 address)
+        Socks5::Address dst = {};
+        std::vector<struct mmsghdr> replies;
+        std::vector<struct iovec> replyIov;
+    };
+
+    struct TcpFlow
+    {
+        std::thread thread;
+        int localFd = -1;
+        int proxyFd = -1;       // guarded by tcpMutex
+        std::atomic<bool> bDone{ false };
+    };
+
+    bool openListener(uint32_t ruleIndex);
+    void readListener(Listener& listener);
+    UdpFlow* findFlow(Listener& listener, const sockaddr_storage& client, socklen_t clientLength, uint64_t now);
+    int32_t chooseAssociation(const FlowKey& remote);
+    void openAssociation(uint32_t index);
+    Socks5::Task<void> establish(uint32_t index);
+    void breakAssociation(uint32_t index);
+    void closeAssociation(uint32_t index);
+    void readAssociation(uint32_t index);
+    void sendPending(Association& association);
+    void acceptTcp(Listener& listener);
+    void relayTcp(TcpFlow* flow, std::string dstHost, uint16_t dstPort);
+    void sweep();
+    static bool isIdle(Association& association);
+    static FlowKey remoteKey(const Socks5::Address& address);
+
+    Socks5::GatewayConfig config;
+    EventLoop loop;
+    std::vector<Listener> listeners;
+    std::vector<Association> associations;
+    std::unordered_map<FlowKey, UdpFlow, FlowKeyHash> flows;
+    std::vector<char> inBuffers;
+    std::vector<struct mmsghdr> inMessages;
+    std::vector<struct iovec> inIov;
+    std::vector<sockaddr_storage> inNames;
+    std::vector<Socks5::UDPMessage> outMessages;
+    std::unique_ptr<ProxyConnectionPool> pool;
+    std::mutex tcpMutex;
+    std::list<std::unique_ptr<TcpFlow>> tcpFlows;
+
+    uint64_t reassociations = 0;
+    uint64_t datagramsToProxy = 0;
+    uint64_t datagramsFromProxy = 0;
+    uint64_t droppedDatagrams = 0;
+    uint64_t rejectedFlows = 0;
+    std::atomic<uint64_t> failedConnects{ 0 };
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "asyncproxymanager.h"
+#include <errno.h>
+
+bool Socks5::FdAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	bool bAdded = loop.addFd(fd, events, [this, handle](uint32_t _occurred)
+	{
+		loop.removeFd(fd);
+		if (timerId != 0)
+			loop.cancelTimer(timerId);
+		occurred = _occurred;
+		handle.resume();
+	});
+	if (!bAdded)
+	{
+		occurred = static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR);
+		return false;
+	}
+
+	if (timeout != 0)
+	{
+		timerId = loop.addTimer(timeout, [this, handle]()
+		{
+			loop.removeFd(fd);
+			occurred = static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_NONE);
+			handle.resume();
+		});
+	}
+	return true;
+}
+
+Socks5::Task<bool> AsyncProxyManager::connectAsync(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	if (!proxyManager.beginConnect(ip, port, user, password, proxyMode, dstIP, dstPort))
+		co_return false;
+
+	while (true)
+	{
+		Socks5::HANDSHAKE_STATE state = proxyManager.advanceHandshake();
+		if (state == Socks5::HANDSHAKE_STATE::ESTABLISHED || state == Socks5::HANDSHAKE_STATE::BOUND)
+			co_return true;
+		if (state == Socks5::HANDSHAKE_STATE::FAILED)
+			co_return false;
+
+		uint32_t events = (proxyManager.handshakeWaitMode() & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND)) ?
+			static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE) : static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ);
+		co_await Socks5::FdAwaiter(loop, proxyManager.getTcpSocket(), events, proxyManager.getHandshakeTimeout());
+		if (proxyManager.checkHandshakeTimeout())
+			co_return false;
+	}
+}
+
+Socks5::Task<bool> AsyncProxyManager::acceptAsync(uint32_t timeout)
+{
+	while (true)
+	{
+		// second reply can be received already with first one
+		Socks5::HANDSHAKE_STATE state = proxyManager.advanceHandshake();
+		if (state == Socks5::HANDSHAKE_STATE::ESTABLISHED)
+			co_return true;
+		if (state != Socks5::HANDSHAKE_STATE::BOUND)
+			co_return false;
+
+		uint32_t occurred = co_await Socks5::FdAwaiter(loop, proxyManager.getTcpSocket(), static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ), timeout);
+		if (occurred == static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_NONE))
+			co_return false;
+	}
+}
+
+int AsyncProxyManager::dataSocket()
+{
+	if (proxyManager.getProxyMode() == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		return proxyManager.getUdpWaitSocket();
+	return proxyManager.getTcpSocket();
+}
+
+Socks5::Task<int32_t> AsyncProxyManager::asyncRead(char* data, uint16_t bufferSize, uint32_t* binAddres, uint16_t* port)
+{
+	while (true)
+	{
+		errno = 0;
+		int32_t result = proxyManager.read(data, bufferSize, binAddres, port);
+		// relay socket of dead association doesn`t become readable, so read isn`t waited for any more
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+			proxyManager.lastErrorCode() == Socks5::PROXY_ERROR::SESSION_CLOSED)
+			co_return result;
+
+		uint32_t occurred = co_await Socks5::FdAwaiter(loop, dataSocket(), static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ));
+		if (occurred == static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR))
+			co_return -1;
+	}
+}
+
+Socks5::Task<int32_t> AsyncProxyManager::asyncSend(char* packet, uint16_t dataLength, int32_t host, uint16_t port)
+{
+	while (true)
+	{
+		errno = 0;
+		int32_t result = proxyManager.send(packet, dataLength, host, port);
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			co_return result;
+
+		uint32_t occurred = co_await Socks5::FdAwaiter(loop, dataSocket(), static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE));
+		if (occurred == static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR))
+			co_return -1;
+	}
+}
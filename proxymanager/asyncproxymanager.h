@@ -0,0 +1,205 @@
+/******************************************************************************
+ * File: asyncproxymanager.h
+ * Description: C++20 coroutine API of socks5-client on top of EventLoop.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef ASYNCPROXYMANAGER_H
+#define ASYNCPROXYMANAGER_H
+
+#include <stdint.h>
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <utility>
+#include "proxymanager.h"
+#include "eventloop.h"
+
+namespace Socks5
+{
+    template<typename T>
+    class Task;
+
+    template<typename T>
+    struct TaskPromiseBase
+    {
+        std::coroutine_handle<> continuation;
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                std::coroutine_handle<> continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    template<typename T>
+    struct TaskPromise : TaskPromiseBase<T>
+    {
+        T value{};
+        Task<T> get_return_object();
+        void return_value(T _value) { value = std::move(_value); }
+    };
+
+    template<>
+    struct TaskPromise<void> : TaskPromiseBase<void>
+    {
+        Task<void> get_return_object();
+        void return_void() {}
+    };
+
+    /**
+     * @class Task
+     * Lazy coroutine. It is started by co_await from other coroutine or by start() from plain code.
+     */
+    template<typename T>
+    class Task
+    {
+    public:
+        typedef TaskPromise<T> promise_type;
+
+        explicit Task(std::coroutine_handle<promise_type> _handle) : handle(_handle) {}
+        Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+        Task& operator=(Task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (handle)
+                    handle.destroy();
+                handle = std::exchange(other.handle, nullptr);
+            }
+            return *this;
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task()
+        {
+            if (handle)
+                handle.destroy();
+        }
+
+        bool await_ready() { return !handle || handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation)
+        {
+            handle.promise().continuation = continuation;
+            return handle;
+        }
+        T await_resume()
+        {
+            if constexpr (!std::is_void<T>::value)
+                return std::move(handle.promise().value);
+        }
+
+        /**
+         * Start coroutine from plain code. Task must live until done() is true.
+         */
+        void start()
+        {
+            if (handle && !handle.done())
+                handle.resume();
+        }
+        /**
+         * Checks that coroutine was finished.
+         * @return true if finished.
+         */
+        bool done() { return !handle || handle.done(); }
+        /**
+         * Gets result of finished coroutine.
+         * @return result of coroutine.
+         */
+        T result() { return await_resume(); }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object()
+    {
+        return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object()
+    {
+        return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+    }
+
+    /**
+     * Awaiter of readiness of file descriptor. co_await returns bit-mask of occurred Socks5::EVENT_TYPE
+     * or EVENT_NONE if timeout expired.
+     * @note File descriptor must not be watched by loop already.
+     */
+    class FdAwaiter
+    {
+    public:
+        FdAwaiter(EventLoop& _loop, int _fd, uint32_t _events, uint32_t _timeout = 0)
+            : loop(_loop), fd(_fd), events(_events), timeout(_timeout) {}
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        uint32_t await_resume() { return occurred; }
+
+    private:
+        EventLoop& loop;
+        int fd;
+        uint32_t events;
+        uint32_t timeout;
+        uint32_t occurred = 0;
+        uint64_t timerId = 0;
+    };
+}
+
+/**
+ * @class AsyncProxyManager
+ * Coroutine API of ProxyManager. Sockets are non-blocking, waiting is done by EventLoop,
+ * so one thread can multiplex many sessions.
+ */
+class AsyncProxyManager
+{
+public:
+    AsyncProxyManager(EventLoop& _loop) : loop(_loop) {}
+    /**
+     * Connect to proxy-server. Parameters are the same as in ProxyManager::connectToProxy().
+     * Timeout of handshake phases is set by manager().setHandshakeTimeout().
+     * @return true if successful, false if connect was failed (see manager().lastErrorCode()). For BIND mode it returns
+     * after first reply (see ProxyManager::getBoundAddress()).
+     */
+    Socks5::Task<bool> connectAsync(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    /**
+     * Wait for connection of peer for BIND command (second reply), as ProxyManager::acceptBind(). Only this coroutine
+     * waits for session, so many BIND commands can be pending on one thread.
+     * @param timeout timeout in mseconds, 0 is without timeout.
+     * @return true if peer was connected, false if error or timeout expired (session stays in BOUND state).
+     */
+    Socks5::Task<bool> acceptAsync(uint32_t timeout = 0);
+    /**
+     * Read data. Parameters are the same as in ProxyManager::read().
+     * @return length of recevied data or -1 if error.
+     */
+    Socks5::Task<int32_t> asyncRead(char* data, uint16_t bufferSize, uint32_t* binAddres = 0, uint16_t* port = 0);
+    /**
+     * Send data. Parameters are the same as in ProxyManager::send().
+     * @return length of sent data or -1 if error.
+     */
+    Socks5::Task<int32_t> asyncSend(char* packet, uint16_t dataLength, int32_t host = 0, uint16_t port = 0);
+    /**
+     * Gets wrapped session for synchronous calls.
+     * @return session.
+     */
+    ProxyManager& manager() { return proxyManager; }
+
+private:
+    int dataSocket();
+    EventLoop& loop;
+    ProxyManager proxyManager;
+};
+
+#endif
@@ -0,0 +1,211 @@
+#include "bufferpool.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+
+#define POOL_BATCH      32      // buffers moved between thread cache and shared free list at once
+#define POOL_SLAB_SIZE  262144  // bytes of buffers allocated at once
+
+// handles can be released by destructors of other thread_local objects after cache of thread
+static thread_local bool bCacheDestroyed = false;
+
+PooledBuffer::PooledBuffer(const PooledBuffer& other)
+	: header(other.header)
+{
+	if (header != 0)
+		header->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer other) noexcept
+{
+	std::swap(header, other.header);
+	return *this;
+}
+
+void PooledBuffer::reset()
+{
+	if (header != 0 && header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		BufferPool::global().release(header);
+	header = 0;
+}
+
+BufferPool& BufferPool::global()
+{
+	// pool isn`t destroyed, because handles can outlive static objects
+	static BufferPool* pool = new BufferPool();
+	return *pool;
+}
+
+BufferPool::ThreadCache& BufferPool::threadCache()
+{
+	thread_local ThreadCache cache;
+	return cache;
+}
+
+BufferPool::ThreadCache::ThreadCache()
+{
+	BufferPool& pool = global();
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	pool.caches.push_back(this);
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+	// buffers of finished thread are returned to shared free lists
+	BufferPool& pool = global();
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT); i++)
+	{
+		while (heads[i] != 0)
+		{
+			Socks5::BufferHeader* header = heads[i];
+			heads[i] = header->next;
+			header->next = pool.freeLists[i];
+			pool.freeLists[i] = header;
+			pool.freeCounts[i]++;
+		}
+		counts[i].store(0, std::memory_order_relaxed);
+	}
+	pool.caches.erase(std::remove(pool.caches.begin(), pool.caches.end(), this), pool.caches.end());
+	bCacheDestroyed = true;
+}
+
+PooledBuffer BufferPool::acquire(uint32_t size)
+{
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT); i++)
+	{
+		if (size <= Socks5::BUFFER_CLASS_SIZES[i])
+			return acquire(static_cast<Socks5::BUFFER_CLASS>(i));
+	}
+	return PooledBuffer();
+}
+
+PooledBuffer BufferPool::acquire(Socks5::BUFFER_CLASS bufferClass)
+{
+	uint32_t index = static_cast<uint32_t>(bufferClass);
+	if (index >= static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT))
+		return PooledBuffer();
+
+	if (bCacheDestroyed)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (freeLists[index] == 0 && !allocateSlab(index))
+			return PooledBuffer();
+		Socks5::BufferHeader* header = freeLists[index];
+		freeLists[index] = header->next;
+		freeCounts[index]--;
+		header->next = 0;
+		header->refs.store(1, std::memory_order_relaxed);
+		return PooledBuffer(header);
+	}
+
+	ThreadCache& cache = threadCache();
+	if (cache.heads[index] == 0 && !refill(cache, index))
+		return PooledBuffer();
+
+	Socks5::BufferHeader* header = cache.heads[index];
+	cache.heads[index] = header->next;
+	cache.counts[index].store(cache.counts[index].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	header->next = 0;
+	header->refs.store(1, std::memory_order_relaxed);
+	return PooledBuffer(header);
+}
+
+void BufferPool::release(Socks5::BufferHeader* header)
+{
+	uint32_t index = header->bufferClass;
+	if (bCacheDestroyed)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		header->next = freeLists[index];
+		freeLists[index] = header;
+		freeCounts[index]++;
+		return;
+	}
+
+	// buffer goes to cache of releasing thread
+	ThreadCache& cache = threadCache();
+	header->next = cache.heads[index];
+	cache.heads[index] = header;
+	uint32_t count = cache.counts[index].load(std::memory_order_relaxed) + 1;
+	cache.counts[index].store(count, std::memory_order_relaxed);
+	if (count > 2 * POOL_BATCH)
+		flush(cache, index, POOL_BATCH);
+}
+
+bool BufferPool::refill(ThreadCache& cache, uint32_t bufferClass)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (freeLists[bufferClass] == 0 && !allocateSlab(bufferClass))
+		return false;
+
+	uint32_t moved = 0;
+	while (moved < POOL_BATCH && freeLists[bufferClass] != 0)
+	{
+		Socks5::BufferHeader* header = freeLists[bufferClass];
+		freeLists[bufferClass] = header->next;
+		header->next = cache.heads[bufferClass];
+		cache.heads[bufferClass] = header;
+		moved++;
+	}
+	freeCounts[bufferClass] -= moved;
+	cache.counts[bufferClass].store(cache.counts[bufferClass].load(std::memory_order_relaxed) + moved, std::memory_order_relaxed);
+	return true;
+}
+
+void BufferPool::flush(ThreadCache& cache, uint32_t bufferClass, uint32_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint32_t moved = 0;
+	while (moved < count && cache.heads[bufferClass] != 0)
+	{
+		Socks5::BufferHeader* header = cache.heads[bufferClass];
+		cache.heads[bufferClass] = header->next;
+		header->next = freeLists[bufferClass];
+		freeLists[bufferClass] = header;
+		moved++;
+	}
+	freeCounts[bufferClass] += moved;
+	cache.counts[bufferClass].store(cache.counts[bufferClass].load(std::memory_order_relaxed) - moved, std::memory_order_relaxed);
+}
+
+bool BufferPool::allocateSlab(uint32_t bufferClass)
+{
+	size_t stride = PooledBuffer::HEADER_SIZE + Socks5::BUFFER_CLASS_SIZES[bufferClass];
+	size_t count = POOL_SLAB_SIZE / stride;
+	if (count < POOL_BATCH / 8)
+		count = POOL_BATCH / 8;
+	char* slab = (char*)aligned_alloc(PooledBuffer::HEADER_SIZE, stride * count);
+	if (slab == 0)
+		return false;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		Socks5::BufferHeader* header = new (slab + i * stride) Socks5::BufferHeader();
+		header->refs.store(0, std::memory_order_relaxed);
+		header->bufferClass = bufferClass;
+		header->next = freeLists[bufferClass];
+		freeLists[bufferClass] = header;
+	}
+	freeCounts[bufferClass] += count;
+	capacity[bufferClass] += count;
+	slabAllocations++;
+	return true;
+}
+
+Socks5::BufferPoolStats BufferPool::getStats()
+{
+	Socks5::BufferPoolStats stats;
+	std::lock_guard<std::mutex> lock(mutex);
+	stats.slabAllocations = slabAllocations;
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT); i++)
+	{
+		uint64_t cached = 0;
+		for (ThreadCache* cache : caches)
+			cached += cache->counts[i].load(std::memory_order_relaxed);
+		stats.capacity[i] = capacity[i];
+		// thread caches are counted without lock, so sum can be inexact for moment
+		stats.inUse[i] = capacity[i] > freeCounts[i] + cached ? capacity[i] - freeCounts[i] - cached : 0;
+	}
+	return stats;
+}
@@ -0,0 +1,139 @@
+/******************************************************************************
+ * File: bufferpool.h
+ * Description: Slab pool of reference-counted buffers of socks5-client.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace Socks5
+{
+    enum class BUFFER_CLASS
+    {
+        HANDSHAKE = 0,  // 1024 bytes
+        MTU,            // 2048 bytes
+        JUMBO,          // 10240 bytes
+        MAX_DATAGRAM,   // 65536 bytes
+        COUNT
+    };
+
+    constexpr uint32_t BUFFER_CLASS_SIZES[static_cast<uint32_t>(BUFFER_CLASS::COUNT)] = { 1024, 2048, 10240, 65536 };
+
+    struct BufferHeader
+    {
+        std::atomic<uint32_t>   refs;
+        uint32_t                bufferClass;
+        BufferHeader*           next;   // link of free list
+    };
+
+    struct BufferPoolStats
+    {
+        uint64_t    slabAllocations;    // heap allocations of pool, it doesn`t grow in steady state
+        uint64_t    capacity[static_cast<uint32_t>(BUFFER_CLASS::COUNT)];   // buffers of each class
+        uint64_t    inUse[static_cast<uint32_t>(BUFFER_CLASS::COUNT)];      // buffers held by handles
+    };
+}
+
+/**
+ * @class PooledBuffer
+ * Reference-counted handle of pool buffer. Copies of handle share buffer, buffer is returned to pool
+ * by destruction of last handle (by any thread).
+ */
+class PooledBuffer
+{
+public:
+    PooledBuffer() {}
+    PooledBuffer(const PooledBuffer& other);
+    PooledBuffer(PooledBuffer&& other) noexcept : header(other.header) { other.header = 0; }
+    PooledBuffer& operator=(PooledBuffer other) noexcept;
+    ~PooledBuffer() { reset(); }
+    /**
+     * Return buffer to pool if handle is last.
+     */
+    void reset();
+    bool isValid() const { return header != 0; }
+    /**
+     * Gets data of buffer.
+     * @return pointer to data or 0 if handle is empty.
+     */
+    char* data() const { return header != 0 ? (char*)header + HEADER_SIZE : 0; }
+    /**
+     * Gets size of buffer.
+     * @return size of buffer in bytes.
+     */
+    uint32_t size() const { return header != 0 ? Socks5::BUFFER_CLASS_SIZES[header->bufferClass] : 0; }
+    uint32_t useCount() const { return header != 0 ? header->refs.load(std::memory_order_relaxed) : 0; }
+
+    // data is cache-line aligned after header
+    static const uint32_t HEADER_SIZE = 64;
+
+private:
+    friend class BufferPool;
+    explicit PooledBuffer(Socks5::BufferHeader* header) : header(header) {}
+    Socks5::BufferHeader* header = 0;
+};
+
+/**
+ * @class BufferPool
+ * Process-wide slab pool of fixed size classes. Every thread has cache of free buffers, which is refilled from
+ * and flushed to shared free lists by batches, so steady-state acquire/release doesn`t lock and doesn`t allocate.
+ * Slabs are allocated when free lists are empty and aren`t freed.
+ */
+class BufferPool
+{
+public:
+    /**
+     * Gets process-wide pool.
+     * @return pool.
+     */
+    static BufferPool& global();
+    /**
+     * Acquire buffer of smallest class, which fits size.
+     * @param size wanted size in bytes.
+     * @return handle of buffer or empty handle if size is larger than the largest class or memory isn`t allocated.
+     */
+    PooledBuffer acquire(uint32_t size);
+    /**
+     * Acquire buffer of class.
+     * @param bufferClass class of buffer.
+     * @return handle of buffer or empty handle if memory isn`t allocated.
+     */
+    PooledBuffer acquire(Socks5::BUFFER_CLASS bufferClass);
+    /**
+     * Gets occupancy of pool.
+     * @return counters of pool.
+     */
+    Socks5::BufferPoolStats getStats();
+
+private:
+    struct ThreadCache
+    {
+        Socks5::BufferHeader* heads[static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT)] = {};
+        std::atomic<uint32_t> counts[static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT)] = {};
+        ThreadCache();
+        ~ThreadCache();
+    };
+
+    friend class PooledBuffer;
+    BufferPool() {}
+    static ThreadCache& threadCache();
+    void release(Socks5::BufferHeader* header);
+    bool refill(ThreadCache& cache, uint32_t bufferClass);
+    void flush(ThreadCache& cache, uint32_t bufferClass, uint32_t count);
+    bool allocateSlab(uint32_t bufferClass);
+
+    std::mutex mutex;
+    Socks5::BufferHeader* freeLists[static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT)] = {};
+    uint64_t freeCounts[static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT)] = {};
+    uint64_t capacity[static_cast<uint32_t>(Socks5::BUFFER_CLASS::COUNT)] = {};
+    uint64_t slabAllocations = 0;
+    std::vector<ThreadCache*> caches;
+};
+
+#endif
@@ -0,0 +1,257 @@
+#include "eventloop.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define EPOLL_EVENTS_MAX 256
+
+EventLoop::EventLoop()
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd >= 0 && wakeupFd >= 0)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL; // wakeup event
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFd, &event);
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	if (wakeupFd >= 0)
+		close(wakeupFd);
+	if (epollFd >= 0)
+		close(epollFd);
+}
+
+bool EventLoop::isValid()
+{
+	return epollFd >= 0 && wakeupFd >= 0;
+}
+
+uint32_t EventLoop::toEpollEvents(uint32_t events)
+{
+	uint32_t epollEvents = EPOLLET | EPOLLRDHUP;
+	if (events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ))
+		epollEvents |= EPOLLIN;
+	if (events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE))
+		epollEvents |= EPOLLOUT;
+	return epollEvents;
+}
+
+bool EventLoop::addFd(int fd, uint32_t events, FdCallback callback)
+{
+	if (!isValid() || fd < 0 || watchers.count(fd))
+		return false;
+
+	std::unique_ptr<Watcher> watcher(new Watcher{ fd, callback, false });
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = toEpollEvents(events);
+	event.data.ptr = watcher.get();
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+		return false;
+
+	watchers[fd] = std::move(watcher);
+	return true;
+}
+
+bool EventLoop::modifyFd(int fd, uint32_t events)
+{
+	auto it = watchers.find(fd);
+	if (it == watchers.end())
+		return false;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = toEpollEvents(events);
+	event.data.ptr = it->second.get();
+	return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void EventLoop::removeFd(int fd)
+{
+	auto it = watchers.find(fd);
+	if (it == watchers.end())
+		return;
+
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+	// watcher can be referenced by pending events of current runOnce(), so it is freed later
+	it->second->removed = true;
+	removedWatchers.push_back(std::move(it->second));
+	watchers.erase(it);
+}
+
+bool EventLoop::addSession(ProxyManager* manager, Socks5::SessionCallbacks callbacks)
+{
+	if (manager == 0 || !manager->isConnected())
+		return false;
+
+	uint32_t readWrite = static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ) | static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE);
+	auto dataCallback = [manager, callbacks](uint32_t events)
+	{
+		if (events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR))
+		{
+			if (callbacks.onError)
+				callbacks.onError(manager);
+			return;
+		}
+		if ((events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ)) && callbacks.onReadable)
+			callbacks.onReadable(manager);
+		if ((events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE)) && callbacks.onWritable)
+			callbacks.onWritable(manager);
+	};
+
+	if (manager->getProxyMode() == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		int tcpFd = manager->getTcpSocket();
+		// proxy must not send anything by control socket of udp association,
+		// so readable control socket means its drop
+		auto controlCallback = [manager, callbacks, tcpFd](uint32_t events)
+		{
+			if (!(events & static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR)))
+			{
+				char byte;
+				int32_t result = recv(tcpFd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+				if (result > 0 || (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+					return;
+			}
+			if (callbacks.onError)
+				callbacks.onError(manager);
+		};
+		if (!addFd(manager->getUdpWaitSocket(), readWrite, dataCallback))
+			return false;
+		if (!addFd(tcpFd, static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ), controlCallback))
+		{
+			removeFd(manager->getUdpWaitSocket());
+			return false;
+		}
+		return true;
+	}
+	else return addFd(manager->getTcpSocket(), readWrite, dataCallback);
+}
+
+void EventLoop::removeSession(ProxyManager* manager)
+{
+	if (manager == 0)
+		return;
+
+	if (manager->getProxyMode() == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		removeFd(manager->getUdpWaitSocket());
+	removeFd(manager->getTcpSocket());
+}
+
+uint64_t EventLoop::monotonicTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t EventLoop::addTimer(uint32_t timeout, std::function<void()> callback)
+{
+	uint64_t timerId = ++lastTimerId;
+	uint64_t deadline = monotonicTime() + timeout;
+	timers[std::make_pair(deadline, timerId)] = callback;
+	timerDeadlines[timerId] = deadline;
+	return timerId;
+}
+
+void EventLoop::cancelTimer(uint64_t timerId)
+{
+	auto it = timerDeadlines.find(timerId);
+	if (it == timerDeadlines.end())
+		return;
+
+	timers.erase(std::make_pair(it->second, timerId));
+	timerDeadlines.erase(it);
+}
+
+int32_t EventLoop::dispatchTimers()
+{
+	int32_t dispatchedCount = 0;
+	uint64_t now = monotonicTime();
+	while (!timers.empty() && timers.begin()->first.first <= now)
+	{
+		// callback is moved out, because it can add or cancel timers
+		std::function<void()> callback = std::move(timers.begin()->second);
+		timerDeadlines.erase(timers.begin()->first.second);
+		timers.erase(timers.begin());
+		callback();
+		dispatchedCount++;
+	}
+	return dispatchedCount;
+}
+
+int32_t EventLoop::runOnce(int32_t timeout)
+{
+	if (!isValid())
+		return -1;
+
+	if (!timers.empty())
+	{
+		uint64_t now = monotonicTime();
+		uint64_t deadline = timers.begin()->first.first;
+		int32_t timerTimeout = deadline > now ? (int32_t)(deadline - now) : 0;
+		if (timeout < 0 || timerTimeout < timeout)
+			timeout = timerTimeout;
+	}
+
+	struct epoll_event events[EPOLL_EVENTS_MAX];
+	int32_t eventCount = epoll_wait(epollFd, events, EPOLL_EVENTS_MAX, timeout);
+	if (eventCount < 0)
+		return errno == EINTR ? 0 : -1;
+
+	int32_t dispatchedCount = 0;
+	for (int32_t i = 0; i < eventCount; i++)
+	{
+		Watcher* watcher = (Watcher*)events[i].data.ptr;
+		if (watcher == NULL)
+		{
+			uint64_t value;
+			while (::read(wakeupFd, &value, sizeof(value)) > 0);
+			continue;
+		}
+		if (watcher->removed)
+			continue;
+
+		uint32_t occurred = static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_NONE);
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+			occurred |= static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_READ);
+		if (events[i].events & EPOLLOUT)
+			occurred |= static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_WRITE);
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+			occurred |= static_cast<uint32_t>(Socks5::EVENT_TYPE::EVENT_ERROR);
+
+		watcher->callback(occurred);
+		dispatchedCount++;
+	}
+	removedWatchers.clear();
+	dispatchedCount += dispatchTimers();
+	return dispatchedCount;
+}
+
+void EventLoop::run()
+{
+	// stop(), which came before run() (e.g. from signal handler), isn`t lost, it is taken by the first check
+	while (!bStopPending.exchange(false))
+	{
+		if (runOnce(-1) < 0)
+			break;
+	}
+}
+
+void EventLoop::stop()
+{
+	bStopPending = true;
+	uint64_t value = 1;
+	if (wakeupFd >= 0)
+		::write(wakeupFd, &value, sizeof(value));
+}
@@ -0,0 +1,142 @@
+/******************************************************************************
+ * File: eventloop.h
+ * Description: epoll-based event loop for driving many ProxyManager sessions from one thread.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    enum class EVENT_TYPE
+    {
+        EVENT_NONE = 0,
+        EVENT_READ = 1,
+        EVENT_WRITE = 2,
+        EVENT_ERROR = 4
+    };
+
+    /**
+     * Callbacks of session added to EventLoop.
+     * Unset callbacks are ignored.
+     */
+    struct SessionCallbacks
+    {
+        std::function<void(ProxyManager*)> onReadable;
+        std::function<void(ProxyManager*)> onWritable;
+        std::function<void(ProxyManager*)> onError;
+    };
+}
+
+/**
+ * @class EventLoop
+ * Edge-triggered epoll reactor. One thread can service many proxied sessions.
+ * @note All methods except stop() must be called from the thread of the loop.
+ */
+class EventLoop
+{
+public:
+    typedef std::function<void(uint32_t events)> FdCallback;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    /**
+     * Checks that epoll instance was created.
+     * @return true if loop is usable.
+     */
+    bool isValid();
+    /**
+     * Watch file descriptor (edge-triggered).
+     * @param fd file descriptor.
+     * @param events bit-mask of Socks5::EVENT_TYPE to watch (EVENT_ERROR is always watched).
+     * @param callback callback, called with bit-mask of occurred Socks5::EVENT_TYPE.
+     * @return true if successful.
+     */
+    bool addFd(int fd, uint32_t events, FdCallback callback);
+    /**
+     * Change watched events of file descriptor.
+     * @param fd file descriptor.
+     * @param events bit-mask of Socks5::EVENT_TYPE to watch.
+     * @return true if successful.
+     */
+    bool modifyFd(int fd, uint32_t events);
+    /**
+     * Stop watching of file descriptor. Can be called from callbacks.
+     * @param fd file descriptor.
+     */
+    void removeFd(int fd);
+    /**
+     * Add connected session. For UDP_ASSOCIATE mode both UDP relay socket and TCP control socket are watched,
+     * drop of TCP control socket is reported by onError.
+     * @param manager connected session.
+     * @param callbacks callbacks of session.
+     * @return true if successful.
+     */
+    bool addSession(ProxyManager* manager, Socks5::SessionCallbacks callbacks);
+    /**
+     * Remove session from loop. Must be called before closeConnection() of session. Can be called from callbacks.
+     * @param manager session.
+     */
+    void removeSession(ProxyManager* manager);
+    /**
+     * Call callback once after timeout. Can be called from callbacks.
+     * @param timeout timeout in mseconds.
+     * @param callback callback.
+     * @return id of timer.
+     */
+    uint64_t addTimer(uint32_t timeout, std::function<void()> callback);
+    /**
+     * Cancel timer, which wasn`t called yet. Can be called from callbacks.
+     * @param timerId id of timer.
+     */
+    void cancelTimer(uint64_t timerId);
+    /**
+     * Wait events and dispatch callbacks once.
+     * @param timeout timeout in mseconds (-1 is infinite).
+     * @return count of dispatched events or -1 if error.
+     */
+    int32_t runOnce(int32_t timeout);
+    /**
+     * Dispatch events until stop() is called. Returns at once if stop() was called before it.
+     */
+    void run();
+    /**
+     * Stop run(), or the next run() if loop isn`t running. Can be called from any thread.
+     */
+    void stop();
+
+private:
+    struct Watcher
+    {
+        int fd;
+        FdCallback callback;
+        bool removed;
+    };
+
+    static uint32_t toEpollEvents(uint32_t events);
+    static uint64_t monotonicTime();
+    int32_t dispatchTimers();
+    int epollFd = -1;
+    int wakeupFd = -1;
+    std::atomic<bool> bStopPending{ false };   // set by stop(), taken by run()
+    std::unordered_map<int, std::unique_ptr<Watcher>> watchers;
+    std::vector<std::unique_ptr<Watcher>> removedWatchers;
+    // timers are ordered by deadline, id makes key unique
+    std::map<std::pair<uint64_t, uint64_t>, std::function<void()>> timers;
+    std::unordered_map<uint64_t, uint64_t> timerDeadlines;
+    uint64_t lastTimerId = 0;
+};
+
+#endif
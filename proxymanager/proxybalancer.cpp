@@ -0,0 +1,205 @@
+#include "proxybalancer.h"
+#include <time.h>
+#include <random>
+
+#define BALANCER_EWMA_WEIGHT    0.2
+#define BALANCER_ERROR_PENALTY  10.0 // score of upstream with error rate 1 is multiplied by 1 + penalty
+
+static uint64_t balancerTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+ProxyBalancer::ProxyBalancer(std::vector<Socks5::ProxyEndpoint> endpoints, Socks5::BALANCE_POLICY policy)
+	: policy(policy)
+{
+	for (Socks5::ProxyEndpoint& endpoint : endpoints)
+	{
+		Upstream upstream;
+		upstream.endpoint = endpoint;
+		upstream.stats = { 0, 0, 0, 0, 0, 0, false };
+		upstream.failuresInRow = 0;
+		upstream.ejectTime = 0;
+		upstream.ejectedUntil = 0;
+		upstream.bProbing = false;
+		upstreams.push_back(upstream);
+	}
+}
+
+void ProxyBalancer::setEjection(uint32_t failureCount, uint32_t ejectTime, uint32_t maxEjectTime)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ejectFailureCount = failureCount;
+	firstEjectTime = ejectTime;
+	this->maxEjectTime = maxEjectTime;
+}
+
+Socks5::UpstreamStats ProxyBalancer::getStats(uint32_t index)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Socks5::UpstreamStats stats = upstreams.at(index).stats;
+	stats.bEjected = upstreams[index].ejectedUntil != 0;
+	return stats;
+}
+
+bool ProxyBalancer::isAvailable(const Upstream& upstream, uint64_t now)
+{
+	if (upstream.ejectedUntil == 0)
+		return true;
+	// ejected upstream is re-probed by one session
+	return now >= upstream.ejectedUntil && !upstream.bProbing;
+}
+
+double ProxyBalancer::score(const Upstream& upstream)
+{
+	// upstream without samples has zero RTT, so it is tried first
+	return upstream.stats.handshakeRtt * (upstream.stats.inFlight + 1) * (1 + BALANCER_ERROR_PENALTY * upstream.stats.errorRate);
+}
+
+int32_t ProxyBalancer::selectUpstream(uint64_t now, const std::vector<bool>& tried)
+{
+	std::vector<uint32_t> candidates;
+	for (uint32_t i = 0; i < upstreams.size(); i++)
+	{
+		if (!tried[i] && isAvailable(upstreams[i], now))
+			candidates.push_back(i);
+	}
+
+	if (candidates.empty())
+	{
+		// all upstreams are ejected, the nearest to end of ejection is used rather than nothing
+		int32_t nearest = -1;
+		for (uint32_t i = 0; i < upstreams.size(); i++)
+		{
+			if (!tried[i] && (nearest < 0 || upstreams[i].ejectedUntil < upstreams[nearest].ejectedUntil))
+				nearest = i;
+		}
+		return nearest;
+	}
+
+	if (policy == Socks5::BALANCE_POLICY::LEAST_LATENCY || candidates.size() <= 2)
+	{
+		uint32_t best = candidates[0];
+		for (uint32_t index : candidates)
+		{
+			if (score(upstreams[index]) < score(upstreams[best]))
+				best = index;
+		}
+		return best;
+	}
+
+	thread_local std::minstd_rand random(balancerTime());
+	uint32_t first = candidates[random() % candidates.size()];
+	uint32_t second = candidates[random() % (candidates.size() - 1)];
+	if (second == first)
+		second = candidates.back();
+	return score(upstreams[first]) <= score(upstreams[second]) ? first : second;
+}
+
+bool ProxyBalancer::isUpstreamFault(Socks5::PROXY_ERROR error)
+{
+	switch (error)
+	{
+	case Socks5::PROXY_ERROR::CONNECTION:
+	case Socks5::PROXY_ERROR::NETWORK:
+	case Socks5::PROXY_ERROR::PROTOCOL:
+	case Socks5::PROXY_ERROR::AUTH_METHOD:
+	case Socks5::PROXY_ERROR::UDP_BIND:
+	case Socks5::PROXY_ERROR::SIGNIN:
+	case Socks5::PROXY_ERROR::GENERAL:
+	case Socks5::PROXY_ERROR::UNKNOW:
+	case Socks5::PROXY_ERROR::TIMEOUT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void ProxyBalancer::finishHandshake(uint32_t index, HANDSHAKE_OUTCOME outcome, uint64_t rtt)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Upstream& upstream = upstreams[index];
+	Socks5::UpstreamStats& stats = upstream.stats;
+	bool bFailed = outcome == HANDSHAKE_OUTCOME::UPSTREAM_FAILED;
+	stats.inFlight--;
+	stats.errorRate += BALANCER_EWMA_WEIGHT * ((bFailed ? 1.0 : 0.0) - stats.errorRate);
+	bool bProbe = upstream.bProbing;
+	upstream.bProbing = false;
+
+	if (!bFailed)
+	{
+		// refused request isn`t session and its time isn`t handshake time, but upstream has answered, so it isn`t ejected
+		if (outcome == HANDSHAKE_OUTCOME::SESSION)
+		{
+			if (stats.handshakeRtt == 0)
+				stats.handshakeRtt = rtt;
+			else
+				stats.handshakeRtt += BALANCER_EWMA_WEIGHT * ((double)rtt - stats.handshakeRtt);
+			stats.sessions++;
+		}
+		upstream.failuresInRow = 0;
+		upstream.ejectTime = 0;
+		upstream.ejectedUntil = 0;
+		return;
+	}
+
+	stats.failures++;
+	upstream.failuresInRow++;
+	if (bProbe || (upstream.ejectedUntil == 0 && upstream.failuresInRow >= ejectFailureCount))
+	{
+		// ejection time grows while probes fail
+		upstream.ejectTime = upstream.ejectTime == 0 ? firstEjectTime : upstream.ejectTime * 2;
+		if (upstream.ejectTime > maxEjectTime)
+			upstream.ejectTime = maxEjectTime;
+		upstream.ejectedUntil = balancerTime() + (uint64_t)upstream.ejectTime * 1000;
+		stats.ejections++;
+	}
+}
+
+std::unique_ptr<ProxyManager> ProxyBalancer::connect(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort,
+	Socks5::PROXY_ERROR* error, uint32_t* upstream)
+{
+	std::vector<bool> tried(upstreams.size(), false);
+	Socks5::PROXY_ERROR lastError = Socks5::PROXY_ERROR::CONNECTION;
+	std::unique_ptr<ProxyManager> manager(new ProxyManager());
+	manager->setHandshakeTimeout(handshakeTimeout);
+
+	while (true)
+	{
+		uint64_t start = balancerTime();
+		Socks5::ProxyEndpoint endpoint;
+		int32_t index;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			index = selectUpstream(start, tried);
+			if (index < 0)
+				break;
+			Upstream& selected = upstreams[index];
+			if (selected.ejectedUntil != 0)
+				selected.bProbing = true;
+			selected.stats.inFlight++;
+			endpoint = selected.endpoint;
+		}
+		tried[index] = true;
+
+		bool bConnected = manager->connectToProxy(endpoint.ip, endpoint.port, endpoint.user, endpoint.password, proxyMode, dstIP, dstPort);
+		lastError = manager->lastErrorCode();
+		HANDSHAKE_OUTCOME outcome = bConnected ? HANDSHAKE_OUTCOME::SESSION :
+			isUpstreamFault(lastError) ? HANDSHAKE_OUTCOME::UPSTREAM_FAILED : HANDSHAKE_OUTCOME::REQUEST_FAILED;
+		finishHandshake(index, outcome, balancerTime() - start);
+		if (outcome == HANDSHAKE_OUTCOME::UPSTREAM_FAILED)
+			continue;
+
+		if (upstream != 0)
+			*upstream = index;
+		if (bConnected)
+			return manager;
+		break;
+	}
+
+	if (error != 0)
+		*error = lastError;
+	return nullptr;
+}
@@ -0,0 +1,120 @@
+/******************************************************************************
+ * File: proxybalancer.h
+ * Description: Latency-aware balancer of sessions between several proxy-servers.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef PROXYBALANCER_H
+#define PROXYBALANCER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    enum class BALANCE_POLICY
+    {
+        POWER_OF_TWO = 0,   // better of two random upstreams
+        LEAST_LATENCY       // best of all upstreams
+    };
+
+    struct UpstreamStats
+    {
+        double      handshakeRtt;   // EWMA of handshake time in useconds
+        double      errorRate;      // EWMA of failed handshakes (0..1)
+        uint32_t    inFlight;       // handshakes in progress
+        uint64_t    sessions;       // established sessions
+        uint64_t    failures;       // handshakes failed by proxy fault
+        uint64_t    ejections;
+        bool        bEjected;
+    };
+}
+
+/**
+ * @class ProxyBalancer
+ * Routes new sessions between several proxy-servers by EWMA of handshake time and error rate.
+ * Upstream is ejected after several failures in row and gets one probe session after ejection time,
+ * ejection time is doubled after every failed probe. Thread-safe.
+ */
+class ProxyBalancer
+{
+public:
+    /**
+     * Create balancer.
+     * @param endpoints proxy-servers.
+     * @param policy policy of upstream selection.
+     */
+    ProxyBalancer(std::vector<Socks5::ProxyEndpoint> endpoints, Socks5::BALANCE_POLICY policy = Socks5::BALANCE_POLICY::POWER_OF_TWO);
+    ProxyBalancer(const ProxyBalancer&) = delete;
+    ProxyBalancer& operator=(const ProxyBalancer&) = delete;
+    /**
+     * Gets connected session through selected upstream. If upstream fails by its fault (connection, auth, protocol
+     * or timeout error), next upstream is tried. Errors of destination (as CONNECTION_REFUSED) are returned at once.
+     * @param proxyMode mode of proxy. Socks5::PROXY_MODE::CONNECTION (TCP connect) or Socks5::PROXY_MODE::UDP_ASSOCIATE (UDP connect).
+     * @param dstIP destination IP address (for CONNECTION mode).
+     * @param dstPort destination port (for CONNECTION mode).
+     * @param error pointer to variable for write error code (can be 0).
+     * @param upstream pointer to variable for write index of used upstream (can be 0).
+     * @return connected session or nullptr if error.
+     */
+    std::unique_ptr<ProxyManager> connect(Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0,
+        Socks5::PROXY_ERROR* error = 0, uint32_t* upstream = 0);
+    /**
+     * Set timeout of each handshake phase. Without timeout hanging upstream isn`t ejected.
+     * @param timeout timeout in mseconds, 0 is without timeout.
+     */
+    void setHandshakeTimeout(uint32_t timeout) { handshakeTimeout = timeout; }
+    /**
+     * Set ejection parameters.
+     * @param failureCount count of failures in row, which ejects upstream.
+     * @param ejectTime first ejection time in mseconds.
+     * @param maxEjectTime maximum ejection time in mseconds.
+     */
+    void setEjection(uint32_t failureCount, uint32_t ejectTime, uint32_t maxEjectTime);
+    uint32_t getUpstreamCount() { return upstreams.size(); }
+    /**
+     * Gets statistics of upstream.
+     * @param index index of upstream in list of constructor.
+     * @return statistics of upstream.
+     */
+    Socks5::UpstreamStats getStats(uint32_t index);
+
+private:
+    struct Upstream
+    {
+        Socks5::ProxyEndpoint endpoint;
+        Socks5::UpstreamStats stats;
+        uint32_t failuresInRow;
+        uint32_t ejectTime;
+        uint64_t ejectedUntil;
+        bool bProbing;
+    };
+
+    enum class HANDSHAKE_OUTCOME
+    {
+        SESSION = 0,        // session is established
+        REQUEST_FAILED,     // upstream is healthy, but request is refused (e.g. destination is unreachable)
+        UPSTREAM_FAILED     // fault of upstream
+    };
+
+    int32_t selectUpstream(uint64_t now, const std::vector<bool>& tried);
+    bool isAvailable(const Upstream& upstream, uint64_t now);
+    static double score(const Upstream& upstream);
+    static bool isUpstreamFault(Socks5::PROXY_ERROR error);
+    void finishHandshake(uint32_t index, HANDSHAKE_OUTCOME outcome, uint64_t rtt);
+
+    std::vector<Upstream> upstreams;
+    Socks5::BALANCE_POLICY policy;
+    std::atomic<uint32_t> handshakeTimeout{ 0 };
+    uint32_t ejectFailureCount = 3;
+    uint32_t firstEjectTime = 5000;
+    uint32_t maxEjectTime = 120000;
+    std::mutex mutex;
+};
+
+#endif
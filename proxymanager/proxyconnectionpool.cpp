@@ -0,0 +1,140 @@
+#include "proxyconnectionpool.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define POOL_CHECK_INTERVAL 1000 // mseconds
+
+static uint64_t poolTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+ProxyConnectionPool::ProxyConnectionPool(std::string ip, uint16_t port, std::string user, std::string password, uint32_t standbyCount, uint32_t maxIdleTime)
+	: proxyIP(ip), proxyPort(port), proxyUser(user), proxyPassword(password), standbyCount(standbyCount), maxIdleTime(maxIdleTime)
+{
+	thread = std::thread(&ProxyConnectionPool::refillThread, this);
+}
+
+ProxyConnectionPool::~ProxyConnectionPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bStopping = true;
+	}
+	condition.notify_all();
+	thread.join();
+}
+
+std::unique_ptr<ProxyManager> ProxyConnectionPool::acquire(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort, Socks5::PROXY_ERROR* error)
+{
+	while (true)
+	{
+		std::unique_ptr<ProxyManager> manager;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (idleConnections.empty())
+				break;
+			manager = std::move(idleConnections.back().manager);
+			idleConnections.pop_back();
+		}
+		condition.notify_all();
+
+		if (!isAlive(manager.get()))
+		{
+			evicted++;
+			continue;
+		}
+
+		hits++;
+		if (manager->commandToProxy(proxyMode, dstIP, dstPort))
+			return manager;
+		if (error != 0)
+			*error = manager->lastErrorCode();
+		return nullptr;
+	}
+
+	misses++;
+	condition.notify_all();
+	std::unique_ptr<ProxyManager> manager(new ProxyManager());
+	manager->setHandshakeTimeout(handshakeTimeout);
+	if (manager->connectToProxy(proxyIP, proxyPort, proxyUser, proxyPassword, proxyMode, dstIP, dstPort))
+		return manager;
+	if (error != 0)
+		*error = manager->lastErrorCode();
+	return nullptr;
+}
+
+Socks5::PoolStats ProxyConnectionPool::getStats()
+{
+	Socks5::PoolStats stats;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.evicted = evicted;
+	stats.refillErrors = refillErrors;
+	std::lock_guard<std::mutex> lock(mutex);
+	stats.idleCount = idleConnections.size();
+	return stats;
+}
+
+bool ProxyConnectionPool::isAlive(ProxyManager* manager)
+{
+	// proxy must be silent before command, so readable socket means EOF or error
+	char byte;
+	int32_t result = recv(manager->getTcpSocket(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+std::unique_ptr<ProxyManager> ProxyConnectionPool::createConnection()
+{
+	std::unique_ptr<ProxyManager> manager(new ProxyManager());
+	manager->setHandshakeTimeout(handshakeTimeout);
+	if (!manager->authenticateToProxy(proxyIP, proxyPort, proxyUser, proxyPassword))
+		return nullptr;
+	return manager;
+}
+
+void ProxyConnectionPool::refillThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!bStopping)
+	{
+		// evict idle and dead connections, oldest are at front
+		uint64_t now = poolTime();
+		for (auto it = idleConnections.begin(); it != idleConnections.end();)
+		{
+			if (now - it->idleSince >= maxIdleTime || !isAlive(it->manager.get()))
+			{
+				it = idleConnections.erase(it);
+				evicted++;
+			}
+			else ++it;
+		}
+
+		bool bRefillFailed = false;
+		while (!bStopping && idleConnections.size() < standbyCount)
+		{
+			lock.unlock();
+			std::unique_ptr<ProxyManager> manager = createConnection();
+			lock.lock();
+			if (!manager)
+			{
+				refillErrors++;
+				bRefillFailed = true;
+				break;
+			}
+			idleConnections.push_back(IdleConnection{ std::move(manager), poolTime() });
+		}
+
+		// after failure refill is retried by timer only, so unreachable proxy isn`t flooded
+		if (bRefillFailed)
+			condition.wait_for(lock, std::chrono::milliseconds(POOL_CHECK_INTERVAL));
+		else
+			condition.wait_for(lock, std::chrono::milliseconds(POOL_CHECK_INTERVAL), [this]() {
+				return bStopping || idleConnections.size() < standbyCount;
+			});
+	}
+	idleConnections.clear();
+}
@@ -0,0 +1,108 @@
+/******************************************************************************
+ * File: proxyconnectionpool.h
+ * Description: Pool of connections to proxy-server, which are already authenticated.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef PROXYCONNECTIONPOOL_H
+#define PROXYCONNECTIONPOOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    struct PoolStats
+    {
+        uint64_t    hits;           // acquire() got warm connection
+        uint64_t    misses;         // acquire() connected from scratch
+        uint64_t    evicted;        // idle or dead connections closed by pool
+        uint64_t    refillErrors;   // failed connects of background refill
+        uint32_t    idleCount;      // warm connections now
+    };
+
+    // default timeout (in mseconds) of handshake phases of pool connections, so refill and destruction
+    // of pool don`t wait for SYN timeout of kernel if proxy-server doesn`t answer
+    const uint32_t POOL_HANDSHAKE_TIMEOUT = 5000;
+}
+
+/**
+ * @class ProxyConnectionPool
+ * Keeps connections to one proxy-server past the auth phase (right before command),
+ * hands them out on demand and refills them in background thread.
+ */
+class ProxyConnectionPool
+{
+public:
+    /**
+     * Create pool and start background refill.
+     * @param ip IP address of proxy server.
+     * @param port port of proxy server.
+     * @param user login of proxy server or empty string if proxy without auth
+     * @param password password of proxy server or empty string if proxy without auth
+     * @param standbyCount count of warm connections, which pool keeps.
+     * @param maxIdleTime warm connection is closed after this time (in mseconds) of idle.
+     */
+    ProxyConnectionPool(std::string ip, uint16_t port, std::string user, std::string password, uint32_t standbyCount, uint32_t maxIdleTime = 60000);
+    ~ProxyConnectionPool();
+    ProxyConnectionPool(const ProxyConnectionPool&) = delete;
+    ProxyConnectionPool& operator=(const ProxyConnectionPool&) = delete;
+    /**
+     * Gets connected session. Warm connection is used if pool has it, else connection is created from scratch.
+     * @param proxyMode mode of proxy. Socks5::PROXY_MODE::CONNECTION (TCP connect) or Socks5::PROXY_MODE::UDP_ASSOCIATE (UDP connect).
+     * @param dstIP destination IP address (for CONNECTION mode).
+     * @param dstPort destination port (for CONNECTION mode).
+     * @param error pointer to variable for write error code (can be 0).
+     * @return connected session or nullptr if error.
+     */
+    std::unique_ptr<ProxyManager> acquire(Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0, Socks5::PROXY_ERROR* error = 0);
+    /**
+     * Set timeout of each handshake phase of pool connections (Socks5::POOL_HANDSHAKE_TIMEOUT by default).
+     * @param timeout timeout in mseconds, 0 is without timeout (destructor waits for refill in progress).
+     */
+    void setHandshakeTimeout(uint32_t timeout) { handshakeTimeout = timeout; }
+    /**
+     * Gets counters of pool.
+     * @return counters of pool.
+     */
+    Socks5::PoolStats getStats();
+
+private:
+    struct IdleConnection
+    {
+        std::unique_ptr<ProxyManager> manager;
+        uint64_t idleSince;
+    };
+
+    static bool isAlive(ProxyManager* manager);
+    std::unique_ptr<ProxyManager> createConnection();
+    void refillThread();
+
+    std::string proxyIP;
+    uint16_t proxyPort;
+    std::string proxyUser;
+    std::string proxyPassword;
+    uint32_t standbyCount;
+    uint32_t maxIdleTime;
+    std::atomic<uint32_t> handshakeTimeout{ Socks5::POOL_HANDSHAKE_TIMEOUT };
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<IdleConnection> idleConnections; // newest at back
+    bool bStopping = false;
+    std::thread thread;
+
+    std::atomic<uint64_t> hits{ 0 };
+    std::atomic<uint64_t> misses{ 0 };
+    std::atomic<uint64_t> evicted{ 0 };
+    std::atomic<uint64_t> refillErrors{ 0 };
+};
+
+#endif
@@ -1,405 +1,1872 @@
 #include "proxymanager.h"
+#include "socks5codec.h"
+#include "resolvercache.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 bool ProxyManager::isForceMainAddress = false;
 
+// keepalive probes without answer, after which connection is closed (TCP_USER_TIMEOUT closes it earlier)
+#define KEEPALIVE_PROBES 8
+
 ProxyManager::~ProxyManager()
 {
-	closeConnection();
+	closeConnection();
+}
+
+bool ProxyManager::connectToProxy(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	if (!beginConnect(ip, port, user, password, proxyMode, dstIP, dstPort))
+		return false;
+
+	return waitHandshake(proxyMode == Socks5::PROXY_MODE::BIND ? Socks5::HANDSHAKE_STATE::BOUND : Socks5::HANDSHAKE_STATE::ESTABLISHED);
+}
+
+bool ProxyManager::authenticateToProxy(std::string ip, uint16_t port, std::string user, std::string password)
+{
+	if (!beginAuthenticate(ip, port, user, password))
+		return false;
+
+	return waitHandshake(Socks5::HANDSHAKE_STATE::AUTHENTICATED);
+}
+
+bool ProxyManager::commandToProxy(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	if (!beginCommand(proxyMode, dstIP, dstPort))
+		return false;
+
+	return waitHandshake(proxyMode == Socks5::PROXY_MODE::BIND ? Socks5::HANDSHAKE_STATE::BOUND : Socks5::HANDSHAKE_STATE::ESTABLISHED);
+}
+
+bool ProxyManager::acceptBind(uint32_t timeout)
+{
+	// waiting for peer isn`t handshake phase, so it has own timeout
+	uint64_t startTime = monotonicTime();
+	while (advanceHandshake() == Socks5::HANDSHAKE_STATE::BOUND)
+	{
+		int32_t pollTimeout = -1;
+		if (timeout != 0)
+		{
+			uint64_t elapsed = monotonicTime() - startTime;
+			if (elapsed >= timeout)
+			{
+				errorCode = Socks5::PROXY_ERROR::TIMEOUT;
+				return false;
+			}
+			pollTimeout = (int32_t)(timeout - elapsed);
+		}
+
+		struct pollfd pollFd;
+		pollFd.fd = tcpConnection;
+		pollFd.events = POLLIN;
+		pollFd.revents = 0;
+		if (poll(&pollFd, 1, pollTimeout) < 0 && errno != EINTR)
+		{
+			failHandshake(Socks5::PROXY_ERROR::NETWORK);
+			return false;
+		}
+	}
+
+	if (handshakeState != Socks5::HANDSHAKE_STATE::ESTABLISHED)
+	{
+		if (handshakeState != Socks5::HANDSHAKE_STATE::FAILED)
+			errorCode = Socks5::PROXY_ERROR::CONNECTION;
+		return false;
+	}
+	// synchronous API works with blocking TCP socket
+	int flags = fcntl(tcpConnection, F_GETFL, 0);
+	fcntl(tcpConnection, F_SETFL, flags & ~O_NONBLOCK);
+	return true;
+}
+
+bool ProxyManager::waitHandshake(Socks5::HANDSHAKE_STATE targetState)
+{
+	while (advanceHandshake() != targetState)
+	{
+		if (handshakeState == Socks5::HANDSHAKE_STATE::FAILED)
+			return false;
+
+		struct pollfd pollFd;
+		pollFd.fd = tcpConnection;
+		pollFd.events = (handshakeWaitMode() & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND)) ? POLLOUT : POLLIN;
+		pollFd.revents = 0;
+		int32_t pollTimeout = -1;
+		if (handshakeTimeout != 0)
+		{
+			uint64_t elapsed = monotonicTime() - phaseStartTime;
+			pollTimeout = elapsed < handshakeTimeout ? (int32_t)(handshakeTimeout - elapsed) : 0;
+		}
+		if (poll(&pollFd, 1, pollTimeout) < 0 && errno != EINTR)
+		{
+			failHandshake(Socks5::PROXY_ERROR::NETWORK);
+			return false;
+		}
+		if (checkHandshakeTimeout())
+			return false;
+	}
+
+	if (targetState == Socks5::HANDSHAKE_STATE::ESTABLISHED)
+	{
+		// synchronous API works with blocking TCP socket
+		int flags = fcntl(tcpConnection, F_GETFL, 0);
+		fcntl(tcpConnection, F_SETFL, flags & ~O_NONBLOCK);
+	}
+	return true;
+}
+
+std::unique_ptr<ProxyManager> ProxyManager::connectRace(const std::vector<Socks5::ProxyEndpoint>& endpoints, Socks5::PROXY_MODE proxyMode,
+	std::string dstIP, uint16_t dstPort, uint32_t deadline, uint32_t stagger, Socks5::PROXY_ERROR* error, uint32_t* endpoint)
+{
+	std::vector<std::unique_ptr<ProxyManager>> racers(endpoints.size());
+	Socks5::PROXY_ERROR lastError = Socks5::PROXY_ERROR::CONNECTION;
+	uint64_t start = monotonicTime();
+	uint64_t nextStart = start;
+	uint32_t nextIndex = 0;
+	int32_t connected = -1; // racer past TCP connect
+
+	while (true)
+	{
+		uint64_t now = monotonicTime();
+		if (now - start >= deadline)
+		{
+			lastError = Socks5::PROXY_ERROR::TIMEOUT;
+			break;
+		}
+
+		std::vector<struct pollfd> pollFds;
+		std::vector<uint32_t> pollIndexes;
+		for (uint32_t i = 0; i < racers.size(); i++)
+		{
+			if (!racers[i])
+				continue;
+			struct pollfd pollFd;
+			pollFd.fd = racers[i]->tcpConnection;
+			pollFd.events = (racers[i]->handshakeWaitMode() & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND)) ? POLLOUT : POLLIN;
+			pollFd.revents = 0;
+			pollFds.push_back(pollFd);
+			pollIndexes.push_back(i);
+		}
+
+		// next connect is started after stagger delay, or at once if nothing is in progress
+		bool bCanStart = connected < 0 && nextIndex < racers.size();
+		if (bCanStart && (now >= nextStart || pollFds.empty()))
+		{
+			uint32_t index = nextIndex++;
+			nextStart = now + stagger;
+			racers[index].reset(new ProxyManager());
+			const Socks5::ProxyEndpoint& candidate = endpoints[index];
+			if (!racers[index]->beginConnect(candidate.ip, candidate.port, candidate.user, candidate.password, proxyMode, dstIP, dstPort))
+			{
+				lastError = racers[index]->lastErrorCode();
+				racers[index].reset();
+			}
+			continue;
+		}
+		if (pollFds.empty())
+			break;
+
+		uint64_t wakeTime = start + deadline;
+		if (bCanStart && nextStart < wakeTime)
+			wakeTime = nextStart;
+		if (poll(pollFds.data(), pollFds.size(), (int32_t)(wakeTime - now)) < 0 && errno != EINTR)
+		{
+			lastError = Socks5::PROXY_ERROR::NETWORK;
+			break;
+		}
+
+		for (uint32_t i = 0; i < pollFds.size(); i++)
+		{
+			uint32_t index = pollIndexes[i];
+			if (pollFds[i].revents == 0 || !racers[index])
+				continue;
+
+			Socks5::HANDSHAKE_STATE state = racers[index]->advanceHandshake();
+			if (state == Socks5::HANDSHAKE_STATE::FAILED)
+			{
+				lastError = racers[index]->lastErrorCode();
+				racers[index].reset();
+				if (connected == (int32_t)index)
+				{
+					connected = -1;
+					nextStart = monotonicTime();
+				}
+			}
+			else if (state == Socks5::HANDSHAKE_STATE::ESTABLISHED)
+			{
+				// synchronous API works with blocking TCP socket
+				int flags = fcntl(racers[index]->tcpConnection, F_GETFL, 0);
+				fcntl(racers[index]->tcpConnection, F_SETFL, flags & ~O_NONBLOCK);
+				if (endpoint != 0)
+					*endpoint = index;
+				return std::move(racers[index]);
+			}
+			else if (connected < 0 && state != Socks5::HANDSHAKE_STATE::CONNECTING)
+			{
+				// first TCP connect wins, other connects are canceled
+				connected = index;
+				for (uint32_t j = 0; j < racers.size(); j++)
+				{
+					if (j != index)
+						racers[j].reset();
+				}
+			}
+		}
+	}
+
+	if (error != 0)
+		*error = lastError;
+	return nullptr;
+}
+
+bool ProxyManager::beginConnect(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	closeConnection();
+	if (!setCommand(proxyMode, dstIP, dstPort))
+		return false;
+
+	bStopAfterAuth = false;
+	bPipelineActive = bPipelinedHandshake;
+	return startConnect(ip, port, user, password);
+}
+
+bool ProxyManager::beginAuthenticate(std::string ip, uint16_t port, std::string user, std::string password)
+{
+	closeConnection();
+	bStopAfterAuth = true;
+	bPipelineActive = false;
+	return startConnect(ip, port, user, password);
+}
+
+bool ProxyManager::beginCommand(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	if (handshakeState != Socks5::HANDSHAKE_STATE::AUTHENTICATED)
+	{
+		errorCode = Socks5::PROXY_ERROR::CONNECTION;
+		return false;
+	}
+	if (!setCommand(proxyMode, dstIP, dstPort))
+	{
+		failHandshake(Socks5::PROXY_ERROR::DST_HOST);
+		return false;
+	}
+
+	prepareRequest();
+	return true;
+}
+
+bool ProxyManager::setCommand(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+{
+	this->proxyMode = proxyMode;
+	if (isStreamMode())
+	{
+		if (dstPort == 0 || !makeAddress(dstIP, dstPort, &handshakeDst))
+		{
+			errorCode = Socks5::PROXY_ERROR::DST_HOST;
+			handshakeState = Socks5::HANDSHAKE_STATE::FAILED;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ProxyManager::startConnect(std::string ip, uint16_t port, std::string user, std::string password)
+{
+	handshakeUser = user;
+	handshakePassword = password;
+	proxyHost = ip;
+	proxyPort = port;
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::CONNECTING);
+
+	memset(&mainProxyAddr, 0, sizeof(mainProxyAddr));
+	struct sockaddr_in* hostAddr = (struct sockaddr_in*)&mainProxyAddr;
+	struct sockaddr_in6* hostAddr6 = (struct sockaddr_in6*)&mainProxyAddr;
+	if (inet_pton(AF_INET, ip.c_str(), &hostAddr->sin_addr) == 1)
+	{
+		hostAddr->sin_family = AF_INET;
+		hostAddr->sin_port = htons(port); // proxy port
+		mainProxyAddrLength = sizeof(struct sockaddr_in);
+	}
+	else if (inet_pton(AF_INET6, ip.c_str(), &hostAddr6->sin6_addr) == 1)
+	{
+		hostAddr6->sin6_family = AF_INET6;
+		hostAddr6->sin6_port = htons(port);
+		mainProxyAddrLength = sizeof(struct sockaddr_in6);
+	}
+	else if (!ResolverCache::global().resolve(ip, port, &mainProxyAddr, &mainProxyAddrLength))
+	{
+		failHandshake(Socks5::PROXY_ERROR::CONNECTION);
+		return false;
+	}
+	return openConnection();
+}
+
+bool ProxyManager::openConnection()
+{
+	tcpConnection = socket(mainProxyAddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (tcpConnection < 0)
+	{
+		failHandshake(Socks5::PROXY_ERROR::CONNECTION);
+		return false;
+	}
+	applyKeepalive();
+	bSessionLost.store(false, std::memory_order_relaxed);
+	lastHealthCheck.store(0, std::memory_order_relaxed);
+
+	fastOpenSent = 0;
+	if (bPipelineActive && bFastOpen)
+	{
+		// connect is started by sending of flight, it goes in SYN if proxy-server gave TFO cookie before
+		uint8_t flight[Socks5::HANDSHAKE_BUFFER_SIZE];
+		uint16_t flightLength = encodeGreeting(flight, true);
+		if (flightLength != 0)
+		{
+			ssize_t result = sendto(tcpConnection, flight, flightLength, MSG_FASTOPEN | MSG_NOSIGNAL, (sockaddr*)&mainProxyAddr, mainProxyAddrLength);
+			if (result >= 0)
+			{
+				fastOpenSent = result;
+				return true;
+			}
+			// without cookie SYN is sent without data
+			if (errno == EINPROGRESS)
+				return true;
+			// else TFO isn`t supported and socket isn`t connected yet
+		}
+	}
+
+	if (connect(tcpConnection, (sockaddr*)&mainProxyAddr, mainProxyAddrLength) != 0 && errno != EINPROGRESS)
+	{
+		failHandshake(Socks5::PROXY_ERROR::CONNECTION);
+		return false;
+	}
+	return true;
+}
+
+void ProxyManager::restartStepByStep()
+{
+	// proxy-server doesn`t accept pipelined messages, so handshake is repeated on new connection
+	bPipelineActive = false;
+	close(tcpConnection);
+	tcpConnection = -1;
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::CONNECTING);
+	openConnection();
+}
+
+Socks5::HANDSHAKE_STATE ProxyManager::advanceHandshake()
+{
+	while (true)
+	{
+		switch (handshakeState)
+		{
+		case Socks5::HANDSHAKE_STATE::CONNECTING:
+		{
+			struct pollfd pollFd;
+			pollFd.fd = tcpConnection;
+			pollFd.events = POLLOUT;
+			pollFd.revents = 0;
+			if (poll(&pollFd, 1, 0) <= 0)
+				return handshakeState;
+
+			int socketError = 0;
+			socklen_t socketErrorLength = sizeof(socketError);
+			if (getsockopt(tcpConnection, SOL_SOCKET, SO_ERROR, &socketError, &socketErrorLength) != 0 || socketError != 0)
+			{
+				failHandshake(Socks5::PROXY_ERROR::CONNECTION);
+				return handshakeState;
+			}
+			prepareGreeting();
+			break;
+		}
+		case Socks5::HANDSHAKE_STATE::GREETING:
+		{
+			int32_t result = transferHandshake(2, Socks5::PROXY_ERROR::PROTOCOL);
+			if (result <= 0)
+				return handshakeState;
+
+			Socks5::MethodReply reply = Socks5::Codec::parseMethodReply({ handshakeBuffer, handshakeRxLength });
+			if (reply.status != Socks5::PARSE_STATUS::OK)
+			{
+				failHandshake(Socks5::PROXY_ERROR::PROTOCOL);
+				return handshakeState;
+			}
+			bool bAuth = !handshakeUser.empty() && !handshakePassword.empty();
+			if (reply.method == 0x00 && bAuth && bPipelineActive)
+			{
+				// credentials, which were sent in flight, would be read as command
+				restartStepByStep();
+				break;
+			}
+			if (reply.method == 0x00)
+				finishAuth();
+			else if (bAuth && reply.method == 0x02 && bPipelineActive)
+				setHandshakePhase(Socks5::HANDSHAKE_STATE::AUTH); // request was sent in flight
+			else if (bAuth && reply.method == 0x02)
+				prepareAuth();
+			else
+			{
+				failHandshake(Socks5::PROXY_ERROR::AUTH_METHOD);
+				return handshakeState;
+			}
+			break;
+		}
+		case Socks5::HANDSHAKE_STATE::AUTH:
+		{
+			int32_t result = transferHandshake(2, Socks5::PROXY_ERROR::NETWORK);
+			if (result <= 0)
+				return handshakeState;
+
+			Socks5::AuthReply reply = Socks5::Codec::parseAuthReply({ handshakeBuffer, handshakeRxLength });
+			if (reply.status != Socks5::PARSE_STATUS::OK)
+			{
+				failHandshake(Socks5::PROXY_ERROR::PROTOCOL);
+				return handshakeState;
+			}
+			if (reply.code != 0x00)
+			{
+				failHandshake(Socks5::PROXY_ERROR::SIGNIN);
+				return handshakeState;
+			}
+			finishAuth();
+			break;
+		}
+		case Socks5::HANDSHAKE_STATE::BOUND:
+		{
+			// pending BIND takes buffer only when second reply arrives
+			if (handshakeBuffer == 0)
+			{
+				struct pollfd pollFd;
+				pollFd.fd = tcpConnection;
+				pollFd.events = POLLIN;
+				pollFd.revents = 0;
+				if (poll(&pollFd, 1, 0) <= 0 || !acquireHandshakeBuffer())
+					return handshakeState;
+			}
+		}
+		[[fallthrough]];
+		case Socks5::HANDSHAKE_STATE::REQUEST:
+		{
+			// reply has variable length: VER REP RSV ATYP, address (its length depends on ATYP), port
+			int32_t result = transferHandshake(5, Socks5::PROXY_ERROR::NETWORK);
+			if (result > 0)
+			{
+				Socks5::CommandReply reply = Socks5::Codec::parseCommandReply({ handshakeBuffer, handshakeRxLength });
+				if (reply.status == Socks5::PARSE_STATUS::INVALID)
+				{
+					failHandshake(Socks5::PROXY_ERROR::PROTOCOL);
+					return handshakeState;
+				}
+				result = transferHandshake(reply.length, Socks5::PROXY_ERROR::NETWORK);
+			}
+			if (result <= 0)
+				return handshakeState;
+
+			finishRequest();
+			return handshakeState;
+		}
+		default:
+			return handshakeState;
+		}
+	}
+}
+
+uint32_t ProxyManager::handshakeWaitMode()
+{
+	if (handshakeState == Socks5::HANDSHAKE_STATE::CONNECTING || handshakeTxOffset < handshakeTxLength)
+		return static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND);
+	if (handshakeState == Socks5::HANDSHAKE_STATE::GREETING ||
+		handshakeState == Socks5::HANDSHAKE_STATE::AUTH ||
+		handshakeState == Socks5::HANDSHAKE_STATE::REQUEST ||
+		handshakeState == Socks5::HANDSHAKE_STATE::BOUND)
+		return static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE);
+	return static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_NONE);
+}
+
+bool ProxyManager::checkHandshakeTimeout()
+{
+	if (handshakeTimeout == 0 || handshakeState == Socks5::HANDSHAKE_STATE::NONE ||
+		handshakeState == Socks5::HANDSHAKE_STATE::AUTHENTICATED || handshakeState == Socks5::HANDSHAKE_STATE::BOUND ||
+		handshakeState == Socks5::HANDSHAKE_STATE::ESTABLISHED || handshakeState == Socks5::HANDSHAKE_STATE::FAILED)
+		return false;
+
+	if (monotonicTime() - phaseStartTime < handshakeTimeout)
+		return false;
+
+	failHandshake(Socks5::PROXY_ERROR::TIMEOUT);
+	return true;
+}
+
+uint64_t ProxyManager::monotonicTime()
+{
+	return monotonicMicros() / 1000;
+}
+
+uint64_t ProxyManager::monotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void ProxyManager::setHandshakePhase(Socks5::HANDSHAKE_STATE state)
+{
+	uint64_t now = monotonicMicros();
+	ProxyMetrics& metrics = ProxyMetrics::global();
+	switch (handshakeState)
+	{
+	case Socks5::HANDSHAKE_STATE::CONNECTING:
+		metrics.recordPhase(Socks5::HANDSHAKE_PHASE::CONNECT, now - phaseStartMicros);
+		break;
+	case Socks5::HANDSHAKE_STATE::GREETING:
+		metrics.recordPhase(Socks5::HANDSHAKE_PHASE::METHOD, now - phaseStartMicros);
+		break;
+	case Socks5::HANDSHAKE_STATE::AUTH:
+		metrics.recordPhase(Socks5::HANDSHAKE_PHASE::AUTH, now - phaseStartMicros);
+		break;
+	case Socks5::HANDSHAKE_STATE::REQUEST:
+		metrics.recordPhase(Socks5::HANDSHAKE_PHASE::COMMAND, now - phaseStartMicros);
+		break;
+	default:
+		break;
+	}
+	if (state == Socks5::HANDSHAKE_STATE::CONNECTING)
+		metrics.recordStarted();
+	else if (state == Socks5::HANDSHAKE_STATE::ESTABLISHED)
+		metrics.recordEstablished();
+
+	handshakeState = state;
+	handshakeTxLength = 0;
+	handshakeTxOffset = 0;
+	handshakeRxLength = 0;
+	phaseStartMicros = now;
+	phaseStartTime = now / 1000;
+
+	if (state == Socks5::HANDSHAKE_STATE::GREETING || state == Socks5::HANDSHAKE_STATE::AUTH || state == Socks5::HANDSHAKE_STATE::REQUEST)
+		acquireHandshakeBuffer();
+	else
+	{
+		handshakeStorage.reset();
+		handshakeBuffer = 0;
+	}
+}
+
+bool ProxyManager::acquireHandshakeBuffer()
+{
+	if (!handshakeStorage.isValid())
+	{
+		handshakeStorage = BufferPool::global().acquire(Socks5::HANDSHAKE_BUFFER_SIZE);
+		handshakeBuffer = (uint8_t*)handshakeStorage.data();
+		if (handshakeBuffer == 0)
+		{
+			failHandshake(Socks5::PROXY_ERROR::MEMORY);
+			return false;
+		}
+	}
+	return true;
+}
+
+void ProxyManager::prepareGreeting()
+{
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::GREETING);
+	if (handshakeBuffer == 0)
+		return;
+	handshakeTxLength = encodeGreeting({ handshakeBuffer, Socks5::HANDSHAKE_BUFFER_SIZE }, bPipelineActive);
+	// data, which was sent in SYN, isn`t sent again
+	handshakeTxOffset = fastOpenSent;
+	fastOpenSent = 0;
+	if (handshakeTxLength == 0)
+		failHandshake(Socks5::PROXY_ERROR::DST_HOST);
+}
+
+uint16_t ProxyManager::encodeGreeting(std::span<uint8_t> out, bool bPipelined)
+{
+	constexpr auto noAuthGreeting = Socks5::Codec::encodeGreeting<0x00>();
+	constexpr auto passwordGreeting = Socks5::Codec::encodeGreeting<0x02>();
+	bool bAuth = !handshakeUser.empty() && !handshakePassword.empty();
+	const auto& greeting = bAuth ? passwordGreeting : noAuthGreeting;
+	memcpy(out.data(), greeting.data(), greeting.size());
+	uint16_t length = greeting.size();
+	if (!bPipelined)
+		return length;
+
+	// flight: greeting, RFC1929 request and command one after another
+	if (bAuth)
+	{
+		uint16_t authLength = Socks5::Codec::encodeAuth(out.subspan(length), handshakeUser, handshakePassword);
+		if (authLength == 0)
+			return 0;
+		length += authLength;
+	}
+	uint16_t requestLength = encodeCommand(out.subspan(length));
+	return requestLength != 0 ? length + requestLength : 0;
+}
+
+void ProxyManager::prepareAuth()
+{
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::AUTH);
+	if (handshakeBuffer == 0)
+		return;
+	handshakeTxLength = Socks5::Codec::encodeAuth({ handshakeBuffer, Socks5::HANDSHAKE_BUFFER_SIZE }, handshakeUser, handshakePassword);
+	if (handshakeTxLength == 0)
+		failHandshake(Socks5::PROXY_ERROR::SIGNIN);
+}
+
+void ProxyManager::finishAuth()
+{
+	// connection waits for beginCommand()
+	if (bStopAfterAuth)
+		setHandshakePhase(Socks5::HANDSHAKE_STATE::AUTHENTICATED);
+	else if (bPipelineActive)
+		setHandshakePhase(Socks5::HANDSHAKE_STATE::REQUEST); // request was sent in flight
+	else
+		prepareRequest();
+}
+
+void ProxyManager::prepareRequest()
+{
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::REQUEST);
+	if (handshakeBuffer == 0)
+		return;
+	handshakeTxLength = encodeCommand({ handshakeBuffer, Socks5::HANDSHAKE_BUFFER_SIZE });
+	if (handshakeTxLength == 0)
+		failHandshake(Socks5::PROXY_ERROR::DST_HOST);
+}
+
+uint16_t ProxyManager::encodeCommand(std::span<uint8_t> out)
+{
+	if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		// any address of the same family as proxy
+		memset(&handshakeDst, 0, sizeof(handshakeDst));
+		handshakeDst.byteAddressType = mainProxyAddr.ss_family == AF_INET6 ? 4 : 1;
+		handshakeDst.byteLength = mainProxyAddr.ss_family == AF_INET6 ? 16 : 4;
+	}
+	// tcp connection = 1, tcp binding = 2,  udp = 3
+	return Socks5::Codec::encodeRequest(out, proxyMode, handshakeDst);
+}
+
+int32_t ProxyManager::transferHandshake(uint16_t expectedLength, Socks5::PROXY_ERROR receiveError)
+{
+	while (handshakeTxOffset < handshakeTxLength)
+	{
+		ssize_t result = ::send(tcpConnection, handshakeBuffer + handshakeTxOffset, handshakeTxLength - handshakeTxOffset, MSG_NOSIGNAL);
+		if (result < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			failTransfer(Socks5::PROXY_ERROR::NETWORK);
+			return -1;
+		}
+		handshakeTxOffset += result;
+	}
+	// request is sent, buffer is reused for reply
+	handshakeTxLength = 0;
+	handshakeTxOffset = 0;
+
+	// reply is read exactly, so next reply (or data) isn`t consumed
+	while (handshakeRxLength < expectedLength)
+	{
+		ssize_t result = recv(tcpConnection, handshakeBuffer + handshakeRxLength, expectedLength - handshakeRxLength, 0);
+		if (result < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			failTransfer(receiveError);
+			return -1;
+		}
+		if (result == 0)
+		{
+			failTransfer(receiveError);
+			return -1;
+		}
+		handshakeRxLength += result;
+	}
+	return 1;
+}
+
+static void copyAddress(const Socks5::AddressView& view, Socks5::Address* address)
+{
+	address->byteAddressType = view.byteAddressType;
+	address->byteLength = view.byteLength;
+	memcpy(address->bytes, view.bytes, view.byteLength);
+	address->usPort = view.usPort;
+}
+
+void ProxyManager::finishRequest()
+{
+	Socks5::CommandReply reply = Socks5::Codec::parseCommandReply({ handshakeBuffer, handshakeRxLength });
+	if (reply.status != Socks5::PARSE_STATUS::OK)
+	{
+		failHandshake(Socks5::PROXY_ERROR::PROTOCOL);
+		return;
+	}
+	if (reply.reply != 0x00)
+	{
+		if (reply.reply < 9)
+			failHandshake(static_cast<Socks5::PROXY_ERROR>((uint8_t)Socks5::PROXY_ERROR::SIGNIN + reply.reply));
+		else
+			failHandshake(Socks5::PROXY_ERROR::UNKNOW);
+		return;
+	}
+
+	static const uint8_t anyAddress[16] = { 0 };
+	if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		const Socks5::AddressView& relay = reply.bound;
+		// unspecified or domain relay address means address of proxy
+		bool bUseMain = isForceMainAddress || relay.byteAddressType == 3 ||
+			memcmp(relay.bytes, anyAddress, relay.byteLength) == 0;
+		memset(&udpProxyAddr, 0, sizeof(udpProxyAddr));
+		if (bUseMain)
+		{
+			memcpy(&udpProxyAddr, &mainProxyAddr, mainProxyAddrLength);
+			udpProxyAddrLength = mainProxyAddrLength;
+		}
+		else if (relay.byteAddressType == 1)
+		{
+			udpProxyAddr.ss_family = AF_INET;
+			memcpy(&((struct sockaddr_in*)&udpProxyAddr)->sin_addr, relay.bytes, 4);
+			udpProxyAddrLength = sizeof(struct sockaddr_in);
+		}
+		else
+		{
+			udpProxyAddr.ss_family = AF_INET6;
+			memcpy(&((struct sockaddr_in6*)&udpProxyAddr)->sin6_addr, relay.bytes, 16);
+			udpProxyAddrLength = sizeof(struct sockaddr_in6);
+		}
+		if (udpProxyAddr.ss_family == AF_INET6)
+			((struct sockaddr_in6*)&udpProxyAddr)->sin6_port = relay.usPort;
+		else
+			((struct sockaddr_in*)&udpProxyAddr)->sin_port = relay.usPort;
+
+		udpConnection = socket(udpProxyAddr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+		unsigned long nonblock = 1;
+		ioctl(udpConnection, FIONBIO, &nonblock);
+		struct sockaddr_storage localaddr;
+		memset(&localaddr, 0, sizeof(localaddr));
+		localaddr.ss_family = udpProxyAddr.ss_family; // Any local address and port will do
+		if (bind(udpConnection, (struct sockaddr*)&localaddr, udpProxyAddrLength) != 0)
+		{
+			close(udpConnection);
+			udpConnection = -1;
+			failHandshake(Socks5::PROXY_ERROR::UDP_BIND);
+			return;
+		}
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::BIND && handshakeState == Socks5::HANDSHAKE_STATE::REQUEST)
+	{
+		// first reply gives address, which proxy-server listens on, peer can`t connect to unspecified one
+		copyAddress(reply.bound, &boundAddress);
+		if (isForceMainAddress || (boundAddress.byteAddressType != 3 && memcmp(boundAddress.bytes, anyAddress, boundAddress.byteLength) == 0))
+		{
+			bool bIPv6 = mainProxyAddr.ss_family == AF_INET6;
+			boundAddress.byteAddressType = bIPv6 ? 4 : 1;
+			boundAddress.byteLength = bIPv6 ? 16 : 4;
+			if (bIPv6)
+				memcpy(boundAddress.bytes, &((struct sockaddr_in6*)&mainProxyAddr)->sin6_addr, 16);
+			else
+				memcpy(boundAddress.bytes, &((struct sockaddr_in*)&mainProxyAddr)->sin_addr, 4);
+		}
+		// second reply comes after unknown time, so it is read step by step
+		bPipelineActive = false;
+		setHandshakePhase(Socks5::HANDSHAKE_STATE::BOUND);
+		return;
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::BIND)
+		copyAddress(reply.bound, &peerAddress);
+	else if (proxyMode != Socks5::PROXY_MODE::CONNECTION)
+	{
+		failHandshake(Socks5::PROXY_ERROR::COMMAND_NOT_SUPPORT);
+		return;
+	}
+
+	setHandshakePhase(Socks5::HANDSHAKE_STATE::ESTABLISHED);
+	bConnected = true;
+}
+
+void ProxyManager::failTransfer(Socks5::PROXY_ERROR error)
+{
+	// proxy-server, which drops pipelined connection, gets one more chance step by step
+	if (bPipelineActive)
+		restartStepByStep();
+	else
+		failHandshake(error);
+}
+
+void ProxyManager::failHandshake(Socks5::PROXY_ERROR error)
+{
+	errorCode = error;
+	ProxyMetrics::global().recordError(static_cast<uint32_t>(error));
+	handshakeStorage.reset();
+	handshakeBuffer = 0;
+	if (tcpConnection >= 0)
+	{
+		close(tcpConnection);
+		tcpConnection = -1;
+	}
+	handshakeState = Socks5::HANDSHAKE_STATE::FAILED;
+}
+
+void ProxyManager::closeConnection()
+{
+	if (!bConnected)
+	{
+		// handshake can be in progress
+		if (tcpConnection >= 0)
+		{
+			close(tcpConnection);
+			tcpConnection = -1;
+		}
+		handshakeState = Socks5::HANDSHAKE_STATE::NONE;
+		handshakeStorage.reset();
+		handshakeBuffer = 0;
+		return;
+	}
+
+	if(proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		udpUring.release();
+		udpReassembler.release();
+		close(udpConnection);
+		udpConnection = -1;
+	}
+
+	close(tcpConnection);
+	tcpConnection = -1;
+	handshakeState = Socks5::HANDSHAKE_STATE::NONE;
+	bConnected = false;
+
+	// traffic of session is kept in process-wide totals
+	ProxyMetrics::global().recordClosedSession(getSessionStats());
+	counters.bytesSent.store(0, std::memory_order_relaxed);
+	counters.bytesReceived.store(0, std::memory_order_relaxed);
+	counters.packetsSent.store(0, std::memory_order_relaxed);
+	counters.packetsReceived.store(0, std::memory_order_relaxed);
+	counters.droppedDatagrams.store(0, std::memory_order_relaxed);
+}
+
+Socks5::SessionStats ProxyManager::getSessionStats()
+{
+	Socks5::SessionStats stats;
+	stats.bytesSent = counters.bytesSent.load(std::memory_order_relaxed);
+	stats.bytesReceived = counters.bytesReceived.load(std::memory_order_relaxed);
+	stats.packetsSent = counters.packetsSent.load(std::memory_order_relaxed);
+	stats.packetsReceived = counters.packetsReceived.load(std::memory_order_relaxed);
+	stats.droppedDatagrams = counters.droppedDatagrams.load(std::memory_order_relaxed);
+	return stats;
+}
+
+int32_t ProxyManager::countSent(int32_t result)
+{
+	if (result >= 0)
+	{
+		counters.bytesSent.fetch_add(result, std::memory_order_relaxed);
+		counters.packetsSent.fetch_add(1, std::memory_order_relaxed);
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		counters.droppedDatagrams.fetch_add(1, std::memory_order_relaxed);
+	return result;
+}
+
+int32_t ProxyManager::countReceived(int32_t result)
+{
+	if (result > 0)
+	{
+		counters.bytesReceived.fetch_add(result, std::memory_order_relaxed);
+		counters.packetsReceived.fetch_add(1, std::memory_order_relaxed);
+	}
+	else if (result < 0 && proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		counters.droppedDatagrams.fetch_add(1, std::memory_order_relaxed);
+	return result;
+}
+
+int32_t ProxyManager::countTruncated(int32_t length, int32_t bufferSize)
+{
+	// tail of reassembled datagram, which doesn`t fit into buffer, is dropped
+	if (length <= bufferSize)
+		return length;
+	counters.droppedDatagrams.fetch_add(1, std::memory_order_relaxed);
+	return bufferSize;
+}
+
+int32_t ProxyManager::streamReceived(int32_t result)
+{
+	// end of stream and reset of connection are told apart from "no data yet" of non-blocking socket
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		errorCode = Socks5::PROXY_ERROR::WOULD_BLOCK;
+	else if (result < 0 && errno == EINTR)
+		errorCode = Socks5::PROXY_ERROR::NETWORK;
+	else if (result <= 0)
+	{
+		errorCode = Socks5::PROXY_ERROR::SESSION_CLOSED;
+		loseSession();
+	}
+	return countReceived(result);
+}
+
+int32_t ProxyManager::failReceive()
+{
+	// relay socket doesn`t see death of association, so control connection is checked,
+	// but not more often than HEALTH_CHECK_INTERVAL
+	int error = errno;
+	bool bAlive = !bSessionLost.load(std::memory_order_relaxed);
+	uint64_t now = monotonicTime();
+	uint64_t lastCheck = lastHealthCheck.load(std::memory_order_relaxed);
+	if (now - lastCheck >= Socks5::HEALTH_CHECK_INTERVAL &&
+		lastHealthCheck.compare_exchange_strong(lastCheck, now, std::memory_order_relaxed))
+		bAlive = checkSession();
+
+	if (!bAlive)
+		errorCode = Socks5::PROXY_ERROR::SESSION_CLOSED;
+	else if (error == EAGAIN || error == EWOULDBLOCK)
+		errorCode = Socks5::PROXY_ERROR::WOULD_BLOCK;
+	else
+		errorCode = Socks5::PROXY_ERROR::NETWORK;
+	// callers wait for readiness by errno of socket
+	errno = error;
+	return -1;
+}
+
+int32_t ProxyManager::uringSent(int32_t result)
+{
+	// ring reports failed send completions by later sends, so they are told by error code, not only by errno
+	if (result < 0)
+		errorCode = errno == EAGAIN ? Socks5::PROXY_ERROR::WOULD_BLOCK : Socks5::PROXY_ERROR::NETWORK;
+	return result;
+}
+
+bool ProxyManager::probeSession()
+{
+	// proxy-server sends nothing on control connection, so end of stream or error of socket means closed session
+	char byte;
+	ssize_t result = recv(tcpConnection, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return result > 0 || (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+void ProxyManager::loseSession()
+{
+	// closed session is counted once, WOULD_BLOCK of non-blocking reads isn`t counted at all
+	if (!bSessionLost.exchange(true, std::memory_order_relaxed))
+		ProxyMetrics::global().recordError(static_cast<uint32_t>(Socks5::PROXY_ERROR::SESSION_CLOSED));
+}
+
+bool ProxyManager::checkSession()
+{
+	if (!bConnected)
+		return false;
+
+	lastHealthCheck.store(monotonicTime(), std::memory_order_relaxed);
+	if (!bSessionLost.load(std::memory_order_relaxed) && probeSession())
+		return true;
+	loseSession();
+	if (bReassociation && proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE && reassociate())
+		return true;
+	errorCode = Socks5::PROXY_ERROR::SESSION_CLOSED;
+	return false;
+}
+
+bool ProxyManager::setKeepalive(uint32_t detectionTime)
+{
+	keepaliveTime = detectionTime;
+	return tcpConnection < 0 || applyKeepalive();
+}
+
+bool ProxyManager::applyKeepalive()
+{
+	// TCP_USER_TIMEOUT closes connection, whose data or probes aren`t acknowledged for detection time,
+	// probes of idle connection start after a half of it
+	int enable = keepaliveTime != 0 ? 1 : 0;
+	unsigned int userTimeout = keepaliveTime;
+	if (setsockopt(tcpConnection, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) != 0 ||
+		setsockopt(tcpConnection, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout)) != 0)
+		return false;
+	if (enable == 0)
+		return true;
+
+	int idle = keepaliveTime / 2000 > 0 ? keepaliveTime / 2000 : 1;
+	int interval = keepaliveTime / 4000 > 0 ? keepaliveTime / 4000 : 1;
+	int count = KEEPALIVE_PROBES;
+	return setsockopt(tcpConnection, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == 0 &&
+		setsockopt(tcpConnection, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == 0 &&
+		setsockopt(tcpConnection, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == 0;
+}
+
+bool ProxyManager::reassociate()
+{
+	// new association is made by other manager and its sockets are put on descriptors of this one,
+	// so descriptors, which are polled by application, stay valid
+	ProxyManager fresh;
+	fresh.handshakeTimeout = handshakeTimeout;
+	fresh.bPipelinedHandshake = bPipelinedHandshake;
+	fresh.bFastOpen = bFastOpen;
+	fresh.keepaliveTime = keepaliveTime;
+	if (!fresh.connectToProxy(proxyHost, proxyPort, handshakeUser, handshakePassword, Socks5::PROXY_MODE::UDP_ASSOCIATE))
+		return false;
+
+	bool bUring = udpUring.isActive();
+	udpUring.release();
+	if (dup2(fresh.udpConnection, udpConnection) < 0 || dup2(fresh.tcpConnection, tcpConnection) < 0)
+		return false;
+	memcpy(&udpProxyAddr, &fresh.udpProxyAddr, sizeof(udpProxyAddr));
+	udpProxyAddrLength = fresh.udpProxyAddrLength;
+	if (udpTrace.isEnabled())
+		udpTrace.enable(udpConnection, true);
+	if (bUring)
+		setUdpBackend(Socks5::UDP_BACKEND::IO_URING, uringBufferSize);
+
+	bSessionLost.store(false, std::memory_order_relaxed);
+	if (reassociationCallback)
+		reassociationCallback(this, udpProxyAddr);
+	return true;
+}
+
+int32_t ProxyManager::send(char* packet, uint16_t dataLength, std::string ip, uint16_t port)
+{
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
+	{
+		return countSent(::send(tcpConnection, (const char*)packet, dataLength, 0));
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		// parsed address of repeated destination is taken from table of thread
+		Socks5::Address address;
+		if (port != 0 && ResolverCache::global().makeAddress(ip, port, &address))
+		{
+			return send(packet, dataLength, address);
+		}
+		else return -1;
+	}
+	else return -1;
+}
+
+int32_t ProxyManager::send(char* packet, uint16_t dataLength, int32_t host, uint16_t port)
+{
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
+	{
+		return countSent(::send(tcpConnection, (const char*)packet, dataLength, 0));
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		if (host != 0 && port != 0)
+		{
+			// header and data are gathered by kernel, so data isn`t copied
+			auto header = Socks5::Codec::encodeUdpHeaderIPv4(host, htons(port));
+
+			struct iovec iov[2];
+			iov[0].iov_base = header.data();
+			iov[0].iov_len = header.size();
+			iov[1].iov_base = packet;
+			iov[1].iov_len = dataLength;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = &udpProxyAddr;
+			msg.msg_namelen = udpProxyAddrLength;
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+
+			int32_t result = udpSendMessage(&msg);
+			if (result > (int32_t)header.size())
+				return countSent(result - header.size());
+			else
+				return countSent(result);
+		}
+		else return -1;
+	}
+	else return -1;
+}
+
+int32_t ProxyManager::send(char* packet, uint16_t dataLength, const Socks5::Address& address)
+{
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
+	{
+		return countSent(::send(tcpConnection, (const char*)packet, dataLength, 0));
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		uint8_t header[Socks5::UDP_HEADER_MAX];
+		uint16_t headerLength = Socks5::Codec::encodeUdpHeader(header, 0, address);
+		if (headerLength == 0)
+			return -1;
+
+		struct iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = headerLength;
+		iov[1].iov_base = packet;
+		iov[1].iov_len = dataLength;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &udpProxyAddr;
+		msg.msg_namelen = udpProxyAddrLength;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+
+		int32_t result = udpSendMessage(&msg);
+		if (result > (int32_t)headerLength)
+			return countSent(result - headerLength);
+		else
+			return countSent(result);
+	}
+	else return -1;
+}
+
+int32_t ProxyManager::sendWithHeadroom(char* buffer, uint16_t dataLength, int32_t host, uint16_t port)
+{
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
+	{
+		return countSent(::send(tcpConnection, (const char*)buffer + Socks5::UDP_IPV4_HEADER_SIZE, dataLength, 0));
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		if (host != 0 && port != 0)
+		{
+			auto header = Socks5::Codec::encodeUdpHeaderIPv4(host, htons(port));
+			memcpy(buffer, header.data(), header.size());
+			int32_t result;
+			if (udpUring.isActive())
+			{
+				struct iovec iov;
+				iov.iov_base = buffer;
+				iov.iov_len = dataLength + header.size();
+				result = uringSent(udpUring.sendv(&iov, 1));
+			}
+			else result = ::sendto(udpConnection, buffer, dataLength + header.size(), 0, (sockaddr*)&udpProxyAddr, udpProxyAddrLength);
+			if (result > (int32_t)header.size())
+				return countSent(result - header.size());
+			else
+				return countSent(result);
+		}
+		else return -1;
+	}
+	else return -1;
+}
+
+int32_t ProxyManager::read(char* data, uint16_t bufferSize, uint32_t* binAddres, uint16_t* port)
+{
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
+	{
+		return streamReceived(recv(tcpConnection, data, bufferSize, 0));
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		Socks5::Address address;
+		int32_t result = receiveDatagram(data, bufferSize, &address);
+		if (result >= 0)
+		{
+			if (binAddres != 0)
+				*binAddres = address.byteAddressType == 1 ? *(uint32_t*)address.bytes : 0;
+			if (port != 0)
+				*port = address.usPort;
+		}
+		return result;
+	}
+	else return -1;
 }
 
-bool ProxyManager::connectToProxy(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort)
+int32_t ProxyManager::read(char* data, uint16_t bufferSize, Socks5::Address* address)
 {
-	this->proxyMode = proxyMode;
-	if ((proxyMode == Socks5::PROXY_MODE::CONNECTION || proxyMode == Socks5::PROXY_MODE::BIND) &&
-		(dstIP.length() < 7 || dstPort == 0))
+	if (!bConnected)
+		return -1;
+
+	if (isStreamMode())
 	{
-		errorCode = Socks5::PROXY_ERROR::DST_HOST;
-		return false;
+		return streamReceived(recv(tcpConnection, data, bufferSize, 0));
 	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	{
+		Socks5::Address sourceAddress;
+		return receiveDatagram(data, bufferSize, address != 0 ? address : &sourceAddress);
+	}
+	else return -1;
+}
 
-	tcpConnection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+int32_t ProxyManager::receiveDatagram(char* data, uint16_t bufferSize, Socks5::Address* address)
+{
+	// IPv4 header is scattered to stack, data goes directly to caller`s buffer
+	uint8_t head[Socks5::UDP_IPV4_HEADER_SIZE];
+	struct iovec iov[2];
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = data;
+	iov[1].iov_len = bufferSize;
 
-	unsigned long mainProxyAddr = inet_addr(ip.c_str());
-	struct sockaddr_in hostAddr;
-	hostAddr.sin_family = AF_INET;
-	hostAddr.sin_addr.s_addr = mainProxyAddr; // proxy IP
-	hostAddr.sin_port = htons(port);		  // proxy port
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
 
-	if (connect(tcpConnection, (sockaddr*)(&hostAddr), sizeof(hostAddr)) == 0)
+	while (true)
 	{
-		Socks5::AuthRequestHeader auth_req_head;
-		memset(&auth_req_head, 0, sizeof(Socks5::AuthRequestHeader));
-		auth_req_head.byteVersion = 0x05;
-		auth_req_head.byteAuthMethodsCount = 0x01;
-		if (user.empty() || password.empty())
-			auth_req_head.byteMethods[0] = 0x00;
-		else
-			auth_req_head.byteMethods[0] = 0x02;
+		int32_t result = udpReceiveMessage(&msg);
+		if (result < 0)
+			return failReceive();
+		uint8_t fragment = 0;
+		int32_t dataLength = unpackDatagram(head, data, result, bufferSize, address, &fragment);
+		if (dataLength < 0 || fragment == 0)
+			return countReceived(dataLength);
 
-		if (::send(tcpConnection, (const char*)&auth_req_head, sizeof(Socks5::AuthRequestHeader), 0) > 0)
-		{
-			char proxyResponse[sizeof(Socks5::AuthRespondHeader) + 8];
-			memset(proxyResponse, 0, sizeof(proxyResponse));
-			int32_t responseLength = recv(tcpConnection, proxyResponse, sizeof(proxyResponse), 0);
-			if (responseLength > 0)
-			{
-				Socks5::AuthRespondHeader auth_resp_head;
-				memcpy(&auth_resp_head, proxyResponse, sizeof(Socks5::AuthRespondHeader));
-				if (auth_resp_head.byteVersion != 0x05)
-				{
-					errorCode = Socks5::PROXY_ERROR::PROTOCOL;
-					close(tcpConnection);
-					return false;
-				}
-				if (auth_resp_head.byteAuthMethod == 0x00)
-				{
-					if (proxyMode == Socks5::PROXY_MODE::CONNECTION)
-						return connectionCommand(dstIP, dstPort);
-					else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
-						return udpAssociate(mainProxyAddr);
-					else
-					{
-						close(tcpConnection);
-						return false;
-					}
-				}
-				else if (auth_req_head.byteMethods[0] == 0x02 && auth_resp_head.byteAuthMethod == 0x02)
-				{
-					uint8_t userLength = static_cast<uint8_t>(user.length());
-					uint8_t passwordLength = static_cast<uint8_t>(password.length());
-					uint8_t* auth_data = new uint8_t[3 + userLength + passwordLength];
-					if (auth_data)
-					{
-						auth_data[0] = 0x01;//the current version of the subnegotiation
-						auth_data[1] = userLength;
-						memcpy(&auth_data[2], user.c_str(), userLength);
-						auth_data[2 + userLength] = passwordLength;
-						memcpy(&auth_data[3 + userLength], password.c_str(), passwordLength);
-						if (::send(tcpConnection, (const char*)auth_data, 3 + userLength + passwordLength, 0) > 0)
-						{
-							delete[] auth_data;
-							char proxyAuthResponse[sizeof(Socks5::AuthUPRespondtHeader)];
-							responseLength = recv(tcpConnection, proxyAuthResponse, sizeof(proxyAuthResponse), 0);
-							if (responseLength > 0)
-							{
-								Socks5::AuthUPRespondtHeader auth_up_resp_head;
-								memcpy(&auth_up_resp_head, proxyAuthResponse, sizeof(Socks5::AuthUPRespondtHeader));
-								if (auth_up_resp_head.byteVersion != 0x01)
-								{
-									errorCode = Socks5::PROXY_ERROR::PROTOCOL;
-									close(tcpConnection);
-									return false;
-								}
-								if (auth_up_resp_head.byteRespondCode == 0x00)
-								{
-									if (proxyMode == Socks5::PROXY_MODE::CONNECTION)
-										return connectionCommand(dstIP, dstPort);
-									else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
-										return udpAssociate(mainProxyAddr);
-									else
-									{
-										close(tcpConnection);
-										return false;
-									}
-								}
-								else
-								{
-									errorCode = Socks5::PROXY_ERROR::SIGNIN;
-									close(tcpConnection);
-									return false;
-								}
-							}
-							else
-							{
-								errorCode = Socks5::PROXY_ERROR::NETWORK;
-								close(tcpConnection);
-								return false;
-							}
-						}
-						else
-						{
-							free(auth_data);
-							errorCode = Socks5::PROXY_ERROR::NETWORK;
-							close(tcpConnection);
-							return false;
-						}
-					}
-					else
-					{
-						errorCode = Socks5::PROXY_ERROR::MEMORY;
-						close(tcpConnection);
-						return false;
-					}
-				}
-				else
-				{
-					errorCode = Socks5::PROXY_ERROR::AUTH_METHOD;
-					close(tcpConnection);
-					return false;
-				}
-			}
-			else
-			{
-				errorCode = Socks5::PROXY_ERROR::PROTOCOL;
-				close(tcpConnection);
-				return false;
-			}
-		}
-		else
-		{
-			errorCode = Socks5::PROXY_ERROR::NETWORK;
-			close(tcpConnection);
-			return false;
-		}
+		// datagram is returned when its last fragment arrives
+		dataLength = reassembleFragment(fragment, *address, data, dataLength, bufferSize);
+		if (dataLength != 0)
+			return countReceived(dataLength);
+	}
+}
+
+int32_t ProxyManager::reassembleFragment(uint8_t fragment, const Socks5::Address& source, char* data, int32_t dataLength, uint16_t bufferSize)
+{
+	// RFC 1928: fragments are dropped if reassembly isn`t supported
+	if (!udpReassembler.isActive())
+		return -1;
+
+	uint8_t sourceBytes[Socks5::UDP_HEADER_MAX];
+	uint16_t sourceLength = Socks5::Codec::encodeAddress(sourceBytes, source);
+	const char* message;
+	int32_t length = udpReassembler.add(sourceBytes, sourceLength, fragment, data, dataLength, &message);
+	if (length <= 0)
+		return length;
+	length = countTruncated(length, bufferSize);
+	memcpy(data, message, length);
+	return length;
+}
+
+int32_t ProxyManager::unpackDatagram(const uint8_t* head, char* data, int32_t received, uint16_t bufferSize, Socks5::Address* address, uint8_t* fragment)
+{
+	const uint16_t headSize = Socks5::UDP_IPV4_HEADER_SIZE;
+	if (received <= headSize)
+		return -1;
+
+	Socks5::UDPHeader header = Socks5::Codec::parseUdpHeader({ head, headSize });
+	if (header.status == Socks5::PARSE_STATUS::INVALID)
+		return -1;
+	if (header.status == Socks5::PARSE_STATUS::OK && header.length == headSize)
+	{
+		Socks5::Codec::copyAddress(header.address, address);
+		*fragment = header.fragment;
+		return received - headSize;
+	}
+
+	// header of other address types has other length, so it is joined and data is moved after it
+	uint8_t joined[Socks5::UDP_HEADER_MAX];
+	int32_t dataReceived = received - headSize;
+	if (dataReceived > bufferSize)
+		dataReceived = bufferSize;
+	uint16_t joinedLength = headSize + (dataReceived < Socks5::UDP_HEADER_MAX - headSize ? dataReceived : Socks5::UDP_HEADER_MAX - headSize);
+	memcpy(joined, head, headSize);
+	memcpy(joined + headSize, data, joinedLength - headSize);
 
+	header = Socks5::Codec::parseUdpHeader({ joined, joinedLength });
+	if (header.status != Socks5::PARSE_STATUS::OK)
+		return -1;
+	Socks5::Codec::copyAddress(header.address, address);
+	*fragment = header.fragment;
+	uint16_t headerLength = header.length;
+	if (headerLength >= headSize)
+	{
+		int32_t dataLength = dataReceived - (headerLength - headSize);
+		if (dataLength <= 0)
+			return -1;
+		memmove(data, data + (headerLength - headSize), dataLength);
+		return dataLength;
 	}
 	else
 	{
-		errorCode = Socks5::PROXY_ERROR::CONNECTION;
-		close(tcpConnection);
-		return false;
+		// short domain name, some bytes of data are in head
+		uint16_t shift = headSize - headerLength;
+		int32_t dataLength = dataReceived;
+		if (dataLength + shift > bufferSize)
+			dataLength = bufferSize - shift;
+		memmove(data + shift, data, dataLength);
+		memcpy(data, head + headerLength, shift);
+		return dataLength + shift;
 	}
 }
 
-void ProxyManager::closeConnection()
+bool ProxyManager::makeAddress(std::string host, uint16_t port, Socks5::Address* address)
 {
-	if (!bConnected)
-		return;
+	if (host.empty() || host.length() > 255)
+		return false;
 
-	if(proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
-		close(udpConnection);
+	if (inet_pton(AF_INET, host.c_str(), address->bytes) == 1)
+	{
+		address->byteAddressType = 1;
+		address->byteLength = 4;
+	}
+	else if (inet_pton(AF_INET6, host.c_str(), address->bytes) == 1)
+	{
+		address->byteAddressType = 4;
+		address->byteLength = 16;
+	}
+	else
+	{
+		address->byteAddressType = 3;
+		address->byteLength = host.length();
+		memcpy(address->bytes, host.c_str(), host.length());
+	}
+	address->usPort = htons(port);
+	return true;
+}
 
-	close(tcpConnection);
-	bConnected = false;
+std::string ProxyManager::addressToString(const Socks5::Address& address)
+{
+	char text[INET6_ADDRSTRLEN];
+	if (address.byteAddressType == 1 && inet_ntop(AF_INET, address.bytes, text, sizeof(text)))
+		return text;
+	if (address.byteAddressType == 4 && inet_ntop(AF_INET6, address.bytes, text, sizeof(text)))
+		return text;
+	if (address.byteAddressType == 3)
+		return std::string((const char*)address.bytes, address.byteLength);
+	return "";
 }
 
-bool ProxyManager::connectionCommand(std::string dstIP, uint16_t dstPort)
+int32_t ProxyManager::readView(char* buffer, uint16_t bufferSize, Socks5::UDPDatagramView* view)
 {
-	Socks5::ConnectRequestHeader connect_command_head;
-	memset(&connect_command_head, 0, sizeof(Socks5::ConnectRequestHeader));
-	connect_command_head.byteVersion = 5;
-	connect_command_head.byteCommand = 1; // tcp connection = 1, tcp binding = 2,  udp = 3
-	connect_command_head.byteReserved = 0;
-	connect_command_head.byteAddressType = 1; // IPv4=1, domain name = 3, IPv6 = 4
-	connect_command_head.ulAddressIPv4 = inet_addr(dstIP.c_str());
-	connect_command_head.usPort = htons(dstPort);
+	if (!bConnected || view == 0)
+		return -1;
 
-	if (::send(tcpConnection, (const char*)&connect_command_head, sizeof(Socks5::ConnectRequestHeader), 0) > 0)
+	if (isStreamMode())
+	{
+		int32_t result = streamReceived(recv(tcpConnection, buffer, bufferSize, 0));
+		if (result > 0)
+		{
+			view->data = buffer;
+			view->dataLength = result;
+			view->ulAddressIPv4 = 0;
+			view->usPort = 0;
+			view->byteAddressType = 0;
+			view->addressLength = 0;
+			view->address = 0;
+		}
+		return result;
+	}
+	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
 	{
-		char proxyResponse[sizeof(Socks5::ConnectRespondHeader) + 8];
-		memset(proxyResponse, 0, sizeof(proxyResponse));
-		int32_t responseLength = recv(tcpConnection, proxyResponse, sizeof(proxyResponse), 0);
-		if (responseLength > 0)
+		int32_t result;
+		Socks5::UDPHeader header;
+		while (true)
 		{
-			Socks5::ConnectRespondHeader connect_command_resp_head;
-			memcpy(&connect_command_resp_head, proxyResponse, sizeof(Socks5::ConnectRespondHeader));
-			if (connect_command_resp_head.byteVersion == 0x05 && connect_command_resp_head.byteResult == 0x00)
+			if (udpUring.isActive())
 			{
-				bConnected = true;
-				return true;
+				struct iovec iov;
+				iov.iov_base = buffer;
+				iov.iov_len = bufferSize;
+				result = udpUring.recvv(&iov, 1);
 			}
-			else
+			else if constexpr (Socks5::TRACING_ENABLED)
 			{
-				if (connect_command_resp_head.byteResult < 9)
-					errorCode = static_cast<Socks5::PROXY_ERROR>((uint8_t)Socks5::PROXY_ERROR::SIGNIN + connect_command_resp_head.byteResult);
-				else
-					errorCode = Socks5::PROXY_ERROR::UNKNOW;
+				// RX timestamp comes as control message, so recvmsg is used
+				struct iovec iov;
+				iov.iov_base = buffer;
+				iov.iov_len = bufferSize;
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				result = udpReceiveMessage(&msg);
+			}
+			else result = recv(udpConnection, buffer, bufferSize, 0);
+			if (result < 0)
+				return failReceive();
+			header = Socks5::Codec::parseUdpHeader({ (const uint8_t*)buffer, (size_t)result });
+			if (header.status != Socks5::PARSE_STATUS::OK || result <= header.length)
+				return countReceived(-1);
 
-				close(tcpConnection);
-				return false;
+			view->data = buffer + header.length;
+			view->dataLength = result - header.length;
+			if (header.fragment == 0)
+				break;
+
+			// reassembly slot is reused by next fragment, so reassembled datagram is copied after header in buffer
+			if (!udpReassembler.isActive())
+				return countReceived(-1);
+			const char* message;
+			int32_t length = udpReassembler.add((const uint8_t*)buffer + 3, header.address.length, header.fragment, view->data, view->dataLength, &message);
+			if (length < 0)
+				return countReceived(-1);
+			if (length > 0)
+			{
+				view->dataLength = countTruncated(length, bufferSize - header.length);
+				memcpy(view->data, message, view->dataLength);
+				break;
 			}
 		}
-		else
-		{
-			errorCode = Socks5::PROXY_ERROR::NETWORK;
-			close(tcpConnection);
-			return false;
-		}
+		const Socks5::AddressView& address = header.address;
+		view->ulAddressIPv4 = 0;
+		if (address.byteAddressType == 1)
+			memcpy(&view->ulAddressIPv4, address.bytes, 4);
+		view->usPort = address.usPort;
+		view->byteAddressType = address.byteAddressType;
+		view->addressLength = address.byteLength;
+		view->address = address.bytes;
+		return countReceived(view->dataLength);
 	}
-	else
+	else return -1;
+}
+
+int32_t ProxyManager::readPooled(PooledBuffer* buffer, Socks5::UDPDatagramView* view, Socks5::BUFFER_CLASS bufferClass)
+{
+	if (buffer == 0)
+		return -1;
+
+	uint32_t wantedSize = Socks5::BUFFER_CLASS_SIZES[static_cast<uint32_t>(bufferClass)];
+	if (buffer->useCount() != 1 || buffer->size() < wantedSize)
 	{
-		errorCode = Socks5::PROXY_ERROR::NETWORK;
-		close(tcpConnection);
-		return false;
+		*buffer = BufferPool::global().acquire(bufferClass);
+		if (!buffer->isValid())
+		{
+			errorCode = Socks5::PROXY_ERROR::MEMORY;
+			return -1;
+		}
 	}
+	uint32_t bufferSize = buffer->size() < 0xFFFF ? buffer->size() : 0xFFFF;
+	return readView(buffer->data(), bufferSize, view);
 }
 
-bool ProxyManager::udpAssociate(unsigned long mainProxyAddr)
+struct RelayDirection
 {
-	Socks5::ConnectRequestHeader udp_accoc_head;
-	memset(&udp_accoc_head, 0, sizeof(Socks5::ConnectRequestHeader));
-	udp_accoc_head.byteVersion = 5;
-	udp_accoc_head.byteCommand = 3; // tcp connection = 1, tcp binding = 2,  udp = 3
-	udp_accoc_head.byteReserved = 0;
-	udp_accoc_head.byteAddressType = 1; // IPv4=1, domain name = 3, IPv6 = 4
-	udp_accoc_head.ulAddressIPv4 = 0;
-	udp_accoc_head.usPort = 0;
+	int src;
+	int dst;
+	int pipeFds[2];
+	size_t pipeSize;
+	size_t pending;
+	bool bSrcClosed;
+	bool bDstShut;
+	uint64_t* counter;
+};
 
-	if (::send(tcpConnection, (const char*)&udp_accoc_head, sizeof(Socks5::ConnectRequestHeader), 0) > 0)
+// move data of one direction as far as possible, returns -1 if error
+static int32_t pumpRelay(RelayDirection* direction)
+{
+	while (true)
 	{
-		char proxyResponse[sizeof(Socks5::ConnectRespondHeader) + 8];
-		memset(proxyResponse, 0, sizeof(proxyResponse));
-		int32_t responseLength = recv(tcpConnection, proxyResponse, sizeof(proxyResponse), 0);
-		if (responseLength > 0)
+		bool bMoved = false;
+		if (!direction->bSrcClosed && direction->pending < direction->pipeSize)
 		{
-			Socks5::ConnectRespondHeader udp_accoc_resp_head;
-			memcpy(&udp_accoc_resp_head, proxyResponse, sizeof(Socks5::ConnectRespondHeader));
-			if (udp_accoc_resp_head.byteVersion == 0x05 && udp_accoc_resp_head.byteResult == 0x00)
+			ssize_t result = splice(direction->src, NULL, direction->pipeFds[1], NULL, direction->pipeSize - direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (result > 0)
 			{
-				if (!isForceMainAddress)
-					udpProxyAddr.sin_addr.s_addr = udp_accoc_resp_head.ulAddressIPv4;
-				else
-					udpProxyAddr.sin_addr.s_addr = mainProxyAddr;
-
-				udpProxyAddr.sin_family = AF_INET;
-				udpProxyAddr.sin_port = udp_accoc_resp_head.usPort;
-				udpConnection = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-				unsigned long nonblock = 1;
-				ioctl(udpConnection, FIONBIO, &nonblock);
-				struct sockaddr_in localaddr;
-				localaddr.sin_family = AF_INET;
-				localaddr.sin_addr.s_addr = INADDR_ANY;
-				localaddr.sin_port = 0; // Any local port will do
-				if (!bind(udpConnection, (struct sockaddr*)&localaddr, sizeof(localaddr)))
-				{
-					bConnected = true;
-					return true;
-				}
-				else
-				{
-					errorCode = Socks5::PROXY_ERROR::UDP_BIND;
-					close(tcpConnection);
-					return false;
-				}
+				direction->pending += result;
+				bMoved = true;
 			}
-			else
+			else if (result == 0)
+				direction->bSrcClosed = true;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return -1;
+		}
+		if (direction->pending > 0)
+		{
+			ssize_t result = splice(direction->pipeFds[0], NULL, direction->dst, NULL, direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (result > 0)
 			{
-				if (udp_accoc_resp_head.byteResult < 9)
-					errorCode = static_cast<Socks5::PROXY_ERROR>((uint8_t)Socks5::PROXY_ERROR::SIGNIN + udp_accoc_resp_head.byteResult);
-				else
-					errorCode = Socks5::PROXY_ERROR::UNKNOW;
-
-				close(tcpConnection);
-				return false;
+				direction->pending -= result;
+				if (direction->counter != 0)
+					*direction->counter += result;
+				bMoved = true;
 			}
+			else if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return -1;
 		}
-		else
+		if (direction->bSrcClosed && direction->pending == 0 && !direction->bDstShut)
 		{
-			errorCode = Socks5::PROXY_ERROR::NETWORK;
-			close(tcpConnection);
-			return false;
+			// half-close is passed to other side
+			shutdown(direction->dst, SHUT_WR);
+			direction->bDstShut = true;
 		}
-	}
-	else
-	{
-		errorCode = Socks5::PROXY_ERROR::NETWORK;
-		close(tcpConnection);
-		return false;
+		if (!bMoved)
+			return 0;
 	}
 }
 
-int32_t ProxyManager::send(char* packet, uint16_t dataLength, std::string ip, uint16_t port)
+int32_t ProxyManager::relay(int localFd, Socks5::RelayStats* stats, uint32_t idleTimeout)
 {
-	if (!bConnected)
+	if (!bConnected || !isStreamMode() || localFd < 0)
 		return -1;
 
-	if (proxyMode == Socks5::PROXY_MODE::CONNECTION)
+	Socks5::RelayStats localStats = { 0, 0 };
+	if (stats == 0)
+		stats = &localStats;
+	Socks5::RelayStats startStats = *stats;
+
+	RelayDirection directions[2] = {
+		{ localFd, tcpConnection, { -1, -1 }, 0, 0, false, false, &stats->bytesToProxy },
+		{ tcpConnection, localFd, { -1, -1 }, 0, 0, false, false, &stats->bytesFromProxy }
+	};
+	int32_t result = 0;
+	for (int i = 0; i < 2 && result == 0; i++)
 	{
-		return ::send(tcpConnection, (const char*)packet, dataLength, 0);
+		if (pipe2(directions[i].pipeFds, O_NONBLOCK | O_CLOEXEC) != 0)
+		{
+			result = -1;
+			break;
+		}
+		fcntl(directions[i].pipeFds[0], F_SETPIPE_SZ, Socks5::RELAY_PIPE_SIZE);
+		int pipeSize = fcntl(directions[i].pipeFds[0], F_GETPIPE_SZ);
+		directions[i].pipeSize = pipeSize > 0 ? pipeSize : 65536;
 	}
-	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+
+	int localFlags = fcntl(localFd, F_GETFL, 0);
+	int proxyFlags = fcntl(tcpConnection, F_GETFL, 0);
+	fcntl(localFd, F_SETFL, localFlags | O_NONBLOCK);
+	fcntl(tcpConnection, F_SETFL, proxyFlags | O_NONBLOCK);
+
+	while (result == 0 && !(directions[0].bDstShut && directions[1].bDstShut))
 	{
-		if (!ip.empty() && port != 0)
+		struct pollfd pollFds[2];
+		pollFds[0].fd = localFd;
+		pollFds[1].fd = tcpConnection;
+		pollFds[0].events = pollFds[1].events = 0;
+		pollFds[0].revents = pollFds[1].revents = 0;
+		for (int i = 0; i < 2; i++)
 		{
-			return send(packet, dataLength, inet_addr(ip.c_str()), port);
+			struct pollfd* srcPoll = directions[i].src == localFd ? &pollFds[0] : &pollFds[1];
+			struct pollfd* dstPoll = directions[i].dst == localFd ? &pollFds[0] : &pollFds[1];
+			if (!directions[i].bSrcClosed && directions[i].pending < directions[i].pipeSize)
+				srcPoll->events |= POLLIN;
+			if (directions[i].pending > 0)
+				dstPoll->events |= POLLOUT;
+		}
+
+		int32_t pollResult = poll(pollFds, 2, idleTimeout != 0 ? (int32_t)idleTimeout : -1);
+		if (pollResult < 0 && errno != EINTR)
+		{
+			errorCode = Socks5::PROXY_ERROR::NETWORK;
+			result = -1;
+		}
+		else if (pollResult == 0)
+		{
+			errorCode = Socks5::PROXY_ERROR::TIMEOUT;
+			result = -1;
+		}
+		else
+		{
+			for (int i = 0; i < 2 && result == 0; i++)
+			{
+				if (pumpRelay(&directions[i]) != 0)
+				{
+					errorCode = Socks5::PROXY_ERROR::NETWORK;
+					result = -1;
+				}
+			}
 		}
-		else return -1;
 	}
-	else return -1;
+
+	fcntl(localFd, F_SETFL, localFlags);
+	fcntl(tcpConnection, F_SETFL, proxyFlags);
+	counters.bytesSent.fetch_add(stats->bytesToProxy - startStats.bytesToProxy, std::memory_order_relaxed);
+	counters.bytesReceived.fetch_add(stats->bytesFromProxy - startStats.bytesFromProxy, std::memory_order_relaxed);
+	for (int i = 0; i < 2; i++)
+	{
+		if (directions[i].pipeFds[0] >= 0)
+			close(directions[i].pipeFds[0]);
+		if (directions[i].pipeFds[1] >= 0)
+			close(directions[i].pipeFds[1]);
+	}
+	return result;
 }
 
-int32_t ProxyManager::send(char* packet, uint16_t dataLength, int32_t host, uint16_t port)
+Socks5::UDP_BACKEND ProxyManager::setUdpBackend(Socks5::UDP_BACKEND backend, uint32_t bufferSize)
 {
-	if (!bConnected)
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		return Socks5::UDP_BACKEND::SYSCALL;
+
+	udpUring.release();
+	if (backend == Socks5::UDP_BACKEND::IO_URING)
+	{
+		if (udpTrace.isEnabled())
+			udpTrace.enable(udpConnection, false);
+		// ring sends without address, so socket is connected to relay
+		if (connect(udpConnection, (sockaddr*)&udpProxyAddr, udpProxyAddrLength) == 0 &&
+			udpUring.init(udpConnection, Socks5::UDP_URING_BUFFERS, bufferSize))
+		{
+			uringBufferSize = bufferSize;
+			return Socks5::UDP_BACKEND::IO_URING;
+		}
+	}
+	return Socks5::UDP_BACKEND::SYSCALL;
+}
+
+bool ProxyManager::setFragmentReassembly(uint32_t slotCount, uint32_t maxMessageSize, uint32_t timeout)
+{
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE)
+		return false;
+
+	if (slotCount == 0)
+	{
+		udpReassembler.release();
+		return true;
+	}
+	return udpReassembler.init(slotCount, maxMessageSize, timeout);
+}
+
+int32_t ProxyManager::sendFragmented(char* packet, uint32_t dataLength, const Socks5::Address& address, uint16_t fragmentSize)
+{
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE || fragmentSize == 0 || dataLength == 0)
+		return -1;
+
+	uint32_t fragmentCount = (dataLength + fragmentSize - 1) / fragmentSize;
+	if (fragmentCount > Socks5::FRAGMENT_MAX)
 		return -1;
+	if (fragmentCount == 1)
+		return send(packet, dataLength, address);
 
-	if (proxyMode == Socks5::PROXY_MODE::CONNECTION)
+	// fragments share address part of header, only RSV and FRAG bytes are own
+	uint8_t prefixes[Socks5::FRAGMENT_MAX][3];
+	uint8_t addressPart[Socks5::UDP_HEADER_MAX];
+	uint16_t addressLength = Socks5::Codec::encodeAddress(addressPart, address);
+	if (addressLength == 0)
+		return -1;
+	struct iovec iov[Socks5::UDP_BATCH_MAX][3];
+	struct mmsghdr msgs[Socks5::UDP_BATCH_MAX];
+	uint32_t sentCount = 0;
+
+	while (sentCount < fragmentCount)
 	{
-		return ::send(tcpConnection, (const char*)packet, dataLength, 0);
+		uint32_t batchSize = fragmentCount - sentCount;
+		if (batchSize > Socks5::UDP_BATCH_MAX)
+			batchSize = Socks5::UDP_BATCH_MAX;
+
+		memset(msgs, 0, sizeof(struct mmsghdr) * batchSize);
+		for (uint32_t i = 0; i < batchSize; i++)
+		{
+			uint32_t index = sentCount + i;
+			uint32_t offset = index * fragmentSize;
+			prefixes[index][0] = 0;
+			prefixes[index][1] = 0;
+			prefixes[index][2] = (uint8_t)(index + 1) | (index + 1 == fragmentCount ? Socks5::FRAGMENT_END : 0);
+			iov[i][0].iov_base = prefixes[index];
+			iov[i][0].iov_len = 3;
+			iov[i][1].iov_base = addressPart;
+			iov[i][1].iov_len = addressLength;
+			iov[i][2].iov_base = packet + offset;
+			iov[i][2].iov_len = dataLength - offset < fragmentSize ? dataLength - offset : fragmentSize;
+			msgs[i].msg_hdr.msg_name = &udpProxyAddr;
+			msgs[i].msg_hdr.msg_namelen = udpProxyAddrLength;
+			msgs[i].msg_hdr.msg_iov = iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 3;
+		}
+
+		int32_t result;
+		if (udpUring.isActive())
+		{
+			result = 0;
+			while ((uint32_t)result < batchSize && uringSent(udpUring.sendv(iov[result], 3, false)) >= 0)
+				result++;
+			udpUring.submit();
+			if (result == 0)
+				result = -1;
+		}
+		else result = udpSendBatch(msgs, batchSize);
+		if (result < 0)
+			return countSent(-1);
+		sentCount += result;
 	}
-	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+	return countSent(dataLength);
+}
+
+int32_t ProxyManager::udpSendMessage(struct msghdr* msg)
+{
+	if (udpUring.isActive())
+		return uringSent(udpUring.sendv(msg->msg_iov, msg->msg_iovlen));
+	uint64_t start = udpTrace.beginSend();
+	int32_t result = sendmsg(udpConnection, msg, 0);
+	if (result >= 0)
+		udpTrace.endSend(udpConnection, start, 1);
+	return result;
+}
+
+int32_t ProxyManager::udpReceiveMessage(struct msghdr* msg)
+{
+	if (udpUring.isActive())
+		return udpUring.recvv(msg->msg_iov, msg->msg_iovlen);
+	udpTrace.prepareReceive(msg);
+	int32_t result = recvmsg(udpConnection, msg, 0);
+	udpTrace.finishReceive(msg, result);
+	return result;
+}
+
+int32_t ProxyManager::udpSendBatch(struct mmsghdr* msgs, uint32_t count)
+{
+	uint64_t start = udpTrace.beginSend();
+	int32_t result = sendmmsg(udpConnection, msgs, count, 0);
+	if (result > 0)
+		udpTrace.endSend(udpConnection, start, result);
+	return result;
+}
+
+bool ProxyManager::setTracing(bool bEnabled)
+{
+	// datagrams of io_uring don`t pass send and receive calls, which take timestamps
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE || (bEnabled && udpUring.isActive()))
+		return false;
+	return udpTrace.enable(udpConnection, bEnabled);
+}
+
+int32_t ProxyManager::sendBatch(Socks5::UDPMessage* messages, uint32_t count)
+{
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE || messages == 0)
+		return -1;
+
+	uint8_t headers[Socks5::UDP_BATCH_MAX][Socks5::UDP_HEADER_MAX];
+	struct iovec iov[Socks5::UDP_BATCH_MAX][2];
+	struct mmsghdr msgs[Socks5::UDP_BATCH_MAX];
+	uint32_t sentCount = 0;
+
+	while (sentCount < count)
 	{
-		if (host != 0 && port != 0)
+		uint32_t batchSize = count - sentCount;
+		if (batchSize > Socks5::UDP_BATCH_MAX)
+			batchSize = Socks5::UDP_BATCH_MAX;
+
+		memset(msgs, 0, sizeof(struct mmsghdr) * batchSize);
+		for (uint32_t i = 0; i < batchSize; i++)
 		{
-			size_t alloc_size = dataLength + sizeof(Socks5::UDPDatagramHeader) + 1;
-			char* allData = new char[alloc_size];
-			if (allData)
+			Socks5::UDPMessage& message = messages[sentCount + i];
+			uint16_t headerLength;
+			if (message.address.byteAddressType != 0)
+				headerLength = Socks5::Codec::encodeUdpHeader(headers[i], 0, message.address);
+			else
+			{
+				auto header = Socks5::Codec::encodeUdpHeaderIPv4(message.ulAddressIPv4, htons(message.usPort));
+				memcpy(headers[i], header.data(), header.size());
+				headerLength = header.size();
+			}
+			// batch is cut before message with invalid address, it stops sending if it is first
+			if (headerLength == 0)
 			{
-				Socks5::UDPDatagramHeader* send_head = (Socks5::UDPDatagramHeader*)allData;
-				memset(allData, 0, alloc_size);
-				send_head->usReserved = 0;
-				send_head->byteFragment = 0;
-				send_head->byteAddressType = 1;
-				send_head->ulAddressIPv4 = host;
-				send_head->usPort = htons(port);
-				memcpy(&allData[sizeof(Socks5::UDPDatagramHeader)], packet, dataLength);
-				int32_t result = ::sendto(udpConnection, allData, dataLength + sizeof(Socks5::UDPDatagramHeader), 0, (sockaddr*)&udpProxyAddr, sizeof(udpProxyAddr));
-				delete[] allData;
-
-				if (result > sizeof(Socks5::UDPDatagramHeader))
-					return result - sizeof(Socks5::UDPDatagramHeader);
-				else
-					return result;
+				if (i == 0)
+				{
+					message.result = countSent(-1);
+					errorCode = Socks5::PROXY_ERROR::DST_HOST;
+					return sentCount > 0 ? sentCount : -1;
+				}
+				batchSize = i;
+				break;
 			}
-			else return -1;
+			iov[i][0].iov_base = headers[i];
+			iov[i][0].iov_len = headerLength;
+			iov[i][1].iov_base = message.data;
+			iov[i][1].iov_len = message.dataLength;
+			msgs[i].msg_hdr.msg_name = &udpProxyAddr;
+			msgs[i].msg_hdr.msg_namelen = udpProxyAddrLength;
+			msgs[i].msg_hdr.msg_iov = iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 2;
 		}
-		else return -1;
+
+		int32_t result;
+		if (udpUring.isActive())
+		{
+			// requests are queued and submitted at once
+			result = 0;
+			while ((uint32_t)result < batchSize && uringSent(udpUring.sendv(iov[result], 2, false)) >= 0)
+			{
+				msgs[result].msg_len = iov[result][0].iov_len + iov[result][1].iov_len;
+				result++;
+			}
+			udpUring.submit();
+			if (result == 0)
+				result = -1;
+		}
+		else result = udpSendBatch(msgs, batchSize);
+		if (result < 0)
+			return sentCount > 0 ? sentCount : -1;
+
+		for (int32_t i = 0; i < result; i++)
+			messages[sentCount + i].result = countSent(msgs[i].msg_len - iov[i][0].iov_len);
+
+		sentCount += result;
+		if ((uint32_t)result < batchSize)
+			break;
 	}
-	else return -1;
+	return sentCount;
 }
 
-int32_t ProxyManager::read(char* data, uint16_t bufferSize, uint32_t* binAddres, uint16_t* port)
+int32_t ProxyManager::readBatch(Socks5::UDPMessage* messages, uint32_t count)
 {
-	if (!bConnected)
+	if (!bConnected || proxyMode != Socks5::PROXY_MODE::UDP_ASSOCIATE || messages == 0)
 		return -1;
 
-	if (proxyMode == Socks5::PROXY_MODE::CONNECTION)
+	if (count > Socks5::UDP_BATCH_MAX)
+		count = Socks5::UDP_BATCH_MAX;
+
+	uint8_t headers[Socks5::UDP_BATCH_MAX][Socks5::UDP_IPV4_HEADER_SIZE];
+	struct iovec iov[Socks5::UDP_BATCH_MAX][2];
+	struct mmsghdr msgs[Socks5::UDP_BATCH_MAX];
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * count);
+	for (uint32_t i = 0; i < count; i++)
 	{
-		return recv(tcpConnection, data, bufferSize, 0);
+		iov[i][0].iov_base = headers[i];
+		iov[i][0].iov_len = Socks5::UDP_IPV4_HEADER_SIZE;
+		iov[i][1].iov_base = messages[i].data;
+		iov[i][1].iov_len = messages[i].dataLength;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+		udpTrace.prepareReceive(&msgs[i].msg_hdr, i);
 	}
-	else if (proxyMode == Socks5::PROXY_MODE::UDP_ASSOCIATE)
+
+	int32_t result;
+	if (udpUring.isActive())
 	{
-		uint16_t inputDataSize = bufferSize + sizeof(Socks5::UDPDatagramHeader);
-		char* inputData = new char[inputDataSize];
-		if (inputData)
+		result = 0;
+		int32_t length;
+		while ((uint32_t)result < count && (length = udpUring.recvv(iov[result], 2)) >= 0)
 		{
-			memset(inputData, 0, inputDataSize);
-			int32_t result = recv(udpConnection, inputData, inputDataSize, 0);
-			if (result > (int32_t)sizeof(Socks5::UDPDatagramHeader))
-			{
-				Socks5::UDPDatagramHeader* udpDataHeader = (Socks5::UDPDatagramHeader*)inputData;
-				if (binAddres != 0)
-					*binAddres = udpDataHeader->ulAddressIPv4;
-				if (port != 0)
-					*port = udpDataHeader->usPort;
-				memcpy(data, inputData + sizeof(Socks5::UDPDatagramHeader), result - sizeof(Socks5::UDPDatagramHeader));
-				delete[] inputData;
-				return (result - sizeof(Socks5::UDPDatagramHeader));
-			}
-			else
-			{
-				delete[] inputData;
-				return -1;
-			}
+			msgs[result].msg_len = length;
+			result++;
 		}
-		else return -1;
+		if (result == 0)
+			result = -1;
 	}
-	else return -1;
+	else result = recvmmsg(udpConnection, msgs, count, 0, NULL);
+	if (result < 0)
+		return failReceive();
+
+	for (int32_t i = 0; i < result; i++)
+	{
+		udpTrace.finishReceive(&msgs[i].msg_hdr, msgs[i].msg_len);
+		Socks5::Address address;
+		address.byteAddressType = 0;
+		address.usPort = 0;
+		uint8_t fragment = 0;
+		int32_t dataLength = unpackDatagram(headers[i], messages[i].data, msgs[i].msg_len, messages[i].dataLength, &address, &fragment);
+		if (dataLength >= 0 && fragment != 0)
+		{
+			// fragment, which doesn`t complete datagram, has result -1 but isn`t counted as dropped
+			dataLength = reassembleFragment(fragment, address, messages[i].data, dataLength, messages[i].dataLength);
+			messages[i].result = dataLength != 0 ? countReceived(dataLength) : -1;
+		}
+		else messages[i].result = countReceived(dataLength);
+		messages[i].ulAddressIPv4 = address.byteAddressType == 1 ? *(uint32_t*)address.bytes : 0;
+		messages[i].usPort = address.usPort;
+		messages[i].address = address;
+	}
+	return result;
 }
 
 int32_t ProxyManager::udpSocketWait(uint32_t *waitMode, uint32_t timeout)
@@ -407,6 +1874,7 @@ int32_t ProxyManager::udpSocketWait(uint32_t *waitMode, uint32_t timeout)
 	fd_set readSet, writeSet;
 	struct timeval timeVal;
 	int selectCount;
+	int waitSocket = getUdpWaitSocket();
 
 	timeVal.tv_sec = timeout / 1000;
 	timeVal.tv_usec = (timeout % 1000) * 1000;
@@ -415,12 +1883,21 @@ int32_t ProxyManager::udpSocketWait(uint32_t *waitMode, uint32_t timeout)
 	FD_ZERO(&writeSet);
 
 	if (*waitMode & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND))
-		FD_SET(udpConnection, &writeSet);
+		FD_SET(waitSocket, &writeSet);
 
 	if (*waitMode & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE))
-		FD_SET(udpConnection, &readSet);
+		FD_SET(waitSocket, &readSet);
+
+	// end of control connection wakes waiting, association is dead without it
+	int maxSocket = waitSocket;
+	if (tcpConnection >= 0)
+	{
+		FD_SET(tcpConnection, &readSet);
+		if (tcpConnection > maxSocket)
+			maxSocket = tcpConnection;
+	}
 
-	selectCount = select(udpConnection + 1, &readSet, &writeSet, NULL, &timeVal);
+	selectCount = select(maxSocket + 1, &readSet, &writeSet, NULL, &timeVal);
 
 	if (selectCount < 0)
 		return -1;
@@ -430,10 +1907,13 @@ int32_t ProxyManager::udpSocketWait(uint32_t *waitMode, uint32_t timeout)
 	if (selectCount == 0)
 		return 0;
 
-	if (FD_ISSET(udpConnection, &writeSet))
+	if (tcpConnection >= 0 && FD_ISSET(tcpConnection, &readSet) && !checkSession())
+		return -1;
+
+	if (FD_ISSET(waitSocket, &writeSet))
 		*waitMode |= static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND);
 
-	if (FD_ISSET(udpConnection, &readSet))
+	if (FD_ISSET(waitSocket, &readSet))
 		*waitMode |= static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE);
 
 	return 0;
@@ -463,10 +1943,13 @@ std::string ProxyManager::getErrorString(Socks5::PROXY_ERROR errorCode) {
 		"TTL expired",
 		"The command is not supported by the proxy server",
 		"The specified address type is not supported by the proxy server",
-		"Unknown error"
+		"Unknown error",
+		"Timeout of handshake phase expired",
+		"No data yet (non-blocking socket)",
+		"Session was closed by proxy server or network"
 	};
 	uint8_t iErrorCode = static_cast<uint8_t>(errorCode);
-	if (iErrorCode >= 19)
-		iErrorCode = 18;
+	if (iErrorCode >= sizeof(errorStrings) / sizeof(errorStrings[0]))
+		iErrorCode = static_cast<uint8_t>(Socks5::PROXY_ERROR::UNKNOW);
 	return errorStrings[iErrorCode];
 }
\ No newline at end of file
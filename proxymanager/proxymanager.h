@@ -10,7 +10,17 @@
 #include <stdint.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <span>
 #include <string>
+#include <vector>
+#include "udpuring.h"
+#include "proxymetrics.h"
+#include "bufferpool.h"
+#include "udpreassembler.h"
+#include "udptracer.h"
 
 namespace Socks5
 {
@@ -41,7 +51,11 @@ namespace Socks5
         TTL,
         COMMAND_NOT_SUPPORT,
         ADDRESS_TYPE,
-        UNKNOW
+        UNKNOW,
+        TIMEOUT,
+        //session health errors
+        WOULD_BLOCK,
+        SESSION_CLOSED
     };
     enum class PROXY_WAIT_MODE
     {
@@ -49,6 +63,22 @@ namespace Socks5
         PROXY_WAIT_SEND = 1,
         PROXY_WAIT_RECEIVE = 2
     };
+    enum class HANDSHAKE_STATE
+    {
+        NONE = 0,
+        CONNECTING,
+        GREETING,
+        AUTH,
+        AUTHENTICATED,
+        REQUEST,
+        BOUND,          // first reply of BIND was received, proxy-server waits for connection of peer
+        ESTABLISHED,
+        FAILED
+    };
+
+    // enough for pipelined greeting, RFC1929 request with 255-byte username and password and request
+    // with 255-byte domain name, it is taken from BufferPool
+    const uint16_t HANDSHAKE_BUFFER_SIZE = 3 + 513 + 262;
 
 #pragma pack(push, 1)
     struct AuthRequestHeader
@@ -99,29 +129,270 @@ namespace Socks5
         uint16_t	usPort;
     };
 #pragma pack(pop)
+
+    /**
+     * Address of destination host of any type.
+     */
+    struct Address
+    {
+        uint8_t     byteAddressType;    // IPv4=1, domain name = 3, IPv6 = 4
+        uint8_t     byteLength;         // length of bytes (4, length of domain name, 16)
+        uint8_t     bytes[255];
+        uint16_t    usPort;             // network byte order
+    };
+
+    // maximum length of UDP datagram header (with 255-byte domain name)
+    const uint16_t UDP_HEADER_MAX = 4 + 1 + 255 + 2;
+    // length of UDP datagram header with IPv4 address (headroom of sendWithHeadroom())
+    const uint16_t UDP_IPV4_HEADER_SIZE = 4 + 4 + 2;
+
+    /**
+     * View of a received UDP datagram inside the caller`s buffer.
+     * ulAddressIPv4 is set for IPv4 address only, address points to address bytes of any type inside of buffer
+     * (for domain name it is name without length byte).
+     */
+    struct UDPDatagramView
+    {
+        char*       data;
+        uint16_t    dataLength;
+        uint32_t    ulAddressIPv4;
+        uint16_t    usPort;
+        uint8_t     byteAddressType;
+        uint8_t     addressLength;
+        const uint8_t* address;
+    };
+
+    /**
+     * One datagram of batch send/read.
+     * For sending usPort is in host byte order, for reading it is in network byte order (as in read()).
+     * Address of any type is sent if byteAddressType of address isn`t 0, else ulAddressIPv4 and usPort are used.
+     * Reading writes source to address and to ulAddressIPv4 and usPort (ulAddressIPv4 is 0 for other address types).
+     */
+    struct UDPMessage
+    {
+        char*       data;
+        uint16_t    dataLength;
+        uint32_t    ulAddressIPv4;
+        uint16_t    usPort;
+        int32_t     result;
+        Address     address;        // usPort of address is in network byte order
+    };
+
+    enum class UDP_BACKEND
+    {
+        SYSCALL = 0,
+        IO_URING
+    };
+
+    // count of send and receive buffers of io_uring backend
+    const uint32_t UDP_URING_BUFFERS = 256;
+
+    /**
+     * Counters of relay().
+     */
+    struct RelayStats
+    {
+        uint64_t    bytesToProxy;
+        uint64_t    bytesFromProxy;
+    };
+
+    // wanted size of pipes of relay()
+    const int RELAY_PIPE_SIZE = 1 << 20;
+
+    // maximum count of datagrams passed to kernel by one sendmmsg/recvmmsg call
+    const uint32_t UDP_BATCH_MAX = 64;
+
+    struct ProxyEndpoint
+    {
+        std::string ip;
+        uint16_t    port;
+        std::string user;       // empty string if proxy without auth
+        std::string password;
+    };
+
+    // delay (in mseconds) between connects of racing connect (RFC 8305)
+    const uint32_t RACE_STAGGER = 250;
+
+    // minimal interval (in mseconds) between checks of control connection, which are made by failed reads
+    const uint32_t HEALTH_CHECK_INTERVAL = 100;
 }
 
 /**
  * @class ProxyManager
- * Socks5-client for linux with supporting CONNECT and UDP_ASSOCIATE commands.
+ * Socks5-client for linux with supporting CONNECT, BIND and UDP_ASSOCIATE commands.
  */
 class ProxyManager
 {
 public:
+    typedef std::function<void(ProxyManager* manager, const sockaddr_storage& relayAddress)> ReassociationCallback;
+
     ProxyManager() {}
     ~ProxyManager();
     /**
      * Connect to proxy-server.
-     * @param ip IP address of proxy server.
+     * @param ip IP address of proxy server (IPv4 or IPv6) or host name (it is resolved by ResolverCache).
      * @param port port of proxy server.
      * @param user login of proxy server or empty string if proxy without auth
      * @param password password of proxy server or empty string if proxy without auth
+     * @param proxyMode mode of proxy. Socks5::PROXY_MODE::CONNECTION (TCP connect), Socks5::PROXY_MODE::BIND (TCP listen)
+     * or Socks5::PROXY_MODE::UDP_ASSOCIATE (UDP connect).
+     * @param dstIP destination IPv4 or IPv6 address or domain name, which is resolved by proxy (for CONNECTION mode),
+     * address of expected peer (for BIND mode).
+     * @param dstPort destination port (for CONNECTION and BIND modes).
+     * @return true if successful, false if connect was failed. For BIND mode it returns after first reply,
+     * address for peer is given by getBoundAddress(), connection of peer is waited for by acceptBind().
+     */
+    bool connectToProxy(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    /**
+     * Connect to first reachable of several proxy-servers. Connects are started one by one with delay (as in RFC 8305)
+     * while previous ones are in progress. When TCP connect succeeds, other connects are canceled and handshake is
+     * completed. If handshake fails, racing goes on with remaining proxy-servers.
+     * @param endpoints proxy-servers in order of preference.
      * @param proxyMode mode of proxy. Socks5::PROXY_MODE::CONNECTION (TCP connect) or Socks5::PROXY_MODE::UDP_ASSOCIATE (UDP connect).
-     * @param dstIP destination IP address (for CONNECTION mode).
+     * @param dstIP destination address (for CONNECTION mode).
      * @param dstPort destination port (for CONNECTION mode).
+     * @param deadline maximum time of whole connecting in mseconds.
+     * @param stagger delay between connects in mseconds.
+     * @param error pointer to variable for write error code (can be 0). Socks5::PROXY_ERROR::TIMEOUT if deadline expired.
+     * @param endpoint pointer to variable for write index of connected proxy-server (can be 0).
+     * @return connected session or nullptr if error.
+     * @note this is static function.
+     */
+    static std::unique_ptr<ProxyManager> connectRace(const std::vector<Socks5::ProxyEndpoint>& endpoints, Socks5::PROXY_MODE proxyMode,
+        std::string dstIP, uint16_t dstPort, uint32_t deadline, uint32_t stagger = Socks5::RACE_STAGGER,
+        Socks5::PROXY_ERROR* error = 0, uint32_t* endpoint = 0);
+    /**
+     * Connect to proxy-server and sign in without sending of command. Command is sent by commandToProxy().
+     * @param ip IP address of proxy server.
+     * @param port port of proxy server.
+     * @param user login of proxy server or empty string if proxy without auth
+     * @param password password of proxy server or empty string if proxy without auth
      * @return true if successful, false if connect was failed.
      */
-    bool connectToProxy(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    bool authenticateToProxy(std::string ip, uint16_t port, std::string user, std::string password);
+    /**
+     * Send command by connection, which was authenticated by authenticateToProxy().
+     * @param proxyMode mode of proxy. Socks5::PROXY_MODE::CONNECTION (TCP connect), Socks5::PROXY_MODE::BIND (TCP listen)
+     * or Socks5::PROXY_MODE::UDP_ASSOCIATE (UDP connect).
+     * @param dstIP destination IP address (for CONNECTION mode), address of expected peer (for BIND mode).
+     * @param dstPort destination port (for CONNECTION and BIND modes).
+     * @return true if successful, false if command was failed. For BIND mode it returns after first reply.
+     */
+    bool commandToProxy(Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    /**
+     * Wait for connection of peer to address, which proxy-server listens on for BIND command (second reply).
+     * After it session is used as in CONNECTION mode. Waiting isn`t limited by handshake timeout.
+     * @param timeout timeout in mseconds, 0 is without timeout.
+     * @return true if peer was connected (its address is given by getPeerAddress()), false if error
+     * or timeout expired (Socks5::PROXY_ERROR::TIMEOUT, session stays in BOUND state and can be waited for again).
+     */
+    bool acceptBind(uint32_t timeout = 0);
+    /**
+     * Gets address, which proxy-server listens on for BIND command (unspecified address of reply is replaced
+     * with address of proxy-server). Valid in BOUND and ESTABLISHED states.
+     * @return address (usPort in network byte order).
+     */
+    const Socks5::Address& getBoundAddress() { return boundAddress; }
+    /**
+     * Gets address of peer, which was connected to proxy-server for BIND command.
+     * @return address (usPort in network byte order).
+     */
+    const Socks5::Address& getPeerAddress() { return peerAddress; }
+    /**
+     * Start non-blocking connect to proxy-server. Handshake is advanced by advanceHandshake().
+     * Parameters are the same as in connectToProxy().
+     * @return true if connect was started, false if it was failed.
+     */
+    bool beginConnect(std::string ip, uint16_t port, std::string user, std::string password, Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    /**
+     * Non-blocking version of authenticateToProxy(). Handshake stops in AUTHENTICATED state.
+     * @return true if connect was started, false if it was failed.
+     */
+    bool beginAuthenticate(std::string ip, uint16_t port, std::string user, std::string password);
+    /**
+     * Non-blocking version of commandToProxy(). Handshake is advanced by advanceHandshake().
+     * @return true if command was started, false if connection isn`t in AUTHENTICATED state or destination is invalid.
+     */
+    bool beginCommand(Socks5::PROXY_MODE proxyMode, std::string dstIP = "", uint16_t dstPort = 0);
+    /**
+     * Advance handshake as far as possible without blocking. Call it when socket from getTcpSocket() is ready
+     * for mode from handshakeWaitMode().
+     * @return state of handshake. ESTABLISHED if successful, FAILED if handshake was failed (see lastErrorCode()).
+     * BOUND for BIND command, when address for peer is known, advanceHandshake() is called again on readiness
+     * for receive, until peer is connected. Pending BIND doesn`t hold handshake buffer, so many of them can wait at once.
+     * @note TCP socket stays non blocking after handshake.
+     */
+    Socks5::HANDSHAKE_STATE advanceHandshake();
+    /**
+     * Gets state of handshake.
+     * @return state of handshake.
+     */
+    Socks5::HANDSHAKE_STATE getHandshakeState() { return handshakeState; }
+    /**
+     * Gets readiness which handshake waits for.
+     * @return bit-mask of Socks5::PROXY_WAIT_MODE.
+     */
+    uint32_t handshakeWaitMode();
+    /**
+     * Set timeout of each handshake phase (connect, greeting, auth, request).
+     * @param timeout timeout in mseconds, 0 is without timeout.
+     */
+    void setHandshakeTimeout(uint32_t timeout) { handshakeTimeout = timeout; }
+    /**
+     * Gets timeout of each handshake phase.
+     * @return timeout in mseconds, 0 is without timeout.
+     */
+    uint32_t getHandshakeTimeout() { return handshakeTimeout; }
+    /**
+     * Send greeting, RFC1929 request and command in one flight and parse concatenated replies, so handshake takes
+     * one round-trip instead of three. It is for proxy-servers with known auth method: if proxy-server answers
+     * unexpectedly or drops connection, handshake is repeated step by step on new connection.
+     * Used by connectToProxy() and beginConnect().
+     * @param bPipelined true to send messages in one flight.
+     * @param bFastOpen true to send flight in SYN (TCP Fast Open), if kernel and proxy-server support it.
+     */
+    void setPipelinedHandshake(bool bPipelined, bool bFastOpen = false) { bPipelinedHandshake = bPipelined; this->bFastOpen = bFastOpen; }
+    /**
+     * Fail handshake with Socks5::PROXY_ERROR::TIMEOUT if timeout of current phase expired.
+     * @return true if timeout expired.
+     */
+    bool checkHandshakeTimeout();
+    /**
+     * Tune TCP keepalive and TCP_USER_TIMEOUT of connection to proxy server (control connection of UDP_ASSOCIATE mode),
+     * so silently dropped connection is closed by kernel after detection time. Applied to current and next connections.
+     * @param detectionTime time (in mseconds) without answer of proxy server, after which connection is dead
+     * (idle connection is probed after a half of it, but not earlier than after 1 second), 0 disables keepalive.
+     * @return true if successful.
+     */
+    bool setKeepalive(uint32_t detectionTime);
+    /**
+     * Gets detection time of dead connection.
+     * @return time in mseconds, 0 if keepalive is disabled.
+     */
+    uint32_t getKeepalive() { return keepaliveTime; }
+    /**
+     * Establish new UDP association, when control connection of current one is found closed. New association takes
+     * descriptors of old one (getTcpSocket() and getUdpSocket() don`t change, but epoll registration of them is lost),
+     * relay address can change. Handshake is blocking (limited by setHandshakeTimeout()) and it is made
+     * by thread, which found closed connection.
+     * @param bEnabled true to enable.
+     * @param callback function, which is called after new association is established (can be nullptr).
+     * @note must not be enabled if manager is used by many threads (as by SharedUdpAssociation).
+     */
+    void setReassociation(bool bEnabled, ReassociationCallback callback = nullptr) { bReassociation = bEnabled; reassociationCallback = callback; }
+    /**
+     * Check control connection (data connection for CONNECTION mode) now. If it is closed and reassociation
+     * is enabled, new association is established.
+     * @return true if session is alive, false if it is closed (error code is Socks5::PROXY_ERROR::SESSION_CLOSED).
+     */
+    bool checkSession();
+    /**
+     * Checks that session was found closed by read functions, udpSocketWait() or checkSession(). Thread-safe.
+     * Failed read functions check control connection not more often than Socks5::HEALTH_CHECK_INTERVAL, so dead session
+     * is reported in keepalive detection time plus this interval.
+     * @return true if session is closed.
+     */
+    bool isSessionLost() { return bSessionLost.load(std::memory_order_relaxed); }
     /**
      * Close connection to proxy server.
      */
@@ -130,11 +401,19 @@ public:
      * Send data to destination server through proxy server.
      * @param packet pointer to data array.
      * @param dataLength length of data array.
-     * @param ip destination IP address (for UDP_ASSOCIATE mode).
+     * @param ip destination IPv4 or IPv6 address or domain name, which is resolved by proxy (for UDP_ASSOCIATE mode).
      * @param port destination port (for UDP_ASSOCIATE mode).
      * @return length of sent data or -1 if error.
      */
     int32_t send(char* packet, uint16_t dataLength, std::string ip, uint16_t port);
+    /**
+     * Send data to destination server through proxy server.
+     * @param packet pointer to data array.
+     * @param dataLength length of data array.
+     * @param address destination address of any type (for UDP_ASSOCIATE mode).
+     * @return length of sent data or -1 if error.
+     */
+    int32_t send(char* packet, uint16_t dataLength, const Socks5::Address& address);
     /**
      * Send data to destination server through proxy server.
      * @param packet pointer to data array.
@@ -150,15 +429,119 @@ public:
      * @param bufferSize maximum size of data array
      * @param binAddres pointer to variable for write destination host address (binary format, for UDP_ASSOCIATE mode).
      * @param port pointer to variable for write destination host port (for UDP_ASSOCIATE mode).
-     * @return length of recevied data or -1 if error.
+     * @return length of recevied data or -1 if error. Error code is Socks5::PROXY_ERROR::WOULD_BLOCK if there is no data yet,
+     * Socks5::PROXY_ERROR::SESSION_CLOSED if connection (control connection of UDP association) was closed.
      * @note Proxy socket is non blocking for UDP_ASSOCIATE mode.
      */ 
     int32_t read(char* data, uint16_t bufferSize, uint32_t* binAddres = 0, uint16_t* port = 0);
+    /**
+     * Read data from destination server through proxy server.
+     * @param data pointer to data array
+     * @param bufferSize maximum size of data array
+     * @param address pointer to variable for write source address of any type (for UDP_ASSOCIATE mode).
+     * @return length of recevied data or -1 if error.
+     */
+    int32_t read(char* data, uint16_t bufferSize, Socks5::Address* address);
+    /**
+     * Send data with header written in place (without copying of data).
+     * @param buffer pointer to buffer with Socks5::UDP_IPV4_HEADER_SIZE bytes reserved before data.
+     * @param dataLength length of data after reserved bytes.
+     * @param host destination host (binary format, for UDP_ASSOCIATE mode).
+     * @param port destination port (for UDP_ASSOCIATE mode).
+     * @return length of sent data or -1 if error.
+     * @note In CONNECTION mode reserved bytes are not sent. Only IPv4 destination can be used.
+     */
+    int32_t sendWithHeadroom(char* buffer, uint16_t dataLength, int32_t host = 0, uint16_t port = 0);
+    /**
+     * Read datagram into buffer and return view of data (without copying of data).
+     * @param buffer pointer to buffer for whole datagram (header and data).
+     * @param bufferSize size of buffer.
+     * @param view pointer to view, which will point to data inside of buffer.
+     * @return length of recevied data or -1 if error.
+     */
+    int32_t readView(char* buffer, uint16_t bufferSize, Socks5::UDPDatagramView* view);
+    /**
+     * Read datagram into buffer of BufferPool and return view of data (as readView()). Buffer can be handed to
+     * other thread by copy of handle, it is returned to pool by destruction of last handle.
+     * @param buffer pointer to handle. Its buffer is reused if handle is only owner, else new buffer is taken.
+     * @param view pointer to view, which will point to data inside of buffer.
+     * @param bufferClass class of taken buffer.
+     * @return length of recevied data or -1 if error (Socks5::PROXY_ERROR::MEMORY if buffer isn`t taken).
+     */
+    int32_t readPooled(PooledBuffer* buffer, Socks5::UDPDatagramView* view, Socks5::BUFFER_CLASS bufferClass = Socks5::BUFFER_CLASS::MTU);
+    /**
+     * Send batch of datagrams by sendmmsg. Only for UDP_ASSOCIATE mode.
+     * @param messages array of messages (data, dataLength and address or ulAddressIPv4 and usPort must be set).
+     * @param count count of messages.
+     * @return count of sent messages or -1 if error. Length of sent data of each message is written to its result.
+     * Sending stops at message with invalid address (its result is -1, Socks5::PROXY_ERROR::DST_HOST).
+     */
+    int32_t sendBatch(Socks5::UDPMessage* messages, uint32_t count);
+    /**
+     * Read batch of datagrams by recvmmsg. Only for UDP_ASSOCIATE mode.
+     * @param messages array of messages (data and dataLength are buffer and its size).
+     * @param count count of messages.
+     * @return count of received messages or -1 if error. Length of recevied data of each message is written to its result,
+     * source to address, ulAddressIPv4 and usPort.
+     */
+    int32_t readBatch(Socks5::UDPMessage* messages, uint32_t count);
+    /**
+     * Forward data between local socket and proxy in both directions until both are closed. Only for CONNECTION mode.
+     * Data is moved by splice() through pipes without copying to user space, end of data of one side is passed
+     * to other side by shutdown(SHUT_WR).
+     * @param localFd local stream socket (or pipe).
+     * @param stats pointer to counters, which are updated while relaying (can be 0).
+     * @param idleTimeout relay is stopped after this time (in mseconds) without data, 0 is without timeout.
+     * @return 0 if both directions were closed, -1 if error (see lastErrorCode()).
+     * @note Connection isn`t closed by relay, call closeConnection() after it.
+     */
+    int32_t relay(int localFd, Socks5::RelayStats* stats = 0, uint32_t idleTimeout = 0);
+    /**
+     * Select I/O backend of UDP relay socket. Only for UDP_ASSOCIATE mode, after connect.
+     * If kernel doesn`t support io_uring (multishot receive, provided buffer rings), syscall backend is used.
+     * @param backend wanted backend.
+     * @param bufferSize size of io_uring buffers (maximum size of datagram with header, bigger datagrams are sent by syscall).
+     * @return backend, which is used.
+     */
+    Socks5::UDP_BACKEND setUdpBackend(Socks5::UDP_BACKEND backend, uint32_t bufferSize = 2048);
+    /**
+     * Enable reassembly of fragmented datagrams (RFC 1928 FRAG field). Only for UDP_ASSOCIATE mode, after connect.
+     * Without reassembly fragments are dropped.
+     * @param slotCount count of sources which are reassembled at once, 0 disables reassembly.
+     * @param maxMessageSize maximum size of reassembled datagram.
+     * @param timeout reassembly timer in mseconds.
+     * @return true if successful.
+     */
+    bool setFragmentReassembly(uint32_t slotCount, uint32_t maxMessageSize = 65535, uint32_t timeout = Socks5::FRAGMENT_TIMEOUT);
+    /**
+     * Gets counters of reassembly.
+     * @return counters.
+     */
+    Socks5::ReassemblyStats getReassemblyStats() { return udpReassembler.getStats(); }
+    /**
+     * Enable tracing of UDP relay socket by software kernel timestamps (SO_TIMESTAMPING): time from send call
+     * to TX timestamp and from RX timestamp to return of read are written to per-thread rings of UdpTracer.
+     * Only for UDP_ASSOCIATE mode with syscall backend, after connect. Tracing is compiled in by SOCKS5_TRACING=1.
+     * @param bEnabled true to enable.
+     * @return true if successful, false if tracing isn`t compiled in, io_uring backend is used or socket option failed.
+     */
+    bool setTracing(bool bEnabled);
+    /**
+     * Send datagram split to fragments (RFC 1928 FRAG field). Only for UDP_ASSOCIATE mode.
+     * All fragments are passed to kernel by batches.
+     * @param packet pointer to data.
+     * @param dataLength length of data.
+     * @param address destination address.
+     * @param fragmentSize maximum length of data of each fragment.
+     * @return length of sent data or -1 if error (more than 127 fragments or send was failed).
+     */
+    int32_t sendFragmented(char* packet, uint32_t dataLength, const Socks5::Address& address, uint16_t fragmentSize);
     /**
      * Waiting (with timeout) send or/and receive data. Only for UDP_ASSOCIATE mode.
      * @param waitMode pointer to bit-mask of waiting mode.
      * @param timeout timeout in mseconds.
-     * @return 0 if success, -1 if error.
+     * @return 0 if success, -1 if error (Socks5::PROXY_ERROR::SESSION_CLOSED if control connection was closed,
+     * waiting is woken by it).
      */
     int32_t udpSocketWait(uint32_t *waitMode, uint32_t timeout);
     /**
@@ -166,6 +549,36 @@ public:
      * @return error code.
      */
     Socks5::PROXY_ERROR lastErrorCode();
+    /**
+     * Checks connection to proxy server.
+     * @return true if connected.
+     */
+    bool isConnected() { return bConnected; }
+    /**
+     * Gets mode of proxy.
+     * @return mode of proxy.
+     */
+    Socks5::PROXY_MODE getProxyMode() { return proxyMode; }
+    /**
+     * Gets TCP socket (data socket for CONNECTION mode, control socket for UDP_ASSOCIATE mode).
+     * @return socket descriptor.
+     */
+    int getTcpSocket() { return tcpConnection; }
+    /**
+     * Gets UDP relay socket. Only for UDP_ASSOCIATE mode.
+     * @return socket descriptor.
+     */
+    int getUdpSocket() { return udpConnection; }
+    /**
+     * Gets descriptor for waiting of UDP relay readiness (ring descriptor for io_uring backend, else UDP socket).
+     * @return descriptor.
+     */
+    int getUdpWaitSocket() { return udpUring.isActive() ? udpUring.getRingFd() : udpConnection; }
+    /**
+     * Gets traffic counters of current session. Counters are added to ProxyMetrics::global() by closeConnection().
+     * @return bytes, packets and dropped datagrams of session.
+     */
+    Socks5::SessionStats getSessionStats();
     /**
      * Gets error string by error code.
      * @param errorCode error code.
@@ -179,17 +592,104 @@ public:
      * @param _isForceMainAddress true if proxy don`t adhere to RFC, false if else.
      */
     static inline void setForceMainAddress(bool _isForceMainAddress) { isForceMainAddress = _isForceMainAddress; }
+    /**
+     * Make address from string.
+     * @param host IPv4 or IPv6 address or domain name.
+     * @param port port (host byte order).
+     * @param address pointer to address for write.
+     * @return true if successful, false if host is empty or too long.
+     */
+    static bool makeAddress(std::string host, uint16_t port, Socks5::Address* address);
+    /**
+     * Gets string of address.
+     * @param address address.
+     * @return IPv4 or IPv6 address or domain name.
+     */
+    static std::string addressToString(const Socks5::Address& address);
 
 private:
-    bool udpAssociate(unsigned long mainProxyAddr);
-    bool connectionCommand(std::string dstIP, uint16_t dstPort);
-    unsigned int tcpConnection = 0;
-    unsigned int udpConnection = 0;
-    sockaddr_in udpProxyAddr = { 0 };
-    Socks5::PROXY_ERROR errorCode = Socks5::PROXY_ERROR::SUCCESS;
+    static uint64_t monotonicTime();
+    static uint64_t monotonicMicros();
+    bool waitHandshake(Socks5::HANDSHAKE_STATE targetState);
+    bool setCommand(Socks5::PROXY_MODE proxyMode, std::string dstIP, uint16_t dstPort);
+    bool startConnect(std::string ip, uint16_t port, std::string user, std::string password);
+    bool openConnection();
+    void restartStepByStep();
+    void finishAuth();
+    bool acquireHandshakeBuffer();
+    bool isStreamMode() { return proxyMode == Socks5::PROXY_MODE::CONNECTION || proxyMode == Socks5::PROXY_MODE::BIND; }
+    void setHandshakePhase(Socks5::HANDSHAKE_STATE state);
+    void prepareGreeting();
+    void prepareAuth();
+    void prepareRequest();
+    uint16_t encodeGreeting(std::span<uint8_t> out, bool bPipelined);
+    uint16_t encodeCommand(std::span<uint8_t> out);
+    int32_t transferHandshake(uint16_t expectedLength, Socks5::PROXY_ERROR receiveError);
+    void finishRequest();
+    void failTransfer(Socks5::PROXY_ERROR error);
+    void failHandshake(Socks5::PROXY_ERROR error);
+    static int32_t unpackDatagram(const uint8_t* head, char* data, int32_t received, uint16_t bufferSize, Socks5::Address* address, uint8_t* fragment);
+    int32_t receiveDatagram(char* data, uint16_t bufferSize, Socks5::Address* address);
+    int32_t udpSendMessage(struct msghdr* msg);
+    int32_t udpReceiveMessage(struct msghdr* msg);
+    int32_t udpSendBatch(struct mmsghdr* msgs, uint32_t count);
+    int32_t reassembleFragment(uint8_t fragment, const Socks5::Address& source, char* data, int32_t dataLength, uint16_t bufferSize);
+    int32_t countSent(int32_t result);
+    int32_t countReceived(int32_t result);
+    int32_t countTruncated(int32_t length, int32_t bufferSize);
+    int32_t streamReceived(int32_t result);
+    int32_t failReceive();
+    int32_t uringSent(int32_t result);
+    bool probeSession();
+    void loseSession();
+    bool applyKeepalive();
+    bool reassociate();
+    int tcpConnection = -1;
+    int udpConnection = -1;
+    sockaddr_storage udpProxyAddr = { 0 };
+    socklen_t udpProxyAddrLength = 0;
+    UdpUring udpUring;
+    UdpReassembler udpReassembler;
+    // empty without SOCKS5_TRACING
+    [[no_unique_address]] UdpTrace udpTrace;
+    // written by read functions, which can be called by many threads
+    std::atomic<Socks5::PROXY_ERROR> errorCode{ Socks5::PROXY_ERROR::SUCCESS };
     Socks5::PROXY_MODE proxyMode = Socks5::PROXY_MODE::CONNECTION;
     bool bConnected = false;
 
+    Socks5::HANDSHAKE_STATE handshakeState = Socks5::HANDSHAKE_STATE::NONE;
+    // buffer is taken from pool only while handshake messages are transferred
+    PooledBuffer handshakeStorage;
+    uint8_t* handshakeBuffer = 0;
+    uint16_t handshakeTxLength = 0;
+    uint16_t handshakeTxOffset = 0;
+    uint16_t handshakeRxLength = 0;
+    uint32_t handshakeTimeout = 0;
+    bool bStopAfterAuth = false;
+    bool bPipelinedHandshake = false;
+    bool bFastOpen = false;
+    // current handshake sends all messages in one flight
+    bool bPipelineActive = false;
+    uint16_t fastOpenSent = 0;
+    uint64_t phaseStartTime = 0;
+    uint64_t phaseStartMicros = 0;
+    Socks5::SessionCounters counters;
+    sockaddr_storage mainProxyAddr = { 0 };
+    socklen_t mainProxyAddrLength = 0;
+    std::string handshakeUser;
+    std::string handshakePassword;
+    Socks5::Address handshakeDst;
+    Socks5::Address boundAddress = { 0 };
+    Socks5::Address peerAddress = { 0 };
+    std::string proxyHost;
+    uint16_t proxyPort = 0;
+    uint32_t keepaliveTime = 0;
+    uint32_t uringBufferSize = 0;
+    bool bReassociation = false;
+    ReassociationCallback reassociationCallback;
+    std::atomic<bool> bSessionLost{ false };
+    std::atomic<uint64_t> lastHealthCheck{ 0 };
+
     // Some proxy-servers don`t adhere to RFC
     // and give invalid address with udp association
     static bool isForceMainAddress;
@@ -0,0 +1,179 @@
+#include "proxymetrics.h"
+#include "proxymanager.h"
+#include <stdio.h>
+#include <iterator>
+
+uint32_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+	if (value < SUB_BUCKETS)
+		return value;
+
+	// buckets of each power of 2 are split to SUB_BUCKETS linear sub-buckets
+	uint32_t magnitude = 63 - __builtin_clzll(value);
+	uint32_t shift = magnitude - SUB_BUCKET_BITS;
+	return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucketUpper(uint32_t index)
+{
+	if (index < SUB_BUCKETS)
+		return index;
+
+	uint32_t shift = index / SUB_BUCKETS - 1;
+	uint64_t subBucket = index % SUB_BUCKETS;
+	return ((SUB_BUCKETS + subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+	counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+	total.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+	uint64_t currentMax = max.load(std::memory_order_relaxed);
+	while (value > currentMax && !max.compare_exchange_weak(currentMax, value, std::memory_order_relaxed));
+}
+
+Socks5::HistogramSnapshot LatencyHistogram::snapshot() const
+{
+	Socks5::HistogramSnapshot result;
+	result.count = total.load(std::memory_order_relaxed);
+	result.sum = sum.load(std::memory_order_relaxed);
+	result.max = max.load(std::memory_order_relaxed);
+	result.p50 = result.p90 = result.p99 = 0;
+
+	uint64_t counted = 0;
+	for (uint32_t i = 0; i < BUCKETS; i++)
+		counted += counts[i].load(std::memory_order_relaxed);
+	if (counted == 0)
+		return result;
+
+	// counts can grow while they are read, so targets are taken from the same pass
+	uint64_t target50 = (counted * 50 + 99) / 100;
+	uint64_t target90 = (counted * 90 + 99) / 100;
+	uint64_t target99 = (counted * 99 + 99) / 100;
+	uint64_t cumulative = 0;
+	for (uint32_t i = 0; i < BUCKETS; i++)
+	{
+		cumulative += counts[i].load(std::memory_order_relaxed);
+		uint64_t upper = bucketUpper(i);
+		if (upper > result.max)
+			upper = result.max;
+		if (result.p50 == 0 && cumulative >= target50)
+			result.p50 = upper;
+		if (result.p90 == 0 && cumulative >= target90)
+			result.p90 = upper;
+		if (cumulative >= target99)
+		{
+			result.p99 = upper;
+			break;
+		}
+	}
+	return result;
+}
+
+ProxyMetrics& ProxyMetrics::global()
+{
+	static ProxyMetrics metrics;
+	return metrics;
+}
+
+void ProxyMetrics::recordPhase(Socks5::HANDSHAKE_PHASE phase, uint64_t latency)
+{
+	if (phase < Socks5::HANDSHAKE_PHASE::COUNT)
+		phases[static_cast<uint32_t>(phase)].record(latency);
+}
+
+void ProxyMetrics::recordError(uint32_t errorCode)
+{
+	if (errorCode < Socks5::PROXY_ERROR_COUNT)
+		errorCounts[errorCode].fetch_add(1, std::memory_order_relaxed);
+}
+
+void ProxyMetrics::recordClosedSession(const Socks5::SessionStats& stats)
+{
+	closedSessions.bytesSent.fetch_add(stats.bytesSent, std::memory_order_relaxed);
+	closedSessions.bytesReceived.fetch_add(stats.bytesReceived, std::memory_order_relaxed);
+	closedSessions.packetsSent.fetch_add(stats.packetsSent, std::memory_order_relaxed);
+	closedSessions.packetsReceived.fetch_add(stats.packetsReceived, std::memory_order_relaxed);
+	closedSessions.droppedDatagrams.fetch_add(stats.droppedDatagrams, std::memory_order_relaxed);
+}
+
+Socks5::MetricsSnapshot ProxyMetrics::snapshot() const
+{
+	Socks5::MetricsSnapshot result;
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::HANDSHAKE_PHASE::COUNT); i++)
+		result.phases[i] = phases[i].snapshot();
+	result.handshakesStarted = handshakesStarted.load(std::memory_order_relaxed);
+	result.handshakesEstablished = handshakesEstablished.load(std::memory_order_relaxed);
+	for (uint32_t i = 0; i < Socks5::PROXY_ERROR_COUNT; i++)
+		result.errorCounts[i] = errorCounts[i].load(std::memory_order_relaxed);
+	result.closedSessions.bytesSent = closedSessions.bytesSent.load(std::memory_order_relaxed);
+	result.closedSessions.bytesReceived = closedSessions.bytesReceived.load(std::memory_order_relaxed);
+	result.closedSessions.packetsSent = closedSessions.packetsSent.load(std::memory_order_relaxed);
+	result.closedSessions.packetsReceived = closedSessions.packetsReceived.load(std::memory_order_relaxed);
+	result.closedSessions.droppedDatagrams = closedSessions.droppedDatagrams.load(std::memory_order_relaxed);
+	return result;
+}
+
+std::string ProxyMetrics::toPrometheus() const
+{
+	static const char* phaseNames[] = { "connect", "method", "auth", "command" };
+	static const char* errorNames[] = {
+		"SUCCESS", "CONNECTION", "NETWORK", "PROTOCOL", "AUTH_METHOD", "UDP_BIND", "IMPOSSIBLE", "MEMORY",
+		"DST_HOST", "SIGNIN", "GENERAL", "RULESET", "NETWORK_UNREACHEBLE", "HOST_UNREACHEBLE",
+		"CONNECTION_REFUSED", "TTL", "COMMAND_NOT_SUPPORT", "ADDRESS_TYPE", "UNKNOW", "TIMEOUT",
+		"WOULD_BLOCK", "SESSION_CLOSED"
+	};
+	// every code of PROXY_ERROR has name
+	static_assert(std::size(errorNames) == Socks5::PROXY_ERROR_COUNT);
+	static_assert(static_cast<uint32_t>(Socks5::PROXY_ERROR::SESSION_CLOSED) + 1 == Socks5::PROXY_ERROR_COUNT);
+	Socks5::MetricsSnapshot metrics = snapshot();
+	std::string text;
+	char line[512];
+
+	text += "# HELP socks5_handshake_phase_seconds Latency of SOCKS5 handshake phases.\n";
+	text += "# TYPE socks5_handshake_phase_seconds summary\n";
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Socks5::HANDSHAKE_PHASE::COUNT); i++)
+	{
+		const Socks5::HistogramSnapshot& phase = metrics.phases[i];
+		snprintf(line, sizeof(line),
+			"socks5_handshake_phase_seconds{phase=\"%s\",quantile=\"0.5\"} %.6f\n"
+			"socks5_handshake_phase_seconds{phase=\"%s\",quantile=\"0.9\"} %.6f\n"
+			"socks5_handshake_phase_seconds{phase=\"%s\",quantile=\"0.99\"} %.6f\n",
+			phaseNames[i], phase.p50 / 1e6, phaseNames[i], phase.p90 / 1e6, phaseNames[i], phase.p99 / 1e6);
+		text += line;
+		snprintf(line, sizeof(line),
+			"socks5_handshake_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+			"socks5_handshake_phase_seconds_count{phase=\"%s\"} %lu\n",
+			phaseNames[i], phase.sum / 1e6, phaseNames[i], (unsigned long)phase.count);
+		text += line;
+	}
+
+	text += "# HELP socks5_handshakes_total Handshakes by result.\n";
+	text += "# TYPE socks5_handshakes_total counter\n";
+	snprintf(line, sizeof(line), "socks5_handshakes_total{result=\"started\"} %lu\nsocks5_handshakes_total{result=\"established\"} %lu\n",
+		(unsigned long)metrics.handshakesStarted, (unsigned long)metrics.handshakesEstablished);
+	text += line;
+
+	text += "# HELP socks5_errors_total Errors by code.\n";
+	text += "# TYPE socks5_errors_total counter\n";
+	for (uint32_t i = 1; i < Socks5::PROXY_ERROR_COUNT; i++)
+	{
+		snprintf(line, sizeof(line), "socks5_errors_total{code=\"%s\"} %lu\n", errorNames[i], (unsigned long)metrics.errorCounts[i]);
+		text += line;
+	}
+
+	text += "# HELP socks5_closed_session_traffic_total Traffic of closed sessions.\n";
+	text += "# TYPE socks5_closed_session_traffic_total counter\n";
+	snprintf(line, sizeof(line),
+		"socks5_closed_session_traffic_total{counter=\"bytes_sent\"} %lu\n"
+		"socks5_closed_session_traffic_total{counter=\"bytes_received\"} %lu\n"
+		"socks5_closed_session_traffic_total{counter=\"packets_sent\"} %lu\n"
+		"socks5_closed_session_traffic_total{counter=\"packets_received\"} %lu\n"
+		"socks5_closed_session_traffic_total{counter=\"dropped_datagrams\"} %lu\n",
+		(unsigned long)metrics.closedSessions.bytesSent, (unsigned long)metrics.closedSessions.bytesReceived,
+		(unsigned long)metrics.closedSessions.packetsSent, (unsigned long)metrics.closedSessions.packetsReceived,
+		(unsigned long)metrics.closedSessions.droppedDatagrams);
+	text += line;
+	return text;
+}
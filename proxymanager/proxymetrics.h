@@ -0,0 +1,138 @@
+/******************************************************************************
+ * File: proxymetrics.h
+ * Description: Handshake latency histograms and traffic counters of socks5-client.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef PROXYMETRICS_H
+#define PROXYMETRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+namespace Socks5
+{
+    enum class HANDSHAKE_PHASE
+    {
+        CONNECT = 0,    // TCP connect
+        METHOD,         // method negotiation
+        AUTH,           // RFC1929 auth
+        COMMAND,        // CONNECT/BIND/UDP ASSOCIATE reply
+        COUNT
+    };
+
+    // count of PROXY_ERROR codes
+    const uint32_t PROXY_ERROR_COUNT = 22;
+
+    /**
+     * Traffic counters of session. Updated by relaxed atomic increments.
+     * Failed UDP sends, received UDP datagrams with invalid header and reassembled datagrams truncated to buffer
+     * are counted as dropped.
+     */
+    struct SessionCounters
+    {
+        std::atomic<uint64_t> bytesSent{ 0 };
+        std::atomic<uint64_t> bytesReceived{ 0 };
+        std::atomic<uint64_t> packetsSent{ 0 };
+        std::atomic<uint64_t> packetsReceived{ 0 };
+        std::atomic<uint64_t> droppedDatagrams{ 0 };
+    };
+
+    struct SessionStats
+    {
+        uint64_t    bytesSent;
+        uint64_t    bytesReceived;
+        uint64_t    packetsSent;
+        uint64_t    packetsReceived;
+        uint64_t    droppedDatagrams;
+    };
+
+    struct HistogramSnapshot
+    {
+        uint64_t    count;
+        uint64_t    sum;        // useconds
+        uint64_t    max;        // useconds
+        uint64_t    p50;        // useconds
+        uint64_t    p90;        // useconds
+        uint64_t    p99;        // useconds
+    };
+
+    struct MetricsSnapshot
+    {
+        HistogramSnapshot   phases[static_cast<uint32_t>(HANDSHAKE_PHASE::COUNT)];
+        uint64_t            handshakesStarted;
+        uint64_t            handshakesEstablished;
+        uint64_t            errorCounts[PROXY_ERROR_COUNT];
+        SessionStats        closedSessions; // totals of closed sessions
+    };
+}
+
+/**
+ * @class LatencyHistogram
+ * Lock-free log-linear (HDR-style) histogram of useconds with ~6% precision.
+ */
+class LatencyHistogram
+{
+public:
+    /**
+     * Record value.
+     * @param value value in useconds.
+     */
+    void record(uint64_t value);
+    /**
+     * Gets snapshot with percentiles.
+     * @return snapshot.
+     */
+    Socks5::HistogramSnapshot snapshot() const;
+
+private:
+    static const uint32_t SUB_BUCKET_BITS = 4;
+    static const uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const uint32_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+    static uint32_t bucketIndex(uint64_t value);
+    static uint64_t bucketUpper(uint32_t index);
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{ 0 };
+    std::atomic<uint64_t> sum{ 0 };
+    std::atomic<uint64_t> max{ 0 };
+};
+
+/**
+ * @class ProxyMetrics
+ * Process-wide metrics of all sessions: handshake phase latencies, error codes and traffic of closed sessions.
+ */
+class ProxyMetrics
+{
+public:
+    /**
+     * Gets process-wide metrics.
+     * @return metrics.
+     */
+    static ProxyMetrics& global();
+    void recordPhase(Socks5::HANDSHAKE_PHASE phase, uint64_t latency);
+    void recordStarted() { handshakesStarted.fetch_add(1, std::memory_order_relaxed); }
+    void recordEstablished() { handshakesEstablished.fetch_add(1, std::memory_order_relaxed); }
+    void recordError(uint32_t errorCode);
+    void recordClosedSession(const Socks5::SessionStats& stats);
+    /**
+     * Gets snapshot of metrics.
+     * @return snapshot.
+     */
+    Socks5::MetricsSnapshot snapshot() const;
+    /**
+     * Gets metrics in Prometheus text format.
+     * @return text of metrics.
+     */
+    std::string toPrometheus() const;
+
+private:
+    LatencyHistogram phases[static_cast<uint32_t>(Socks5::HANDSHAKE_PHASE::COUNT)];
+    std::atomic<uint64_t> handshakesStarted{ 0 };
+    std::atomic<uint64_t> handshakesEstablished{ 0 };
+    std::atomic<uint64_t> errorCounts[Socks5::PROXY_ERROR_COUNT] = {};
+    Socks5::SessionCounters closedSessions;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "resolvercache.h"
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+
+static uint64_t resolverTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+ResolverCache& ResolverCache::global()
+{
+	static ResolverCache cache;
+	return cache;
+}
+
+ResolverCache::~ResolverCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bStopping = true;
+	}
+	condition.notify_all();
+	if (thread.joinable())
+		thread.join();
+}
+
+ResolverCache::ThreadTable& ResolverCache::threadTable()
+{
+	thread_local ThreadTable table;
+	uint64_t currentGeneration = generation.load(std::memory_order_acquire);
+	if (table.generation != currentGeneration)
+	{
+		table.hosts.clear();
+		table.addresses.clear();
+		table.generation = currentGeneration;
+	}
+	return table;
+}
+
+bool ResolverCache::resolve(const std::string& host, uint16_t port, sockaddr_storage* address, socklen_t* addressLength)
+{
+	uint64_t now = resolverTime();
+	ThreadTable& table = threadTable();
+	auto local = table.hosts.find(host);
+	if (local != table.hosts.end() && now < local->second.refreshTime)
+	{
+		threadHits.fetch_add(1, std::memory_order_relaxed);
+		return copyEntry(local->second, port, address, addressLength);
+	}
+
+	Entry entry;
+	bool bFound = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto shared = hosts.find(host);
+		if (shared != hosts.end() && now < shared->second.expireTime)
+		{
+			// entry is used until it expires, fresh one is resolved in background
+			if (now >= shared->second.refreshTime && !shared->second.bRefreshing)
+			{
+				shared->second.bRefreshing = true;
+				refreshQueue.push_back(host);
+				if (!thread.joinable())
+					thread = std::thread(&ResolverCache::refreshThread, this);
+				condition.notify_one();
+			}
+			entry = shared->second;
+			bFound = true;
+		}
+	}
+
+	if (bFound)
+		sharedHits.fetch_add(1, std::memory_order_relaxed);
+	else
+	{
+		entry = lookup(host);
+		resolutions.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(mutex);
+		hosts[host] = entry;
+	}
+
+	if (table.hosts.size() >= Socks5::RESOLVER_THREAD_ENTRIES)
+		table.hosts.clear();
+	table.hosts[host] = entry;
+	return copyEntry(entry, port, address, addressLength);
+}
+
+bool ResolverCache::makeAddress(const std::string& host, uint16_t port, Socks5::Address* address)
+{
+	ThreadTable& table = threadTable();
+	auto local = table.addresses.find(host);
+	if (local == table.addresses.end())
+	{
+		Socks5::Address parsed;
+		if (!ProxyManager::makeAddress(host, port, &parsed))
+			return false;
+		if (table.addresses.size() >= Socks5::RESOLVER_THREAD_ENTRIES)
+			table.addresses.clear();
+		local = table.addresses.emplace(host, parsed).first;
+	}
+
+	const Socks5::Address& cached = local->second;
+	address->byteAddressType = cached.byteAddressType;
+	address->byteLength = cached.byteLength;
+	memcpy(address->bytes, cached.bytes, cached.byteLength);
+	address->usPort = htons(port);
+	return true;
+}
+
+void ResolverCache::setTtl(uint32_t ttl, uint32_t negativeTtl)
+{
+	this->ttl.store(ttl, std::memory_order_relaxed);
+	this->negativeTtl.store(negativeTtl, std::memory_order_relaxed);
+}
+
+void ResolverCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	hosts.clear();
+	generation.fetch_add(1, std::memory_order_release);
+}
+
+Socks5::ResolverStats ResolverCache::getStats()
+{
+	Socks5::ResolverStats stats;
+	stats.threadHits = threadHits.load(std::memory_order_relaxed);
+	stats.sharedHits = sharedHits.load(std::memory_order_relaxed);
+	stats.resolutions = resolutions.load(std::memory_order_relaxed);
+	stats.refreshes = refreshes.load(std::memory_order_relaxed);
+	stats.failures = failures.load(std::memory_order_relaxed);
+	return stats;
+}
+
+ResolverCache::Entry ResolverCache::lookup(const std::string& host)
+{
+	Entry entry;
+	memset(&entry.address, 0, sizeof(entry.address));
+	entry.addressLength = 0;
+	entry.bResolved = false;
+	entry.bRefreshing = false;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* result = 0;
+	if (getaddrinfo(host.c_str(), NULL, &hints, &result) == 0 && result != 0)
+	{
+		memcpy(&entry.address, result->ai_addr, result->ai_addrlen);
+		entry.addressLength = result->ai_addrlen;
+		entry.bResolved = true;
+	}
+	if (result != 0)
+		freeaddrinfo(result);
+
+	uint64_t now = resolverTime();
+	if (entry.bResolved)
+	{
+		uint32_t lifetime = ttl.load(std::memory_order_relaxed);
+		entry.expireTime = now + lifetime;
+		entry.refreshTime = now + lifetime - lifetime / 4;
+	}
+	else
+	{
+		failures.fetch_add(1, std::memory_order_relaxed);
+		entry.expireTime = now + negativeTtl.load(std::memory_order_relaxed);
+		entry.refreshTime = entry.expireTime;
+	}
+	return entry;
+}
+
+void ResolverCache::refreshThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!bStopping)
+	{
+		if (refreshQueue.empty())
+		{
+			condition.wait(lock);
+			continue;
+		}
+		std::string host = refreshQueue.front();
+		refreshQueue.pop_front();
+
+		lock.unlock();
+		Entry entry = lookup(host);
+		refreshes.fetch_add(1, std::memory_order_relaxed);
+		lock.lock();
+
+		auto shared = hosts.find(host);
+		if (shared == hosts.end())
+			continue; // cache was cleared
+		if (entry.bResolved)
+			shared->second = entry;
+		else
+		{
+			// failed refresh keeps old address until it expires and is retried after negative TTL
+			shared->second.bRefreshing = false;
+			shared->second.refreshTime = std::min(entry.expireTime, shared->second.expireTime);
+		}
+	}
+}
+
+bool ResolverCache::copyEntry(const Entry& entry, uint16_t port, sockaddr_storage* address, socklen_t* addressLength)
+{
+	if (!entry.bResolved)
+		return false;
+	memcpy(address, &entry.address, entry.addressLength);
+	*addressLength = entry.addressLength;
+	if (entry.address.ss_family == AF_INET6)
+		((struct sockaddr_in6*)address)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in*)address)->sin_port = htons(port);
+	return true;
+}
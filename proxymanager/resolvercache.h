@@ -0,0 +1,134 @@
+/******************************************************************************
+ * File: resolvercache.h
+ * Description: Cache of resolved host names with per-thread tables and background refresh.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef RESOLVERCACHE_H
+#define RESOLVERCACHE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    // lifetime (in mseconds) of resolved and of failed names, getaddrinfo() doesn`t give TTL of records
+    const uint32_t RESOLVER_TTL = 60000;
+    const uint32_t RESOLVER_NEGATIVE_TTL = 5000;
+    // per-thread table is cleared when it has this count of entries
+    const uint32_t RESOLVER_THREAD_ENTRIES = 1024;
+
+    struct ResolverStats
+    {
+        uint64_t    threadHits;     // lookups answered by per-thread table
+        uint64_t    sharedHits;     // lookups answered by shared table
+        uint64_t    resolutions;    // blocking resolutions (first lookup or lookup after expiration)
+        uint64_t    refreshes;      // background resolutions
+        uint64_t    failures;       // failed resolutions
+    };
+}
+
+/**
+ * @class ResolverCache
+ * Process-wide cache of host names. Every thread reads own table without locks, misses go to shared table.
+ * Name is resolved again by background thread when its TTL is about to expire, so only first lookup and
+ * lookup after expiration wait for getaddrinfo(). Failures are cached for negative TTL.
+ * @note All methods are thread-safe. Cache exists only as global(), because tables of threads aren`t per instance.
+ */
+class ResolverCache
+{
+public:
+    /**
+     * Gets process-wide cache.
+     * @return cache.
+     */
+    static ResolverCache& global();
+    ~ResolverCache();
+    ResolverCache(const ResolverCache&) = delete;
+    ResolverCache& operator=(const ResolverCache&) = delete;
+    /**
+     * Resolve host name (or parse IP address).
+     * @param host host name or IPv4 or IPv6 address.
+     * @param port port (host byte order).
+     * @param address pointer to address for write.
+     * @param addressLength pointer to length of address for write.
+     * @return true if successful, false if name isn`t resolved.
+     */
+    bool resolve(const std::string& host, uint16_t port, sockaddr_storage* address, socklen_t* addressLength);
+    /**
+     * Make destination address from string as ProxyManager::makeAddress(), but result for string is kept
+     * in table of thread, so repeated destination costs one hash lookup. Domain name isn`t resolved,
+     * it is passed to proxy-server.
+     * @param host IPv4 or IPv6 address or domain name.
+     * @param port port (host byte order).
+     * @param address pointer to address for write.
+     * @return true if successful, false if host is empty or too long.
+     */
+    bool makeAddress(const std::string& host, uint16_t port, Socks5::Address* address);
+    /**
+     * Set lifetime of entries, which are added after call.
+     * @param ttl lifetime of resolved names in mseconds.
+     * @param negativeTtl lifetime of failed names in mseconds.
+     */
+    void setTtl(uint32_t ttl, uint32_t negativeTtl);
+    /**
+     * Drop all entries (tables of threads are dropped on next lookup).
+     */
+    void clear();
+    /**
+     * Gets counters of cache.
+     * @return counters.
+     */
+    Socks5::ResolverStats getStats();
+
+private:
+    // tables of threads are thread_local, so they belong to the only instance
+    ResolverCache() {}
+
+    struct Entry
+    {
+        sockaddr_storage    address;
+        socklen_t           addressLength;
+        bool                bResolved;
+        bool                bRefreshing;
+        uint64_t            refreshTime;    // background resolution is started after it
+        uint64_t            expireTime;
+    };
+
+    struct ThreadTable
+    {
+        uint64_t generation = 0;
+        std::unordered_map<std::string, Entry> hosts;
+        std::unordered_map<std::string, Socks5::Address> addresses;
+    };
+
+    ThreadTable& threadTable();
+    Entry lookup(const std::string& host);
+    void refreshThread();
+    static bool copyEntry(const Entry& entry, uint16_t port, sockaddr_storage* address, socklen_t* addressLength);
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::unordered_map<std::string, Entry> hosts;
+    std::deque<std::string> refreshQueue;
+    std::thread thread;     // started by first refresh
+    bool bStopping = false;
+    std::atomic<uint64_t> generation{ 1 };
+    std::atomic<uint32_t> ttl{ Socks5::RESOLVER_TTL };
+    std::atomic<uint32_t> negativeTtl{ Socks5::RESOLVER_NEGATIVE_TTL };
+    std::atomic<uint64_t> threadHits{ 0 };
+    std::atomic<uint64_t> sharedHits{ 0 };
+    std::atomic<uint64_t> resolutions{ 0 };
+    std::atomic<uint64_t> refreshes{ 0 };
+    std::atomic<uint64_t> failures{ 0 };
+};
+
+#endif
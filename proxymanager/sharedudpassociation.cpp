@@ -0,0 +1,152 @@
+#include "sharedudpassociation.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+// errors of threads don`t overwrite each other
+static thread_local Socks5::PROXY_ERROR threadError = Socks5::PROXY_ERROR::SUCCESS;
+
+SharedUdpAssociation::~SharedUdpAssociation()
+{
+	close();
+}
+
+bool SharedUdpAssociation::connect(std::string ip, uint16_t port, std::string user, std::string password)
+{
+	close();
+	if (!manager.connectToProxy(ip, port, user, password, Socks5::PROXY_MODE::UDP_ASSOCIATE))
+	{
+		fail(manager.lastErrorCode());
+		return false;
+	}
+
+	threadError = Socks5::PROXY_ERROR::SUCCESS;
+	bOpen.store(true);
+	return true;
+}
+
+int32_t SharedUdpAssociation::send(char* packet, uint16_t dataLength, int32_t host, uint16_t port)
+{
+	if (host == 0 || port == 0)
+		return fail(Socks5::PROXY_ERROR::DST_HOST);
+	if (!enter())
+		return -1;
+	// UDP path of ProxyManager only reads its state, which isn`t changed until close()
+	int32_t result = manager.send(packet, dataLength, host, port);
+	leave();
+	return result >= 0 ? result : fail(Socks5::PROXY_ERROR::NETWORK);
+}
+
+int32_t SharedUdpAssociation::send(char* packet, uint16_t dataLength, const Socks5::Address& address)
+{
+	if (!enter())
+		return -1;
+	int32_t result = manager.send(packet, dataLength, address);
+	leave();
+	return result >= 0 ? result : fail(Socks5::PROXY_ERROR::NETWORK);
+}
+
+int32_t SharedUdpAssociation::sendBatch(Socks5::UDPMessage* messages, uint32_t count)
+{
+	if (!enter())
+		return -1;
+	int32_t result = manager.sendBatch(messages, count);
+	leave();
+	return result >= 0 ? result : fail(Socks5::PROXY_ERROR::NETWORK);
+}
+
+int32_t SharedUdpAssociation::readView(char* buffer, uint16_t bufferSize, Socks5::UDPDatagramView* view)
+{
+	if (!enter())
+		return -1;
+	int32_t result = manager.readView(buffer, bufferSize, view);
+	leave();
+	if (result >= 0)
+		return result;
+	// manager checks control connection, when read fails, and keeps errno of read
+	if (manager.isSessionLost())
+		return fail(Socks5::PROXY_ERROR::SESSION_CLOSED);
+	return fail(errno == EAGAIN || errno == EWOULDBLOCK ? Socks5::PROXY_ERROR::WOULD_BLOCK : Socks5::PROXY_ERROR::NETWORK);
+}
+
+int32_t SharedUdpAssociation::wait(uint32_t* waitMode, uint32_t timeout)
+{
+	if (!enter())
+		return -1;
+
+	// control connection is polled too, its end (or reset) means end of association
+	struct pollfd pollFds[2];
+	struct pollfd& pollFd = pollFds[0];
+	pollFd.fd = manager.getUdpSocket();
+	pollFd.events = 0;
+	pollFd.revents = 0;
+	if (*waitMode & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND))
+		pollFd.events |= POLLOUT;
+	if (*waitMode & static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE))
+		pollFd.events |= POLLIN;
+	pollFds[1].fd = manager.getTcpSocket();
+	pollFds[1].events = POLLRDHUP;
+	pollFds[1].revents = 0;
+	int32_t result = poll(pollFds, 2, timeout);
+	bool bSessionAlive = pollFds[1].revents == 0 || manager.checkSession();
+	leave();
+
+	*waitMode = static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_NONE);
+	if (result < 0 && errno != EINTR)
+		return fail(Socks5::PROXY_ERROR::NETWORK);
+	if (!bSessionAlive)
+		return fail(Socks5::PROXY_ERROR::SESSION_CLOSED);
+	// hang up is raised by close()
+	if (pollFd.revents & (POLLHUP | POLLERR | POLLNVAL))
+		return fail(isConnected() ? Socks5::PROXY_ERROR::NETWORK : Socks5::PROXY_ERROR::CONNECTION);
+	if (pollFd.revents & POLLOUT)
+		*waitMode |= static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_SEND);
+	if (pollFd.revents & POLLIN)
+		*waitMode |= static_cast<uint32_t>(Socks5::PROXY_WAIT_MODE::PROXY_WAIT_RECEIVE);
+	return 0;
+}
+
+void SharedUdpAssociation::close()
+{
+	std::lock_guard<std::mutex> lock(closeMutex);
+	if (!bOpen.exchange(false))
+		return;
+
+	// shutdown wakes threads waiting in poll() even on unconnected UDP socket
+	shutdown(manager.getUdpSocket(), SHUT_RDWR);
+	uint32_t count;
+	while ((count = inFlight.load()) != 0)
+		inFlight.wait(count);
+	manager.closeConnection();
+}
+
+Socks5::PROXY_ERROR SharedUdpAssociation::lastErrorCode()
+{
+	return threadError;
+}
+
+bool SharedUdpAssociation::enter()
+{
+	// counter is raised before check, so either close() waits for this call or this call sees close()
+	inFlight.fetch_add(1);
+	if (!bOpen.load())
+	{
+		leave();
+		fail(Socks5::PROXY_ERROR::CONNECTION);
+		return false;
+	}
+	threadError = Socks5::PROXY_ERROR::SUCCESS;
+	return true;
+}
+
+void SharedUdpAssociation::leave()
+{
+	if (inFlight.fetch_sub(1) == 1 && !bOpen.load())
+		inFlight.notify_all();
+}
+
+int32_t SharedUdpAssociation::fail(Socks5::PROXY_ERROR error)
+{
+	threadError = error;
+	return -1;
+}
@@ -0,0 +1,116 @@
+/******************************************************************************
+ * File: sharedudpassociation.h
+ * Description: UDP association of proxy-server shared by many threads without locks.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef SHAREDUDPASSOCIATION_H
+#define SHAREDUDPASSOCIATION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include "proxymanager.h"
+
+/**
+ * @class SharedUdpAssociation
+ * UDP association, whose datagrams can be sent and read by many threads at once. Every call goes directly
+ * to UDP relay socket (kernel serializes datagrams), so threads don`t lock each other. Error of last call
+ * is kept per thread. close() waits for calls in progress, so socket isn`t closed under them.
+ * @note Fragmented datagrams are dropped, io_uring backend isn`t used (its rings aren`t thread-safe).
+ */
+class SharedUdpAssociation
+{
+public:
+    SharedUdpAssociation() {}
+    ~SharedUdpAssociation();
+    SharedUdpAssociation(const SharedUdpAssociation&) = delete;
+    SharedUdpAssociation& operator=(const SharedUdpAssociation&) = delete;
+    /**
+     * Create UDP association. Must not be called while other threads use association.
+     * @param ip IP address of proxy server.
+     * @param port port of proxy server.
+     * @param user login of proxy server or empty string if proxy without auth
+     * @param password password of proxy server or empty string if proxy without auth
+     * @return true if successful.
+     */
+    bool connect(std::string ip, uint16_t port, std::string user, std::string password);
+    /**
+     * Send datagram. Thread-safe.
+     * @param packet pointer to data.
+     * @param dataLength length of data.
+     * @param host destination IPv4 address (binary format).
+     * @param port destination port.
+     * @return length of sent data or -1 if error (see lastErrorCode()).
+     */
+    int32_t send(char* packet, uint16_t dataLength, int32_t host, uint16_t port);
+    /**
+     * Send datagram. Thread-safe.
+     * @param packet pointer to data.
+     * @param dataLength length of data.
+     * @param address destination address of any type.
+     * @return length of sent data or -1 if error (see lastErrorCode()).
+     */
+    int32_t send(char* packet, uint16_t dataLength, const Socks5::Address& address);
+    /**
+     * Send batch of datagrams by sendmmsg. Thread-safe.
+     * @param messages array of messages (as in ProxyManager::sendBatch()).
+     * @param count count of messages.
+     * @return count of sent messages or -1 if error (see lastErrorCode()).
+     */
+    int32_t sendBatch(Socks5::UDPMessage* messages, uint32_t count);
+    /**
+     * Read datagram into buffer and return view of data (as ProxyManager::readView()). Thread-safe,
+     * every datagram is read by one thread.
+     * @param buffer pointer to buffer for whole datagram (header and data).
+     * @param bufferSize size of buffer.
+     * @param view pointer to view, which will point to data inside of buffer.
+     * @return length of recevied data or -1 if error (see lastErrorCode(), Socks5::PROXY_ERROR::WOULD_BLOCK if there
+     * is no datagram yet, Socks5::PROXY_ERROR::SESSION_CLOSED if control connection was closed).
+     */
+    int32_t readView(char* buffer, uint16_t bufferSize, Socks5::UDPDatagramView* view);
+    /**
+     * Waiting (with timeout) send or/and receive readiness. Thread-safe, close() and end of control connection
+     * wake waiting threads.
+     * @param waitMode pointer to bit-mask of waiting mode.
+     * @param timeout timeout in mseconds.
+     * @return 0 if success, -1 if error (see lastErrorCode(), Socks5::PROXY_ERROR::SESSION_CLOSED if control connection
+     * was closed).
+     */
+    int32_t wait(uint32_t* waitMode, uint32_t timeout);
+    /**
+     * Close association. Thread-safe. New calls fail with Socks5::PROXY_ERROR::CONNECTION,
+     * calls in progress are waited for.
+     */
+    void close();
+    /**
+     * Checks that association is open.
+     * @return true if open.
+     */
+    bool isConnected() { return bOpen.load(); }
+    /**
+     * Gets error code of last call of calling thread.
+     * @return error code.
+     * @note this is static function.
+     */
+    static Socks5::PROXY_ERROR lastErrorCode();
+    /**
+     * Gets traffic counters of association.
+     * @return bytes, packets and dropped datagrams.
+     */
+    Socks5::SessionStats getSessionStats() { return manager.getSessionStats(); }
+
+private:
+    bool enter();
+    void leave();
+    static int32_t fail(Socks5::PROXY_ERROR error);
+
+    ProxyManager manager;
+    // count of calls in progress, close() waits until it is 0
+    std::atomic<uint32_t> inFlight{ 0 };
+    std::atomic<bool> bOpen{ false };
+    std::mutex closeMutex;
+};
+
+#endif
@@ -0,0 +1,362 @@
+/******************************************************************************
+ * File: socks5codec.h
+ * Description: Header-only encoders of requests and parsers of replies of SOCKS5 protocol (RFC 1928, RFC 1929).
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef SOCKS5CODEC_H
+#define SOCKS5CODEC_H
+
+#include <stdint.h>
+#include <array>
+#include <bit>
+#include <span>
+#include <string_view>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    enum class PARSE_STATUS
+    {
+        OK = 0,
+        INCOMPLETE,     // more bytes are needed, length of result is count of needed bytes (if it is known)
+        INVALID
+    };
+
+    /**
+     * Address parsed from message. bytes point inside of parsed span
+     * (for domain name it is name without length byte).
+     */
+    struct AddressView
+    {
+        PARSE_STATUS    status;
+        uint8_t         byteAddressType;    // IPv4=1, domain name = 3, IPv6 = 4
+        uint8_t         byteLength;         // length of bytes (4, length of domain name, 16)
+        const uint8_t*  bytes;
+        uint16_t        usPort;             // network byte order
+        uint16_t        length;             // length of packed address (ATYP, address, port)
+    };
+
+    struct MethodReply
+    {
+        PARSE_STATUS    status;
+        uint8_t         method;
+        uint16_t        length;
+    };
+
+    struct AuthReply
+    {
+        PARSE_STATUS    status;
+        uint8_t         code;               // 0 is success
+        uint16_t        length;
+    };
+
+    struct CommandReply
+    {
+        PARSE_STATUS    status;
+        uint8_t         reply;              // REP field, 0 is success
+        AddressView     bound;
+        uint16_t        length;
+    };
+
+    struct UDPHeader
+    {
+        PARSE_STATUS    status;
+        uint8_t         fragment;
+        AddressView     address;
+        uint16_t        length;             // length of header, data follows it
+    };
+}
+
+namespace Socks5::Codec
+{
+    // values in network byte order are kept in memory as on wire, so their bytes depend on endianness of host
+    constexpr uint16_t loadNetwork16(const uint8_t* in)
+    {
+        if constexpr (std::endian::native == std::endian::little)
+            return (uint16_t)(in[0] | (in[1] << 8));
+        else
+            return (uint16_t)((in[0] << 8) | in[1]);
+    }
+
+    constexpr void storeNetwork16(uint8_t* out, uint16_t value)
+    {
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            out[0] = (uint8_t)value;
+            out[1] = (uint8_t)(value >> 8);
+        }
+        else
+        {
+            out[0] = (uint8_t)(value >> 8);
+            out[1] = (uint8_t)value;
+        }
+    }
+
+    constexpr void storeNetwork32(uint8_t* out, uint32_t value)
+    {
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            for (int i = 0; i < 4; i++)
+                out[i] = (uint8_t)(value >> (i * 8));
+        }
+        else
+        {
+            for (int i = 0; i < 4; i++)
+                out[i] = (uint8_t)(value >> ((3 - i) * 8));
+        }
+    }
+
+    /**
+     * Encode greeting with fixed set of methods.
+     * @return message of size known at compile time.
+     */
+    template<uint8_t... Methods>
+    constexpr std::array<uint8_t, 2 + sizeof...(Methods)> encodeGreeting()
+    {
+        static_assert(sizeof...(Methods) > 0 && sizeof...(Methods) < 256, "count of methods must be from 1 to 255");
+        return { 0x05, (uint8_t)sizeof...(Methods), Methods... };
+    }
+
+    /**
+     * Encode username/password request (RFC 1929).
+     * @param out buffer.
+     * @param user username (up to 255 bytes).
+     * @param password password (up to 255 bytes).
+     * @return length of message or 0 if it doesn`t fit in buffer or username or password is too long.
+     */
+    constexpr uint16_t encodeAuth(std::span<uint8_t> out, std::string_view user, std::string_view password)
+    {
+        if (user.size() > 255 || password.size() > 255 || out.size() < 3 + user.size() + password.size())
+            return 0;
+        uint16_t length = 0;
+        out[length++] = 0x01; // the current version of the subnegotiation
+        out[length++] = (uint8_t)user.size();
+        for (char c : user)
+            out[length++] = (uint8_t)c;
+        out[length++] = (uint8_t)password.size();
+        for (char c : password)
+            out[length++] = (uint8_t)c;
+        return length;
+    }
+
+    /**
+     * Encode address (ATYP, address, port).
+     * @param out buffer.
+     * @param address address.
+     * @return length of packed address or 0 if it doesn`t fit in buffer, type of address is invalid or length of address
+     * doesn`t match its type.
+     */
+    constexpr uint16_t encodeAddress(std::span<uint8_t> out, const Address& address)
+    {
+        // byteLength of caller is trusted only after check against type, it bounds the copy
+        uint16_t byteLength;
+        switch (address.byteAddressType)
+        {
+        case 1: byteLength = 4; break;
+        case 3: byteLength = address.byteLength; break;
+        case 4: byteLength = 16; break;
+        default: return 0;
+        }
+        if (address.byteLength != byteLength)
+            return 0;
+        uint16_t addressLength = address.byteAddressType == 3 ? 1 + byteLength : byteLength;
+        if (out.size() < 1u + addressLength + 2)
+            return 0;
+
+        uint16_t length = 0;
+        out[length++] = address.byteAddressType;
+        if (address.byteAddressType == 3)
+            out[length++] = (uint8_t)byteLength;
+        for (uint16_t i = 0; i < byteLength; i++)
+            out[length++] = address.bytes[i];
+        storeNetwork16(&out[length], address.usPort);
+        return length + 2;
+    }
+
+    /**
+     * Encode command request.
+     * @param out buffer.
+     * @param command command.
+     * @param address destination address.
+     * @return length of message or 0 if it doesn`t fit in buffer.
+     */
+    constexpr uint16_t encodeRequest(std::span<uint8_t> out, PROXY_MODE command, const Address& address)
+    {
+        if (out.size() < 3)
+            return 0;
+        out[0] = 0x05;
+        out[1] = static_cast<uint8_t>(command);
+        out[2] = 0;
+        uint16_t addressLength = encodeAddress(out.subspan(3), address);
+        return addressLength != 0 ? 3 + addressLength : 0;
+    }
+
+    /**
+     * Encode UDP datagram header with IPv4 address.
+     * @param host IPv4 address (binary format).
+     * @param port port (network byte order).
+     * @param fragment FRAG field.
+     * @return header of size known at compile time.
+     */
+    constexpr std::array<uint8_t, UDP_IPV4_HEADER_SIZE> encodeUdpHeaderIPv4(uint32_t host, uint16_t port, uint8_t fragment = 0)
+    {
+        std::array<uint8_t, UDP_IPV4_HEADER_SIZE> header = { 0, 0, fragment, 1 };
+        storeNetwork32(&header[4], host);
+        storeNetwork16(&header[8], port);
+        return header;
+    }
+
+    /**
+     * Encode UDP datagram header with address of any type.
+     * @param out buffer.
+     * @param fragment FRAG field.
+     * @param address destination address.
+     * @return length of header or 0 if it doesn`t fit in buffer.
+     */
+    constexpr uint16_t encodeUdpHeader(std::span<uint8_t> out, uint8_t fragment, const Address& address)
+    {
+        if (out.size() < 3)
+            return 0;
+        out[0] = 0; // reserved
+        out[1] = 0;
+        out[2] = fragment;
+        uint16_t addressLength = encodeAddress(out.subspan(3), address);
+        return addressLength != 0 ? 3 + addressLength : 0;
+    }
+
+    /**
+     * Parse address (ATYP, address, port).
+     * @param in bytes.
+     * @return view of address.
+     */
+    constexpr AddressView parseAddress(std::span<const uint8_t> in)
+    {
+        AddressView address = { PARSE_STATUS::INCOMPLETE, 0, 0, 0, 0, 1 };
+        if (in.size() < 1)
+            return address;
+
+        uint16_t offset = 1;
+        address.byteAddressType = in[0];
+        switch (in[0])
+        {
+        case 1:
+            address.byteLength = 4;
+            break;
+        case 3:
+            if (in.size() < 2)
+            {
+                address.length = 2;
+                return address;
+            }
+            address.byteLength = in[1];
+            offset++;
+            break;
+        case 4:
+            address.byteLength = 16;
+            break;
+        default:
+            address.status = PARSE_STATUS::INVALID;
+            return address;
+        }
+        address.length = offset + address.byteLength + 2;
+        if (in.size() < address.length)
+            return address;
+
+        address.status = PARSE_STATUS::OK;
+        address.bytes = &in[offset];
+        address.usPort = loadNetwork16(&in[offset + address.byteLength]);
+        return address;
+    }
+
+    /**
+     * Copy address from view.
+     * @param view parsed address.
+     * @param address pointer to address for write.
+     */
+    constexpr void copyAddress(const AddressView& view, Address* address)
+    {
+        address->byteAddressType = view.byteAddressType;
+        address->byteLength = view.byteLength;
+        for (uint16_t i = 0; i < view.byteLength; i++)
+            address->bytes[i] = view.bytes[i];
+        address->usPort = view.usPort;
+    }
+
+    /**
+     * Parse reply of greeting.
+     * @param in bytes.
+     * @return selected method.
+     */
+    constexpr MethodReply parseMethodReply(std::span<const uint8_t> in)
+    {
+        if (in.size() < 2)
+            return { PARSE_STATUS::INCOMPLETE, 0, 2 };
+        if (in[0] != 0x05)
+            return { PARSE_STATUS::INVALID, 0, 2 };
+        return { PARSE_STATUS::OK, in[1], 2 };
+    }
+
+    /**
+     * Parse reply of username/password request (RFC 1929).
+     * @param in bytes.
+     * @return status of sign in.
+     */
+    constexpr AuthReply parseAuthReply(std::span<const uint8_t> in)
+    {
+        if (in.size() < 2)
+            return { PARSE_STATUS::INCOMPLETE, 0, 2 };
+        if (in[0] != 0x01)
+            return { PARSE_STATUS::INVALID, 0, 2 };
+        return { PARSE_STATUS::OK, in[1], 2 };
+    }
+
+    /**
+     * Parse reply of command. Reply has variable length, so INCOMPLETE result gives whole length
+     * when first 5 bytes are parsed. Error reply is OK after first 5 bytes, its bound address isn`t
+     * parsed (status of address is INVALID), because servers often send it with zero or short address.
+     * @param in bytes.
+     * @return reply code and bound address.
+     */
+    constexpr CommandReply parseCommandReply(std::span<const uint8_t> in)
+    {
+        CommandReply reply = { PARSE_STATUS::INCOMPLETE, 0, {}, 5 };
+        if (in.size() < 5)
+            return reply;
+        if (in[0] != 0x05)
+        {
+            reply.status = PARSE_STATUS::INVALID;
+            return reply;
+        }
+        reply.reply = in[1];
+        if (reply.reply != 0x00)
+        {
+            reply.status = PARSE_STATUS::OK;
+            reply.bound.status = PARSE_STATUS::INVALID;
+            return reply;
+        }
+        reply.bound = parseAddress(in.subspan(3));
+        reply.status = reply.bound.status;
+        reply.length = 3 + reply.bound.length;
+        return reply;
+    }
+
+    /**
+     * Parse header of UDP datagram.
+     * @param in bytes.
+     * @return fragment, source address and length of header.
+     */
+    constexpr UDPHeader parseUdpHeader(std::span<const uint8_t> in)
+    {
+        UDPHeader header = { PARSE_STATUS::INCOMPLETE, 0, {}, UDP_IPV4_HEADER_SIZE };
+        if (in.size() < 4)
+            return header;
+        header.fragment = in[2];
+        header.address = parseAddress(in.subspan(3));
+        header.status = header.address.status;
+        header.length = 3 + header.address.length;
+        return header;
+    }
+}
+
+#endif
@@ -0,0 +1,331 @@
+#include "udpdemultiplexer.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// initial count of slots of table, it is doubled when table is half full
+#define DEMUX_TABLE_SIZE 64
+
+DatagramRing::DatagramRing(uint32_t capacity, uint32_t slotSize) : slotSize(slotSize)
+{
+	uint32_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	mask = size - 1;
+	slots.reset(new char[(size_t)size * slotSize]);
+	lengths.reset(new uint32_t[size]);
+}
+
+bool DatagramRing::push(const char* data, uint32_t length)
+{
+	uint32_t position = tail.load(std::memory_order_relaxed);
+	if (length > slotSize || position - head.load(std::memory_order_acquire) > mask)
+		return false;
+
+	uint32_t index = position & mask;
+	memcpy(&slots[(size_t)index * slotSize], data, length);
+	lengths[index] = length;
+	tail.store(position + 1, std::memory_order_seq_cst);
+	// consumer is woken only if it waits, so push doesn`t make syscall otherwise
+	if (waiters.load(std::memory_order_seq_cst) != 0)
+	{
+		signal.fetch_add(1, std::memory_order_release);
+		signal.notify_one();
+	}
+	return true;
+}
+
+int32_t DatagramRing::pop(char* buffer, uint32_t bufferSize)
+{
+	uint32_t position = head.load(std::memory_order_relaxed);
+	if (position == tail.load(std::memory_order_acquire))
+		return -1;
+
+	uint32_t index = position & mask;
+	uint32_t length = lengths[index] < bufferSize ? lengths[index] : bufferSize;
+	memcpy(buffer, &slots[(size_t)index * slotSize], length);
+	head.store(position + 1, std::memory_order_release);
+	return length;
+}
+
+void DatagramRing::wait()
+{
+	// signal is read before check of ring, so push or close() after check changes it and wait returns
+	waiters.fetch_add(1, std::memory_order_seq_cst);
+	uint32_t current = signal.load(std::memory_order_acquire);
+	if (head.load(std::memory_order_relaxed) == tail.load(std::memory_order_seq_cst) && !bClosed.load())
+		signal.wait(current, std::memory_order_acquire);
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void DatagramRing::close()
+{
+	bClosed.store(true);
+	signal.fetch_add(1, std::memory_order_release);
+	signal.notify_all();
+}
+
+UdpDemultiplexer::UdpDemultiplexer(ProxyManager& manager) : manager(manager)
+{
+	flowPointers.reset(new std::atomic<Flow*>[Socks5::DEMUX_FLOW_MAX]);
+	for (uint32_t i = 0; i < Socks5::DEMUX_FLOW_MAX; i++)
+		flowPointers[i].store(0, std::memory_order_relaxed);
+	table.resize(DEMUX_TABLE_SIZE, { 0, 0 });
+	buffer.reset(new char[Socks5::DEMUX_DATAGRAM_MAX]);
+
+	int udpSocket = manager.getUdpSocket();
+	if (udpSocket >= 0)
+		fcntl(udpSocket, F_SETFL, fcntl(udpSocket, F_GETFL, 0) | O_NONBLOCK);
+}
+
+int32_t UdpDemultiplexer::addQueue(const Socks5::Address& source, uint32_t capacity, uint32_t slotSize)
+{
+	if (capacity == 0 || slotSize == 0)
+		return -1;
+	return addFlow(source, Handler(), std::make_unique<DatagramRing>(capacity, slotSize));
+}
+
+int32_t UdpDemultiplexer::addHandler(const Socks5::Address& source, Handler handler)
+{
+	if (!handler)
+		return -1;
+	return addFlow(source, handler, nullptr);
+}
+
+int32_t UdpDemultiplexer::addFlow(const Socks5::Address& source, Handler handler, std::unique_ptr<DatagramRing> ring)
+{
+	Socks5::UDPDatagramView view;
+	view.byteAddressType = source.byteAddressType;
+	view.address = source.bytes;
+	view.addressLength = source.byteLength;
+	view.usPort = source.usPort;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (findFlow(view) != 0)
+		return -1;
+
+	uint32_t index;
+	reclaimFlows();
+	if (!freeFlows.empty())
+	{
+		index = freeFlows.back();
+		freeFlows.pop_back();
+	}
+	else if (flows.size() < Socks5::DEMUX_FLOW_MAX)
+	{
+		index = flows.size();
+		flows.push_back(std::make_unique<Flow>());
+	}
+	else return -1;
+
+	Flow* flow = flows[index].get();
+	flow->source = source;
+	flow->hash = hashSource(source.byteAddressType, source.bytes, source.byteLength, source.usPort);
+	flow->handler = handler;
+	flow->ring = std::move(ring);
+	flow->bActive.store(true);
+	insertSlot(flow->hash, index + 1);
+	flowPointers[index].store(flow, std::memory_order_release);
+	return index;
+}
+
+void UdpDemultiplexer::removeFlow(int32_t flowId)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (flowId < 0 || (uint32_t)flowId >= flows.size() || !flows[flowId]->bActive.load())
+		return;
+
+	Flow* flow = flows[flowId].get();
+	uint32_t mask = table.size() - 1;
+	uint32_t i = flow->hash & mask;
+	while (table[i].flow != (uint32_t)flowId + 1)
+		i = (i + 1) & mask;
+
+	// backward shift deletion: following entries of cluster are moved to freed slot, if their home allows it,
+	// so table doesn`t need tombstones
+	uint32_t j = i;
+	while (true)
+	{
+		j = (j + 1) & mask;
+		if (table[j].flow == 0)
+			break;
+		uint32_t home = table[j].hash & mask;
+		bool bInPlace = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+		if (bInPlace)
+			continue;
+		table[i] = table[j];
+		i = j;
+	}
+	table[i].flow = 0;
+	usedSlots--;
+
+	flow->bActive.store(false);
+	flow->handler = Handler();
+	if (flow->ring)
+		flow->ring->close();
+	removedFlows.push_back(flowId);
+}
+
+void UdpDemultiplexer::reclaimFlows()
+{
+	// consumer counts itself in readers before it checks bActive, so removed flow without readers
+	// isn`t used by any consumer
+	for (size_t i = 0; i < removedFlows.size();)
+	{
+		if (flows[removedFlows[i]]->readers.load() == 0)
+		{
+			freeFlows.push_back(removedFlows[i]);
+			removedFlows[i] = removedFlows.back();
+			removedFlows.pop_back();
+		}
+		else i++;
+	}
+}
+
+int32_t UdpDemultiplexer::dispatch(uint32_t timeout)
+{
+	struct pollfd pollFd;
+	pollFd.fd = manager.getUdpWaitSocket();
+	pollFd.events = POLLIN;
+	pollFd.revents = 0;
+	int32_t result = poll(&pollFd, 1, timeout);
+	if (result < 0)
+		return errno == EINTR ? 0 : -1;
+	if (result == 0)
+		return 0;
+
+	int32_t count = 0;
+	Socks5::UDPDatagramView view;
+	std::lock_guard<std::mutex> lock(mutex);
+	// skipped datagrams are counted in reads too, so dispatch doesn`t hold mutex for ever
+	for (uint32_t reads = 0; reads < Socks5::UDP_BATCH_MAX; reads++)
+	{
+		errno = 0;
+		if (manager.readView(buffer.get(), Socks5::DEMUX_DATAGRAM_MAX, &view) < 0)
+		{
+			// invalid datagram and fragment of incomplete datagram are skipped without error of socket,
+			// closed session fails without errno
+			if (errno != 0 || !manager.isConnected())
+				break;
+			continue;
+		}
+		route(view);
+		count++;
+	}
+	return count;
+}
+
+int32_t UdpDemultiplexer::receive(int32_t flowId, char* buffer, uint16_t bufferSize, bool bWait)
+{
+	if (flowId < 0 || (uint32_t)flowId >= Socks5::DEMUX_FLOW_MAX)
+		return -1;
+	Flow* flow = flowPointers[flowId].load(std::memory_order_acquire);
+	if (flow == 0)
+		return -1;
+
+	// ring of flow isn`t replaced while readers isn`t 0, it is checked only after flow is found active
+	flow->readers.fetch_add(1);
+	int32_t result = -1;
+	if (flow->bActive.load() && flow->ring)
+	{
+		while (true)
+		{
+			result = flow->ring->pop(buffer, bufferSize);
+			if (result >= 0 || !bWait || flow->ring->isClosed())
+				break;
+			flow->ring->wait();
+		}
+	}
+	flow->readers.fetch_sub(1);
+	return result;
+}
+
+Socks5::DemuxStats UdpDemultiplexer::getStats()
+{
+	Socks5::DemuxStats stats;
+	stats.routed = routed.load(std::memory_order_relaxed);
+	stats.unmatched = unmatched.load(std::memory_order_relaxed);
+	stats.overflows = overflows.load(std::memory_order_relaxed);
+	return stats;
+}
+
+uint64_t UdpDemultiplexer::hashSource(uint8_t byteAddressType, const uint8_t* address, uint8_t addressLength, uint16_t usPort)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	uint8_t head[3] = { byteAddressType, (uint8_t)usPort, (uint8_t)(usPort >> 8) };
+	for (uint32_t i = 0; i < sizeof(head); i++)
+		hash = (hash ^ head[i]) * 1099511628211ULL;
+	for (uint32_t i = 0; i < addressLength; i++)
+		hash = (hash ^ address[i]) * 1099511628211ULL;
+	// low bits select slot, so high bits are mixed into them
+	return hash ^ (hash >> 32);
+}
+
+UdpDemultiplexer::Flow* UdpDemultiplexer::findFlow(const Socks5::UDPDatagramView& view)
+{
+	uint64_t hash = hashSource(view.byteAddressType, view.address, view.addressLength, view.usPort);
+	uint32_t mask = table.size() - 1;
+	for (uint32_t i = hash & mask; table[i].flow != 0; i = (i + 1) & mask)
+	{
+		if (table[i].hash != hash)
+			continue;
+		Flow* flow = flows[table[i].flow - 1].get();
+		const Socks5::Address& source = flow->source;
+		if (source.byteAddressType == view.byteAddressType && source.byteLength == view.addressLength &&
+			source.usPort == view.usPort && memcmp(source.bytes, view.address, view.addressLength) == 0)
+			return flow;
+	}
+	return 0;
+}
+
+void UdpDemultiplexer::insertSlot(uint64_t hash, uint32_t flow)
+{
+	if ((usedSlots + 1) * 2 > table.size())
+	{
+		std::vector<Slot> oldTable(table.size() * 2, { 0, 0 });
+		oldTable.swap(table);
+		uint32_t mask = table.size() - 1;
+		for (const Slot& slot : oldTable)
+		{
+			if (slot.flow == 0)
+				continue;
+			uint32_t i = slot.hash & mask;
+			while (table[i].flow != 0)
+				i = (i + 1) & mask;
+			table[i] = slot;
+		}
+	}
+
+	uint32_t mask = table.size() - 1;
+	uint32_t i = hash & mask;
+	while (table[i].flow != 0)
+		i = (i + 1) & mask;
+	table[i].hash = hash;
+	table[i].flow = flow;
+	usedSlots++;
+}
+
+void UdpDemultiplexer::route(const Socks5::UDPDatagramView& view)
+{
+	Flow* flow = findFlow(view);
+	if (flow == 0)
+	{
+		unmatched.fetch_add(1, std::memory_order_relaxed);
+		if (defaultHandler)
+			defaultHandler(view);
+		return;
+	}
+
+	if (flow->ring)
+	{
+		if (!flow->ring->push(view.data, view.dataLength))
+		{
+			overflows.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	else flow->handler(view);
+	routed.fetch_add(1, std::memory_order_relaxed);
+}
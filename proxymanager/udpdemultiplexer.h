@@ -0,0 +1,202 @@
+/******************************************************************************
+ * File: udpdemultiplexer.h
+ * Description: Routing of datagrams of UDP association to per-source handlers and queues.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef UDPDEMULTIPLEXER_H
+#define UDPDEMULTIPLEXER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "proxymanager.h"
+
+namespace Socks5
+{
+    struct DemuxStats
+    {
+        uint64_t    routed;         // datagrams passed to handlers and queues
+        uint64_t    unmatched;      // datagrams from unregistered sources (passed to default handler if it is set)
+        uint64_t    overflows;      // datagrams dropped because queue of flow was full
+    };
+
+    // size of dispatch buffer (datagram with header), it is more than any UDP payload
+    const uint32_t DEMUX_DATAGRAM_MAX = 65535;
+    // maximum count of registered flows of demultiplexer
+    const uint32_t DEMUX_FLOW_MAX = 65536;
+}
+
+/**
+ * @class DatagramRing
+ * Bounded queue of datagrams with one producer and one consumer thread. Slots are preallocated,
+ * producer and consumer don`t lock each other.
+ */
+class DatagramRing
+{
+public:
+    /**
+     * Create ring.
+     * @param capacity count of slots (rounded up to power of two).
+     * @param slotSize maximum length of datagram.
+     */
+    DatagramRing(uint32_t capacity, uint32_t slotSize);
+    DatagramRing(const DatagramRing&) = delete;
+    DatagramRing& operator=(const DatagramRing&) = delete;
+    /**
+     * Copy datagram to ring. Only for producer thread.
+     * @return true if successful, false if ring is full or datagram is longer than slot.
+     */
+    bool push(const char* data, uint32_t length);
+    /**
+     * Copy oldest datagram from ring. Only for consumer thread.
+     * @param buffer buffer.
+     * @param bufferSize size of buffer, datagram is truncated to it.
+     * @return length of datagram or -1 if ring is empty.
+     */
+    int32_t pop(char* buffer, uint32_t bufferSize);
+    /**
+     * Wait until ring isn`t empty or it is closed. Only for consumer thread.
+     */
+    void wait();
+    /**
+     * Close ring and wake consumer waiting in wait().
+     */
+    void close();
+    /**
+     * Checks that ring was closed.
+     * @return true if closed.
+     */
+    bool isClosed() { return bClosed.load(); }
+
+private:
+    uint32_t mask;
+    uint32_t slotSize;
+    std::unique_ptr<char[]> slots;
+    std::unique_ptr<uint32_t[]> lengths;
+    // positions are on own cache lines, so producer and consumer don`t share line
+    alignas(64) std::atomic<uint32_t> head{ 0 };    // written by consumer
+    alignas(64) std::atomic<uint32_t> tail{ 0 };    // written by producer
+    // consumer waits for change of signal, producer changes it only if consumer waits
+    std::atomic<uint32_t> signal{ 0 };
+    std::atomic<uint32_t> waiters{ 0 };
+    std::atomic<bool> bClosed{ false };
+};
+
+/**
+ * @class UdpDemultiplexer
+ * Routes datagrams of UDP association by their source (address type, address and port) to handlers
+ * or to queues of flows. Sources are kept in open addressing hash table, so routing of datagram costs
+ * one hash lookup. Datagrams are read by one dispatch thread (dispatch()), every queue is read by
+ * one consumer thread (receive()) without locks.
+ * @note Relay socket of association is switched to non-blocking mode.
+ */
+class UdpDemultiplexer
+{
+public:
+    typedef std::function<void(const Socks5::UDPDatagramView& view)> Handler;
+
+    /**
+     * Create demultiplexer of association.
+     * @param manager connected session in UDP_ASSOCIATE mode, must live longer than demultiplexer.
+     */
+    UdpDemultiplexer(ProxyManager& manager);
+    UdpDemultiplexer(const UdpDemultiplexer&) = delete;
+    UdpDemultiplexer& operator=(const UdpDemultiplexer&) = delete;
+    /**
+     * Register queue for datagrams from source. Thread-safe.
+     * @param source source address (usPort in network byte order as in ProxyManager::makeAddress()).
+     * @param capacity count of datagrams, which queue keeps.
+     * @param slotSize maximum length of datagram in queue, longer datagrams are dropped.
+     * @return id of flow or -1 if source is already registered or there are too many flows.
+     */
+    int32_t addQueue(const Socks5::Address& source, uint32_t capacity, uint32_t slotSize = 2048);
+    /**
+     * Register handler of datagrams from source. Handler is called by dispatch thread, it must not add
+     * or remove flows. Thread-safe.
+     * @param source source address (usPort in network byte order).
+     * @param handler handler, view points to data inside of dispatch buffer.
+     * @return id of flow or -1 if source is already registered or there are too many flows.
+     */
+    int32_t addHandler(const Socks5::Address& source, Handler handler);
+    /**
+     * Unregister flow and wake its consumer (receive() returns -1). Thread-safe. Id of flow can be given
+     * to new flow after consumer leaves receive(), so consumer must not call receive() with it any more.
+     * @param flowId id of flow.
+     */
+    void removeFlow(int32_t flowId);
+    /**
+     * Set handler of datagrams from unregistered sources (they are dropped without it).
+     * Must not be called while dispatch() is running.
+     * @param handler handler.
+     */
+    void setDefaultHandler(Handler handler) { defaultHandler = handler; }
+    /**
+     * Read received datagrams (no more than Socks5::UDP_BATCH_MAX) and route them. Only for one dispatch thread.
+     * @param timeout timeout (in mseconds) of waiting for first datagram.
+     * @return count of read datagrams or -1 if error.
+     */
+    int32_t dispatch(uint32_t timeout);
+    /**
+     * Take datagram from queue of flow. Only for one consumer thread of flow.
+     * @param flowId id of flow.
+     * @param buffer buffer.
+     * @param bufferSize size of buffer.
+     * @param bWait wait until datagram is received (or flow is removed).
+     * @return length of datagram or -1 if queue is empty or flow isn`t queue.
+     */
+    int32_t receive(int32_t flowId, char* buffer, uint16_t bufferSize, bool bWait = false);
+    /**
+     * Gets counters of demultiplexer.
+     * @return counters.
+     */
+    Socks5::DemuxStats getStats();
+
+private:
+    struct Flow
+    {
+        Socks5::Address source;
+        uint64_t hash;
+        Handler handler;
+        std::unique_ptr<DatagramRing> ring;
+        std::atomic<bool> bActive;
+        std::atomic<uint32_t> readers{ 0 };   // consumers inside of receive()
+    };
+
+    // slot of table, flow is 0 for empty slot
+    struct Slot
+    {
+        uint64_t hash;
+        uint32_t flow;  // index of flow + 1
+    };
+
+    static uint64_t hashSource(uint8_t byteAddressType, const uint8_t* address, uint8_t addressLength, uint16_t usPort);
+    int32_t addFlow(const Socks5::Address& source, Handler handler, std::unique_ptr<DatagramRing> ring);
+    Flow* findFlow(const Socks5::UDPDatagramView& view);
+    void insertSlot(uint64_t hash, uint32_t flow);
+    void route(const Socks5::UDPDatagramView& view);
+    void reclaimFlows();
+
+    ProxyManager& manager;
+    std::mutex mutex;   // taken by registration and by dispatch()
+    // flows aren`t freed until destruction, removed flows are reused
+    std::vector<std::unique_ptr<Flow>> flows;
+    // consumers find flows by id without lock
+    std::unique_ptr<std::atomic<Flow*>[]> flowPointers;
+    std::vector<uint32_t> freeFlows;
+    // removed flows wait here until their consumers leave receive(), so ring isn`t freed under them
+    std::vector<uint32_t> removedFlows;
+    std::vector<Slot> table;
+    uint32_t usedSlots = 0;
+    Handler defaultHandler;
+    std::unique_ptr<char[]> buffer;
+
+    std::atomic<uint64_t> routed{ 0 };
+    std::atomic<uint64_t> unmatched{ 0 };
+    std::atomic<uint64_t> overflows{ 0 };
+};
+
+#endif
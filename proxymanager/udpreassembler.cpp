@@ -0,0 +1,116 @@
+#include "udpreassembler.h"
+#include <string.h>
+#include <time.h>
+
+UdpReassembler::~UdpReassembler()
+{
+	release();
+}
+
+bool UdpReassembler::init(uint32_t slotCount, uint32_t maxMessageSize, uint32_t timeout)
+{
+	release();
+	if (slotCount == 0 || maxMessageSize == 0)
+		return false;
+
+	slots = new Slot[slotCount];
+	buffers = new char[(size_t)slotCount * maxMessageSize];
+	for (uint32_t i = 0; i < slotCount; i++)
+		slots[i].bUsed = false;
+	this->slotCount = slotCount;
+	this->maxMessageSize = maxMessageSize;
+	this->timeout = timeout;
+	nextSlot = 0;
+	return true;
+}
+
+void UdpReassembler::release()
+{
+	delete[] slots;
+	delete[] buffers;
+	slots = 0;
+	buffers = 0;
+	slotCount = 0;
+}
+
+uint64_t UdpReassembler::monotonicTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+UdpReassembler::Slot* UdpReassembler::takeSlot(uint64_t now)
+{
+	// free or expired slot is preferred, else the oldest slot of ring is taken
+	for (uint32_t i = 0; i < slotCount; i++)
+	{
+		Slot* slot = &slots[(nextSlot + i) % slotCount];
+		if (!slot->bUsed || now - slot->startTime >= timeout)
+		{
+			if (slot->bUsed)
+				stats.abandoned++;
+			nextSlot = (nextSlot + i + 1) % slotCount;
+			return slot;
+		}
+	}
+	Slot* slot = &slots[nextSlot];
+	nextSlot = (nextSlot + 1) % slotCount;
+	stats.evicted++;
+	return slot;
+}
+
+int32_t UdpReassembler::add(const uint8_t* source, uint16_t sourceLength, uint8_t fragment, const char* data, uint32_t length, const char** message)
+{
+	uint8_t position = fragment & ~Socks5::FRAGMENT_END;
+	if (slots == 0 || position == 0 || sourceLength > sizeof(Slot::source))
+		return -1;
+
+	uint64_t now = monotonicTime();
+	Slot* slot = 0;
+	for (uint32_t i = 0; i < slotCount; i++)
+	{
+		if (slots[i].bUsed && slots[i].sourceLength == sourceLength && memcmp(slots[i].source, source, sourceLength) == 0)
+		{
+			slot = &slots[i];
+			break;
+		}
+	}
+
+	// sequence is abandoned by expired timer or by FRAG, which isn`t next
+	if (slot != 0 && (now - slot->startTime >= timeout || position != slot->lastFragment + 1))
+	{
+		slot->bUsed = false;
+		slot = 0;
+		stats.abandoned++;
+	}
+	if (slot == 0)
+	{
+		if (position != 1)
+			return -1;
+		slot = takeSlot(now);
+		memcpy(slot->source, source, sourceLength);
+		slot->sourceLength = sourceLength;
+		slot->length = 0;
+		slot->startTime = now;
+		slot->bUsed = true;
+	}
+
+	char* buffer = buffers + (size_t)(slot - slots) * maxMessageSize;
+	if (slot->length + length > maxMessageSize)
+	{
+		slot->bUsed = false;
+		stats.abandoned++;
+		return -1;
+	}
+	memcpy(buffer + slot->length, data, length);
+	slot->length += length;
+	slot->lastFragment = position;
+
+	if (!(fragment & Socks5::FRAGMENT_END))
+		return 0;
+	slot->bUsed = false;
+	stats.completed++;
+	*message = buffer;
+	return slot->length;
+}
@@ -0,0 +1,94 @@
+/******************************************************************************
+ * File: udpreassembler.h
+ * Description: Reassembly of fragmented UDP datagrams of UDP_ASSOCIATE mode (RFC 1928 FRAG field).
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef UDPREASSEMBLER_H
+#define UDPREASSEMBLER_H
+
+#include <stdint.h>
+
+namespace Socks5
+{
+    // RFC 1928: reassembly timer must be no less than 5 seconds
+    const uint32_t FRAGMENT_TIMEOUT = 5000;
+    // high-order bit of FRAG marks end of fragment sequence
+    const uint8_t FRAGMENT_END = 0x80;
+    const uint8_t FRAGMENT_MAX = 127;
+
+    struct ReassemblyStats
+    {
+        uint64_t    completed;  // reassembled datagrams
+        uint64_t    abandoned;  // sequences dropped by timer, lower or skipped FRAG or overflow
+        uint64_t    evicted;    // sequences dropped because all slots were busy
+    };
+}
+
+/**
+ * @class UdpReassembler
+ * Reassembly queues keyed by source address. Every queue is slot of preallocated ring, so fragments
+ * are copied without allocation and memory is bounded by count of slots and maximum size of datagram.
+ * @note Not thread-safe, as UDP path of ProxyManager.
+ */
+class UdpReassembler
+{
+public:
+    UdpReassembler() {}
+    ~UdpReassembler();
+    UdpReassembler(const UdpReassembler&) = delete;
+    UdpReassembler& operator=(const UdpReassembler&) = delete;
+    /**
+     * Allocate slots.
+     * @param slotCount count of sources which are reassembled at once.
+     * @param maxMessageSize maximum size of reassembled datagram.
+     * @param timeout reassembly timer in mseconds.
+     * @return true if successful.
+     */
+    bool init(uint32_t slotCount, uint32_t maxMessageSize, uint32_t timeout);
+    /**
+     * Free slots.
+     */
+    void release();
+    bool isActive() { return slots != 0; }
+    /**
+     * Add fragment.
+     * @param source packed source address (ATYP, address, port) of datagram header.
+     * @param sourceLength length of packed source address.
+     * @param fragment FRAG field of datagram header (not 0).
+     * @param data data of fragment.
+     * @param length length of data of fragment.
+     * @param message pointer to variable for write pointer to reassembled datagram. It is valid until next add().
+     * @return length of reassembled datagram, 0 if datagram isn`t complete, -1 if fragment was dropped.
+     */
+    int32_t add(const uint8_t* source, uint16_t sourceLength, uint8_t fragment, const char* data, uint32_t length, const char** message);
+    /**
+     * Gets counters of reassembly.
+     * @return counters.
+     */
+    Socks5::ReassemblyStats getStats() { return stats; }
+
+private:
+    struct Slot
+    {
+        uint8_t source[262];
+        uint16_t sourceLength;
+        uint8_t lastFragment;
+        bool bUsed;
+        uint32_t length;
+        uint64_t startTime;
+    };
+
+    static uint64_t monotonicTime();
+    Slot* takeSlot(uint64_t now);
+
+    Slot* slots = 0;
+    char* buffers = 0;
+    uint32_t slotCount = 0;
+    uint32_t maxMessageSize = 0;
+    uint32_t timeout = 0;
+    uint32_t nextSlot = 0;
+    Socks5::ReassemblyStats stats = { 0, 0, 0 };
+};
+
+#endif
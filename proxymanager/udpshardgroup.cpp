@@ -0,0 +1,144 @@
+#include "udpshardgroup.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+UdpShardGroup::UdpShardGroup(uint32_t shardCount, bool bPinned)
+{
+	// shards are pinned to CPUs allowed for process
+	std::vector<int32_t> cpus;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		}
+	}
+	if (shardCount == 0)
+		shardCount = cpus.empty() ? 1 : cpus.size();
+
+	for (uint32_t i = 0; i < shardCount; i++)
+	{
+		std::unique_ptr<Socks5::UdpShard> shard(new Socks5::UdpShard());
+		shard->index = i;
+		shard->cpu = bPinned && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+		shard->localSocket = -1;
+		shards.push_back(std::move(shard));
+	}
+}
+
+UdpShardGroup::~UdpShardGroup()
+{
+	stop();
+}
+
+bool UdpShardGroup::connect(std::string ip, uint16_t port, std::string user, std::string password,
+	Socks5::UDP_BACKEND backend, Socks5::PROXY_ERROR* error)
+{
+	for (std::unique_ptr<Socks5::UdpShard>& shard : shards)
+	{
+		if (!shard->manager.connectToProxy(ip, port, user, password, Socks5::PROXY_MODE::UDP_ASSOCIATE))
+		{
+			if (error != 0)
+				*error = shard->manager.lastErrorCode();
+			return false;
+		}
+		shard->manager.setUdpBackend(backend);
+	}
+	return true;
+}
+
+bool UdpShardGroup::bindLocal(const struct sockaddr* address, socklen_t addressLength)
+{
+	for (std::unique_ptr<Socks5::UdpShard>& shard : shards)
+	{
+		if (shard->localSocket >= 0)
+			close(shard->localSocket);
+		shard->localSocket = socket(address->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+		int reuse = 1;
+		if (shard->localSocket < 0 ||
+			setsockopt(shard->localSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0 ||
+			bind(shard->localSocket, address, addressLength) != 0)
+		{
+			if (shard->localSocket >= 0)
+				close(shard->localSocket);
+			shard->localSocket = -1;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool UdpShardGroup::start(std::function<void(Socks5::UdpShard*)> setup)
+{
+	if (!workers.empty())
+		return false;
+
+	bStopping = false;
+	for (std::unique_ptr<Socks5::UdpShard>& shard : shards)
+	{
+		if (!shard->loop.isValid())
+			return false;
+		workers.push_back(std::thread(&UdpShardGroup::workerThread, this, shard.get(), setup));
+	}
+	return true;
+}
+
+void UdpShardGroup::stop()
+{
+	bStopping = true;
+	for (std::unique_ptr<Socks5::UdpShard>& shard : shards)
+		shard->loop.stop();
+	for (std::thread& worker : workers)
+		worker.join();
+	workers.clear();
+
+	for (std::unique_ptr<Socks5::UdpShard>& shard : shards)
+	{
+		shard->manager.closeConnection();
+		if (shard->localSocket >= 0)
+		{
+			close(shard->localSocket);
+			shard->localSocket = -1;
+		}
+	}
+}
+
+uint32_t UdpShardGroup::shardOf(uint32_t host, uint16_t port)
+{
+	// multiplicative hash spreads neighbour addresses
+	uint64_t key = ((uint64_t)host << 16) | port;
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) % shards.size();
+}
+
+void UdpShardGroup::workerThread(Socks5::UdpShard* shard, std::function<void(Socks5::UdpShard*)> setup)
+{
+	if (shard->cpu >= 0)
+	{
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(shard->cpu, &cpuSet);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+	}
+
+	// buffers are touched first by pinned thread, so their pages are local to its CPU
+	if (!shard->buffers)
+		shard->buffers.reset(new char[Socks5::UDP_BATCH_MAX * Socks5::SHARD_BUFFER_SIZE]);
+	for (uint32_t i = 0; i < Socks5::UDP_BATCH_MAX; i++)
+	{
+		shard->messages[i].data = shard->buffers.get() + i * Socks5::SHARD_BUFFER_SIZE;
+		shard->messages[i].dataLength = Socks5::SHARD_BUFFER_SIZE;
+	}
+
+	if (setup)
+		setup(shard);
+	while (!bStopping)
+	{
+		if (shard->loop.runOnce(-1) < 0)
+			break;
+	}
+}
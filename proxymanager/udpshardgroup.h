@@ -0,0 +1,107 @@
+/******************************************************************************
+ * File: udpshardgroup.h
+ * Description: UDP_ASSOCIATE sessions sharded across pinned worker threads.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef UDPSHARDGROUP_H
+#define UDPSHARDGROUP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "proxymanager.h"
+#include "eventloop.h"
+
+namespace Socks5
+{
+    // size of each datagram buffer of shard
+    const uint32_t SHARD_BUFFER_SIZE = 2048;
+
+    /**
+     * Shard of UdpShardGroup. All members are used only by worker thread of shard.
+     */
+    struct alignas(64) UdpShard
+    {
+        uint32_t                index;
+        int32_t                 cpu;            // -1 if worker isn`t pinned
+        ProxyManager            manager;        // own UDP association
+        EventLoop               loop;
+        int                     localSocket;    // SO_REUSEPORT socket of bindLocal() or -1
+        UDPMessage              messages[UDP_BATCH_MAX];
+        std::unique_ptr<char[]> buffers;        // UDP_BATCH_MAX * SHARD_BUFFER_SIZE, allocated by worker thread
+    };
+}
+
+/**
+ * @class UdpShardGroup
+ * Spreads UDP relay traffic over several worker threads. Every shard has own UDP association
+ * (and so own UDP socket), event loop, buffers and optional local socket bound with SO_REUSEPORT,
+ * so shards don`t share locks or cache lines and kernel spreads local flows between them.
+ */
+class UdpShardGroup
+{
+public:
+    /**
+     * Create group.
+     * @param shardCount count of shards, 0 is count of CPUs.
+     * @param bPinned pin worker threads to CPUs.
+     */
+    UdpShardGroup(uint32_t shardCount = 0, bool bPinned = true);
+    ~UdpShardGroup();
+    UdpShardGroup(const UdpShardGroup&) = delete;
+    UdpShardGroup& operator=(const UdpShardGroup&) = delete;
+    /**
+     * Create UDP association of every shard.
+     * @param ip IP address of proxy server.
+     * @param port port of proxy server.
+     * @param user login of proxy server or empty string if proxy without auth
+     * @param password password of proxy server or empty string if proxy without auth
+     * @param backend backend of UDP relay of shards.
+     * @param error pointer to variable for write error code (can be 0).
+     * @return true if all associations were created.
+     */
+    bool connect(std::string ip, uint16_t port, std::string user, std::string password,
+        Socks5::UDP_BACKEND backend = Socks5::UDP_BACKEND::SYSCALL, Socks5::PROXY_ERROR* error = 0);
+    /**
+     * Open local UDP socket of every shard bound to the same address with SO_REUSEPORT.
+     * Kernel spreads local flows between shards by hash of addresses.
+     * @param address local address.
+     * @param addressLength length of address.
+     * @return true if successful.
+     */
+    bool bindLocal(const struct sockaddr* address, socklen_t addressLength);
+    /**
+     * Start worker threads. Setup is called by every worker thread before its loop is run,
+     * so it adds session (manager) and local socket with its callbacks to loop of shard.
+     * @param setup setup of shard.
+     * @return true if successful.
+     */
+    bool start(std::function<void(Socks5::UdpShard*)> setup);
+    /**
+     * Stop worker threads and close associations and local sockets.
+     */
+    void stop();
+    uint32_t getShardCount() { return shards.size(); }
+    Socks5::UdpShard* getShard(uint32_t index) { return shards.at(index).get(); }
+    /**
+     * Gets shard of flow, so datagrams of one flow are handled by one shard in order.
+     * @param host IPv4 address of flow in network byte order.
+     * @param port port of flow.
+     * @return index of shard.
+     */
+    uint32_t shardOf(uint32_t host, uint16_t port);
+
+private:
+    void workerThread(Socks5::UdpShard* shard, std::function<void(Socks5::UdpShard*)> setup);
+
+    std::vector<std::unique_ptr<Socks5::UdpShard>> shards;
+    std::vector<std::thread> workers;
+    std::atomic<bool> bStopping{ false };
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "udptracer.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// error queue is drained by this count of reads per send call at most
+#define TRACE_DRAIN_MAX 64
+
+struct TraceRing
+{
+	Socks5::TraceRecord records[Socks5::TRACE_RING_SIZE];
+	std::atomic<uint64_t> position{ 0 };
+	uint32_t threadId = 0;
+};
+
+// control buffer is big enough for timestamps and extended error of error queue
+union ControlBuffer
+{
+	char buffer[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	struct cmsghdr align;
+};
+
+static std::mutex registryMutex;
+// rings aren`t freed, so records of finished threads stay for dump
+static std::vector<std::unique_ptr<TraceRing>> rings;
+static thread_local TraceRing* threadRing = 0;
+static thread_local ControlBuffer controlBuffers[Socks5::TRACE_CONTROL_BUFFERS];
+
+static uint64_t timestampNanos(const struct msghdr* msg)
+{
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR((struct msghdr*)msg); cmsg != 0; cmsg = CMSG_NXTHDR((struct msghdr*)msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			// software timestamp is the first one
+			struct scm_timestamping timestamps;
+			memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+			return (uint64_t)timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+		}
+	}
+	return 0;
+}
+
+void UdpTracer::record(Socks5::TRACE_EVENT type, uint64_t start, uint64_t end, uint32_t value)
+{
+	if (threadRing == 0)
+	{
+		std::unique_ptr<TraceRing> ring(new TraceRing());
+		ring->threadId = syscall(SYS_gettid);
+		threadRing = ring.get();
+		std::lock_guard<std::mutex> lock(registryMutex);
+		rings.push_back(std::move(ring));
+	}
+
+	uint64_t position = threadRing->position.load(std::memory_order_relaxed);
+	Socks5::TraceRecord& record = threadRing->records[position & (Socks5::TRACE_RING_SIZE - 1)];
+	record.start = start;
+	record.duration = end > start ? end - start : 0;
+	record.value = value;
+	record.type = type;
+	threadRing->position.store(position + 1, std::memory_order_release);
+}
+
+std::string UdpTracer::chromeTrace()
+{
+	static const char* names[] = { "send-to-wire", "wire-to-read" };
+	static const char* valueNames[] = { "id", "bytes" };
+	std::string json = "{\"traceEvents\":[";
+	bool bFirst = true;
+	std::lock_guard<std::mutex> lock(registryMutex);
+	for (const std::unique_ptr<TraceRing>& ring : rings)
+	{
+		uint64_t end = ring->position.load(std::memory_order_acquire);
+		uint64_t begin = end > Socks5::TRACE_RING_SIZE ? end - Socks5::TRACE_RING_SIZE : 0;
+		for (uint64_t i = begin; i < end; i++)
+		{
+			const Socks5::TraceRecord& record = ring->records[i & (Socks5::TRACE_RING_SIZE - 1)];
+			uint32_t type = static_cast<uint32_t>(record.type);
+			char event[256];
+			// trace-event time is in useconds
+			snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"cat\":\"udp\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+				"\"pid\":%d,\"tid\":%u,\"args\":{\"%s\":%u}}", bFirst ? "" : ",", names[type],
+				(unsigned long long)(record.start / 1000), (unsigned long long)(record.start % 1000),
+				(unsigned long long)(record.duration / 1000), (unsigned long long)(record.duration % 1000),
+				(int)getpid(), ring->threadId, valueNames[type], record.value);
+			json += event;
+			bFirst = false;
+		}
+	}
+	json += "],\"displayTimeUnit\":\"ns\"}";
+	return json;
+}
+
+bool UdpTracer::dumpChromeTrace(const std::string& path)
+{
+	std::string json = chromeTrace();
+	FILE* file = fopen(path.c_str(), "w");
+	if (file == 0)
+		return false;
+	bool bWritten = fwrite(json.data(), 1, json.size(), file) == json.size();
+	return fclose(file) == 0 && bWritten;
+}
+
+uint64_t UdpTracer::now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool UdpTracePolicy<true>::enable(int socketFd, bool bEnable)
+{
+	// OPT_ID numbers sent datagrams from 0, OPT_TSONLY doesn`t loop datagram back with TX timestamp
+	int flags = bEnable ? (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY) : 0;
+	if (setsockopt(socketFd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+		return false;
+	sendSequence.store(0, std::memory_order_relaxed);
+	bEnabled.store(bEnable, std::memory_order_relaxed);
+	return true;
+}
+
+void UdpTracePolicy<true>::prepareReceive(struct msghdr* msg, uint32_t index)
+{
+	if (!isEnabled() || index >= Socks5::TRACE_CONTROL_BUFFERS)
+		return;
+	msg->msg_control = controlBuffers[index].buffer;
+	msg->msg_controllen = sizeof(controlBuffers[index].buffer);
+}
+
+void UdpTracePolicy<true>::finishReceive(const struct msghdr* msg, int32_t length)
+{
+	if (length < 0 || msg->msg_control == 0)
+		return;
+	uint64_t wireTime = timestampNanos(msg);
+	if (wireTime != 0)
+		UdpTracer::record(Socks5::TRACE_EVENT::WIRE_TO_READ, wireTime, UdpTracer::now(), length);
+}
+
+void UdpTracePolicy<true>::endSend(int socketFd, uint64_t start, uint32_t count)
+{
+	if (start == 0)
+		return;
+	uint32_t first = sendSequence.fetch_add(count, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < count; i++)
+		sendTimes[(first + i) & (Socks5::TRACE_PENDING_SENDS - 1)].store(start, std::memory_order_relaxed);
+
+	// software TX timestamp is usually queued already, when send call returns
+	for (uint32_t i = 0; i < TRACE_DRAIN_MAX; i++)
+	{
+		ControlBuffer control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		if (recvmsg(socketFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		uint64_t wireTime = timestampNanos(&msg);
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0 && wireTime != 0; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+				(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+			struct sock_extended_err error;
+			memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+			if (error.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || error.ee_info != SCM_TSTAMP_SND)
+				continue;
+			uint64_t sendTime = sendTimes[error.ee_data & (Socks5::TRACE_PENDING_SENDS - 1)].load(std::memory_order_relaxed);
+			if (sendTime != 0)
+				UdpTracer::record(Socks5::TRACE_EVENT::SEND_TO_WIRE, sendTime, wireTime, error.ee_data);
+		}
+	}
+}
@@ -0,0 +1,143 @@
+/******************************************************************************
+ * File: udptracer.h
+ * Description: Tracing of latency of UDP relay socket by kernel timestamps (SO_TIMESTAMPING).
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef UDPTRACER_H
+#define UDPTRACER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+
+// tracing is compiled in by -DSOCKS5_TRACING=1 (make TRACING=1), else its hooks are empty
+#ifndef SOCKS5_TRACING
+#define SOCKS5_TRACING 0
+#endif
+
+namespace Socks5
+{
+    enum class TRACE_EVENT
+    {
+        SEND_TO_WIRE = 0,   // from sendmsg/sendmmsg call to software TX timestamp of kernel
+        WIRE_TO_READ        // from software RX timestamp of kernel to return of read
+    };
+
+    struct TraceRecord
+    {
+        uint64_t    start;      // nseconds of CLOCK_REALTIME
+        uint64_t    duration;   // nseconds
+        uint32_t    value;      // length of datagram for WIRE_TO_READ, id of datagram for SEND_TO_WIRE
+        TRACE_EVENT type;
+    };
+
+    constexpr bool TRACING_ENABLED = SOCKS5_TRACING != 0;
+    // records of each thread, older records are overwritten (power of 2)
+    const uint32_t TRACE_RING_SIZE = 16384;
+    // sent datagrams, which wait for their TX timestamps (power of 2)
+    const uint32_t TRACE_PENDING_SENDS = 1024;
+    // control buffers of one receive call (as UDP_BATCH_MAX)
+    const uint32_t TRACE_CONTROL_BUFFERS = 64;
+}
+
+/**
+ * @class UdpTracer
+ * Per-thread rings of trace records. Every thread writes own ring without locks, rings are kept
+ * after exit of thread until dump.
+ */
+class UdpTracer
+{
+public:
+    /**
+     * Add record to ring of calling thread.
+     * @param type type of event.
+     * @param start start of event (nseconds of CLOCK_REALTIME).
+     * @param end end of event (nseconds of CLOCK_REALTIME).
+     * @param value length or id of datagram.
+     */
+    static void record(Socks5::TRACE_EVENT type, uint64_t start, uint64_t end, uint32_t value);
+    /**
+     * Gets records of all threads as Chrome trace-event JSON (chrome://tracing, Perfetto).
+     * Records, which are written during the call, can be skipped.
+     * @return JSON text.
+     */
+    static std::string chromeTrace();
+    /**
+     * Write chromeTrace() to file.
+     * @param path path of file.
+     * @return true if successful.
+     */
+    static bool dumpChromeTrace(const std::string& path);
+    /**
+     * Gets current time for records.
+     * @return nseconds of CLOCK_REALTIME (clock of kernel timestamps).
+     */
+    static uint64_t now();
+};
+
+/**
+ * @class UdpTracePolicy
+ * Hooks of UDP relay path of ProxyManager. Tracing is chosen at compile time: hooks of disabled policy
+ * are empty inline functions, so they cost nothing.
+ */
+template<bool bCompiled>
+class UdpTracePolicy
+{
+public:
+    bool enable(int /*socketFd*/, bool /*bEnable*/) { return false; }
+    bool isEnabled() { return false; }
+    void prepareReceive(struct msghdr* /*msg*/, uint32_t /*index*/ = 0) {}
+    void finishReceive(const struct msghdr* /*msg*/, int32_t /*length*/) {}
+    uint64_t beginSend() { return 0; }
+    void endSend(int /*socketFd*/, uint64_t /*start*/, uint32_t /*count*/) {}
+};
+
+template<>
+class UdpTracePolicy<true>
+{
+public:
+    /**
+     * Enable or disable software RX and TX timestamps of socket. Thread-safe.
+     * @param socketFd UDP socket.
+     * @param bEnable true to enable.
+     * @return true if successful.
+     */
+    bool enable(int socketFd, bool bEnable);
+    bool isEnabled() { return bEnabled.load(std::memory_order_relaxed); }
+    /**
+     * Attach control buffer of calling thread to message, so RX timestamp is received with datagram.
+     * @param msg message of recvmsg/recvmmsg.
+     * @param index index of message in batch.
+     */
+    void prepareReceive(struct msghdr* msg, uint32_t index = 0);
+    /**
+     * Record WIRE_TO_READ event by RX timestamp of received message.
+     * @param msg received message.
+     * @param length result of receive.
+     */
+    void finishReceive(const struct msghdr* msg, int32_t length);
+    /**
+     * Gets time of send call.
+     * @return nseconds of CLOCK_REALTIME or 0 if tracing is disabled.
+     */
+    uint64_t beginSend() { return isEnabled() ? UdpTracer::now() : 0; }
+    /**
+     * Remember sent datagrams and record SEND_TO_WIRE events of TX timestamps, which are queued by kernel.
+     * @param socketFd UDP socket.
+     * @param start result of beginSend().
+     * @param count count of sent datagrams.
+     */
+    void endSend(int socketFd, uint64_t start, uint32_t count);
+
+private:
+    std::atomic<bool> bEnabled{ false };
+    // datagram id of kernel (SOF_TIMESTAMPING_OPT_ID) is counted by the same rule
+    std::atomic<uint32_t> sendSequence{ 0 };
+    std::atomic<uint64_t> sendTimes[Socks5::TRACE_PENDING_SENDS] = {};
+};
+
+typedef UdpTracePolicy<Socks5::TRACING_ENABLED> UdpTrace;
+
+#endif
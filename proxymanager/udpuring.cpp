@@ -0,0 +1,408 @@
+#include "udpuring.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_RECEIVE_TAG	0xFFFFFFFFFFFFFFFFULL
+#define URING_BUFFER_GROUP	0
+#define URING_SQ_IDLE		1000 // mseconds of idle before kernel thread sleeps
+#define URING_PROBE_WAIT	100  // mseconds to wait while kernel thread takes first receive
+
+UdpUring::~UdpUring()
+{
+	release();
+}
+
+bool UdpUring::init(int socketFd, uint32_t bufferCount, uint32_t bufferSize)
+{
+	release();
+	if (bufferCount == 0 || bufferSize == 0)
+		return false;
+
+	// buffer ring must have power of 2 entries
+	uint32_t count = 1;
+	while (count < bufferCount && count < 32768)
+		count <<= 1;
+	this->socketFd = socketFd;
+	this->bufferCount = count;
+	this->bufferSize = bufferSize;
+
+	// kernel thread polling needs privileges on old kernels, so plain ring is fallback
+	if (!setup(count * 2, true) && !setup(count * 2, false))
+		return false;
+
+	size_t buffersSize = (size_t)count * bufferSize;
+	sendBuffers = (uint8_t*)mmap(NULL, buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	recvBuffers = (uint8_t*)mmap(NULL, buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	bufferRingSize = count * sizeof(struct io_uring_buf);
+	bufferRing = (struct io_uring_buf_ring*)mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sendBuffers == MAP_FAILED || recvBuffers == MAP_FAILED || bufferRing == MAP_FAILED)
+	{
+		if (sendBuffers == MAP_FAILED)
+			sendBuffers = 0;
+		if (recvBuffers == MAP_FAILED)
+			recvBuffers = 0;
+		if (bufferRing == MAP_FAILED)
+			bufferRing = 0;
+		release();
+		return false;
+	}
+
+	struct iovec registered;
+	registered.iov_base = sendBuffers;
+	registered.iov_len = buffersSize;
+	if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &registered, 1) != 0)
+	{
+		release();
+		return false;
+	}
+
+	struct io_uring_buf_reg bufferReg;
+	memset(&bufferReg, 0, sizeof(bufferReg));
+	bufferReg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+	bufferReg.ring_entries = count;
+	bufferReg.bgid = URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &bufferReg, 1) != 0)
+	{
+		release();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		recycleBuffer(i);
+	freeSendSlots.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+		freeSendSlots[i] = count - 1 - i;
+	receivedQueue.resize(count);
+
+	if (!armReceive() || submit() != 0 || !probeReceive())
+	{
+		release();
+		return false;
+	}
+	return true;
+}
+
+bool UdpUring::probeReceive()
+{
+	// kernel without multishot receive rejects it at once, but kernel thread takes request later,
+	// waiters poll descriptor of ring, so ring without receive must not be used at all
+	for (uint32_t i = 0; i < URING_PROBE_WAIT && __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != sqLocalTail; i++)
+		usleep(1000);
+	if (__atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != sqLocalTail)
+		return false;
+	reapCompletions();
+	return !bReceiveUnsupported;
+}
+
+bool UdpUring::setup(uint32_t entries, bool bSqPoll)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if (bSqPoll)
+	{
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQ_IDLE;
+	}
+	ringFd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ringFd < 0)
+		return false;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(ringFd);
+		ringFd = -1;
+		return false;
+	}
+	this->bSqPoll = bSqPoll;
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqRingSize > sqRingSize)
+		sqRingSize = cqRingSize;
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		sqRing = 0;
+		close(ringFd);
+		ringFd = -1;
+		return false;
+	}
+	cqRing = sqRing; // single mmap
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		sqes = 0;
+		munmap(sqRing, sqRingSize);
+		sqRing = 0;
+		close(ringFd);
+		ringFd = -1;
+		return false;
+	}
+
+	uint8_t* sq = (uint8_t*)sqRing;
+	sqHead = (uint32_t*)(sq + params.sq_off.head);
+	sqTail = (uint32_t*)(sq + params.sq_off.tail);
+	sqFlags = (uint32_t*)(sq + params.sq_off.flags);
+	sqArray = (uint32_t*)(sq + params.sq_off.array);
+	sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+	sqLocalTail = *sqTail;
+	pendingSubmit = 0;
+
+	uint8_t* cq = (uint8_t*)cqRing;
+	cqHead = (uint32_t*)(cq + params.cq_off.head);
+	cqTail = (uint32_t*)(cq + params.cq_off.tail);
+	cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return true;
+}
+
+void UdpUring::release()
+{
+	// closing of ring cancels requests, registered memory is pinned by kernel until that
+	if (ringFd >= 0)
+	{
+		close(ringFd);
+		ringFd = -1;
+	}
+	if (sqes)
+		munmap(sqes, sqesSize);
+	if (sqRing)
+		munmap(sqRing, sqRingSize);
+	if (sendBuffers)
+		munmap(sendBuffers, (size_t)bufferCount * bufferSize);
+	if (recvBuffers)
+		munmap(recvBuffers, (size_t)bufferCount * bufferSize);
+	if (bufferRing)
+		munmap(bufferRing, bufferRingSize);
+	sqes = 0;
+	sqRing = 0;
+	cqRing = 0;
+	sendBuffers = 0;
+	recvBuffers = 0;
+	bufferRing = 0;
+	bufferRingTail = 0;
+	freeSendSlots.clear();
+	receivedQueue.clear();
+	receivedHead = 0;
+	receivedCount = 0;
+	bReceiveArmed = false;
+	bReceiveUnsupported = false;
+	sendError = 0;
+}
+
+struct io_uring_sqe* UdpUring::getSqe()
+{
+	if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+	{
+		submit();
+		if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+			return 0;
+	}
+	uint32_t index = sqLocalTail & sqMask;
+	sqArray[index] = index;
+	sqLocalTail++;
+	pendingSubmit++;
+	memset(&sqes[index], 0, sizeof(struct io_uring_sqe));
+	return &sqes[index];
+}
+
+int32_t UdpUring::submit()
+{
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+	if (bSqPoll)
+	{
+		// kernel thread takes requests itself, it must be woken only after idle
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		pendingSubmit = 0;
+		if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			syscall(__NR_io_uring_enter, ringFd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+		return 0;
+	}
+
+	while (pendingSubmit > 0)
+	{
+		int32_t result = syscall(__NR_io_uring_enter, ringFd, pendingSubmit, 0, 0, NULL, 0);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EBUSY) ? 0 : -1;
+		}
+		pendingSubmit -= result;
+	}
+	return 0;
+}
+
+void UdpUring::reapCompletions()
+{
+	uint32_t head = *cqHead;
+	uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		struct io_uring_cqe* cqe = &cqes[head & cqMask];
+		if (cqe->user_data == URING_RECEIVE_TAG)
+		{
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+			{
+				uint32_t index = (receivedHead + receivedCount) & (bufferCount - 1);
+				receivedQueue[index].bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				receivedQueue[index].length = cqe->res;
+				receivedCount++;
+			}
+			else if (cqe->res == -EINVAL)
+				bReceiveUnsupported = true; // kernel without multishot receive
+
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				bReceiveArmed = false;
+		}
+		else
+		{
+			// send is completed after sendv() has returned, so its error is reported by next send
+			if (cqe->res < 0 && sendError == 0)
+				sendError = -cqe->res;
+			freeSendSlots.push_back((uint32_t)cqe->user_data);
+		}
+		head++;
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+bool UdpUring::armReceive()
+{
+	struct io_uring_sqe* sqe = getSqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = socketFd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_RECEIVE_TAG;
+	bReceiveArmed = true;
+	return true;
+}
+
+void UdpUring::recycleBuffer(uint16_t bufferId)
+{
+	// bufs of io_uring_buf_ring has wrong offset in C++ (empty struct has size 1), so entries are indexed directly
+	struct io_uring_buf* buffer = (struct io_uring_buf*)bufferRing + (bufferRingTail & (bufferCount - 1));
+	buffer->addr = (uint64_t)(uintptr_t)(recvBuffers + (size_t)bufferId * bufferSize);
+	buffer->len = bufferSize;
+	buffer->bid = bufferId;
+	bufferRingTail++;
+	__atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+int32_t UdpUring::sendv(const struct iovec* iov, int iovcnt, bool bSubmit)
+{
+	size_t totalLength = 0;
+	for (int i = 0; i < iovcnt; i++)
+		totalLength += iov[i].iov_len;
+
+	reapCompletions();
+	if (sendError != 0)
+	{
+		errno = sendError;
+		sendError = 0;
+		return -1;
+	}
+
+	// datagram bigger than registered buffer goes by plain syscall, single send without kernel thread too
+	// (copy and io_uring_enter cost more than sendmsg), unless it would overtake queued sends
+	if (totalLength > bufferSize || (bSubmit && !bSqPoll && pendingSubmit == 0))
+		return writev(socketFd, iov, iovcnt);
+
+	if (freeSendSlots.empty())
+	{
+		submit();
+		reapCompletions();
+		if (freeSendSlots.empty())
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	struct io_uring_sqe* sqe = getSqe();
+	if (!sqe)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	uint32_t slot = freeSendSlots.back();
+	freeSendSlots.pop_back();
+	uint8_t* buffer = sendBuffers + (size_t)slot * bufferSize;
+	size_t offset = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		memcpy(buffer + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = socketFd;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = totalLength;
+	sqe->buf_index = 0;
+	sqe->user_data = slot;
+
+	if (bSubmit && submit() != 0)
+		return -1;
+	return totalLength;
+}
+
+int32_t UdpUring::recvv(const struct iovec* iov, int iovcnt)
+{
+	reapCompletions();
+	if (receivedCount == 0)
+	{
+		// non-polling ring delivers queued sends and receive arming only by syscall
+		submit();
+		reapCompletions();
+	}
+	if (receivedCount == 0)
+	{
+		if (!bReceiveArmed && armReceive())
+			submit();
+		errno = EAGAIN;
+		return -1;
+	}
+
+	Completion completion = receivedQueue[receivedHead];
+	receivedHead = (receivedHead + 1) & (bufferCount - 1);
+	receivedCount--;
+
+	int32_t copied = 0;
+	if (completion.length > 0)
+	{
+		const uint8_t* data = recvBuffers + (size_t)completion.bufferId * bufferSize;
+		for (int i = 0; i < iovcnt && copied < completion.length; i++)
+		{
+			size_t part = completion.length - copied;
+			if (part > iov[i].iov_len)
+				part = iov[i].iov_len;
+			memcpy(iov[i].iov_base, data + copied, part);
+			copied += part;
+		}
+	}
+	recycleBuffer(completion.bufferId);
+
+	if (!bReceiveArmed && armReceive())
+		submit();
+
+	if (completion.length < 0)
+	{
+		errno = -completion.length;
+		return -1;
+	}
+	return copied;
+}
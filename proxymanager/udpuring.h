@@ -0,0 +1,123 @@
+/******************************************************************************
+ * File: udpuring.h
+ * Description: io_uring backend for UDP relay socket of UDP_ASSOCIATE mode.
+ * Created: 17.10.2026
+ * Author: Logotipo
+******************************************************************************/
+#ifndef UDPURING_H
+#define UDPURING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <vector>
+
+/**
+ * @class UdpUring
+ * io_uring of connected UDP socket. Sends are copied to registered buffers and submitted by kernel thread
+ * (SQPOLL) if it is allowed, datagrams are received by multishot receive to ring of provided buffers.
+ * @note Not thread-safe, as UDP path of ProxyManager.
+ */
+class UdpUring
+{
+public:
+    UdpUring() {}
+    ~UdpUring();
+    UdpUring(const UdpUring&) = delete;
+    UdpUring& operator=(const UdpUring&) = delete;
+    /**
+     * Create ring for socket.
+     * @param socketFd connected UDP socket.
+     * @param bufferCount count of send buffers and count of receive buffers (rounded up to power of 2).
+     * @param bufferSize size of each buffer (maximum size of datagram with header).
+     * @return true if successful, false if kernel doesn`t support needed features (including multishot receive).
+     */
+    bool init(int socketFd, uint32_t bufferCount, uint32_t bufferSize);
+    /**
+     * Cancel I/O and free ring.
+     */
+    void release();
+    bool isActive() { return ringFd >= 0; }
+    /**
+     * Gets descriptor of ring. It is readable when completions are ready.
+     * @return ring descriptor.
+     */
+    int getRingFd() { return ringFd; }
+    /**
+     * Queue datagram gathered from iovecs. Single send (bSubmit) of ring without kernel thread goes by plain
+     * syscall, batches should queue datagrams without submit and call submit() once.
+     * @param iov array of iovecs.
+     * @param iovcnt count of iovecs.
+     * @param bSubmit submit queue now (or let it be submitted by later call).
+     * @return length of queued datagram or -1 if error (errno is EAGAIN if all buffers are busy,
+     * or error of earlier send, which was failed by kernel after it was queued).
+     */
+    int32_t sendv(const struct iovec* iov, int iovcnt, bool bSubmit = true);
+    /**
+     * Take received datagram and scatter it to iovecs.
+     * @param iov array of iovecs.
+     * @param iovcnt count of iovecs.
+     * @return length of datagram or -1 if error (errno is EAGAIN if there is no datagram).
+     */
+    int32_t recvv(const struct iovec* iov, int iovcnt);
+    /**
+     * Submit queued requests.
+     * @return 0 if success, -1 if error.
+     */
+    int32_t submit();
+
+private:
+    struct Completion
+    {
+        uint16_t bufferId;
+        int32_t length;
+    };
+
+    struct io_uring_sqe* getSqe();
+    bool setup(uint32_t entries, bool bSqPoll);
+    void reapCompletions();
+    bool armReceive();
+    bool probeReceive();
+    void recycleBuffer(uint16_t bufferId);
+
+    int ringFd = -1;
+    int socketFd = -1;
+    bool bSqPoll = false;
+
+    void* sqRing = 0;
+    size_t sqRingSize = 0;
+    void* cqRing = 0;
+    size_t cqRingSize = 0;
+    struct io_uring_sqe* sqes = 0;
+    size_t sqesSize = 0;
+    uint32_t* sqHead = 0;
+    uint32_t* sqTail = 0;
+    uint32_t* sqFlags = 0;
+    uint32_t* sqArray = 0;
+    uint32_t sqMask = 0;
+    uint32_t sqEntries = 0;
+    uint32_t sqLocalTail = 0;
+    uint32_t pendingSubmit = 0;
+    uint32_t* cqHead = 0;
+    uint32_t* cqTail = 0;
+    uint32_t cqMask = 0;
+    struct io_uring_cqe* cqes = 0;
+
+    uint32_t bufferCount = 0;
+    uint32_t bufferSize = 0;
+    uint8_t* sendBuffers = 0;
+    uint8_t* recvBuffers = 0;
+    struct io_uring_buf_ring* bufferRing = 0;
+    size_t bufferRingSize = 0;
+    uint16_t bufferRingTail = 0;
+    std::vector<uint32_t> freeSendSlots;
+    std::vector<Completion> receivedQueue;
+    uint32_t receivedHead = 0;
+    uint32_t receivedCount = 0;
+    bool bReceiveArmed = false;
+    bool bReceiveUnsupported = false;
+    int sendError = 0;  // errno of failed send completion, which isn`t reported yet
+};
+
+#endif